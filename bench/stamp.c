@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Times the event timestamp kernels against the C library doing the same
+ * job: strptime and mktime to read Charm's local wall clock text, and
+ * localtime and snprintf to write it.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stamp.h"
+
+/*************************************************************************** constants */
+
+#define BENCH_COUNT 1000000
+#define BENCH_SPAN  (6 * 365 * 86400)
+
+/************************************************************************ declarations */
+
+static double bench_now(void);
+static void   bench_report(const char *, double, double);
+
+/************************************************************************* definitions */
+
+int
+main(int argc, char **argv)
+{
+	int count = 1 < argc ? atoi(argv[1]) : BENCH_COUNT;
+	char (*texts)[STAMP_SIZE];
+	int64_t *epochs;
+	int64_t sum_libc = 0, sum_stamp = 0;
+	char text[72];
+	unsigned seed = 1;
+	int mismatches = 0;
+	double start, libc, stamp;
+	int i;
+
+	texts = malloc(sizeof(*texts) * (size_t) count);
+	epochs = malloc(sizeof(int64_t) * (size_t) count);
+
+	/* Event-like times spread over a few years, DST changes included */
+	for (i = 0; i < count; ++i) {
+		time_t t;
+		struct tm tm;
+
+		seed = seed * 1103515245u + 12345u;
+		t = (time_t) (1420070400 + (int64_t) (seed % BENCH_SPAN));
+		localtime_r(&t, &tm);
+		strftime(texts[i], STAMP_SIZE, "%Y-%m-%dT%H:%M:%S", &tm);
+		epochs[i] = (int64_t) t;
+	}
+
+	start = bench_now();
+	for (i = 0; i < count; ++i) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		strptime(texts[i], "%Y-%m-%dT%H:%M:%S", &tm);
+		tm.tm_isdst = -1;
+		sum_libc += (int64_t) mktime(&tm);
+	}
+	libc = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < count; ++i) {
+		int64_t epoch = 0;
+
+		stamp_epoch(texts[i], STAMP_LENGTH, &epoch);
+		sum_stamp += epoch;
+	}
+	stamp = bench_now() - start;
+	bench_report("parse  strptime+mktime", libc, stamp);
+
+	start = bench_now();
+	for (i = 0; i < count; ++i) {
+		time_t t = (time_t) epochs[i];
+		struct tm tm;
+
+		localtime_r(&t, &tm);
+		snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d",
+		         1900 + tm.tm_year, 1 + tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+		sum_libc += text[18];
+	}
+	libc = bench_now() - start;
+
+	start = bench_now();
+	for (i = 0; i < count; ++i) {
+		stamp_format(stamp_local(epochs[i]), text);
+		sum_stamp += text[18];
+	}
+	stamp = bench_now() - start;
+	bench_report("format localtime+snprintf", libc, stamp);
+
+	/* Repeated wall clock hours are the one place the two may pick differently */
+	for (i = 0; i < count; ++i) {
+		int64_t epoch = 0;
+
+		stamp_epoch(texts[i], STAMP_LENGTH, &epoch);
+		stamp_format(stamp_local(epochs[i]), text);
+		if (0 != strcmp(text, texts[i]) || (epoch != epochs[i] &&
+		    stamp_local(epoch) != stamp_local(epochs[i])))
+			++mismatches;
+	}
+
+	printf("%d timestamps, %d mismatches (checksums %lld %lld)\n", count, mismatches,
+	       (long long) sum_libc, (long long) sum_stamp);
+
+	free(texts);
+	free(epochs);
+
+	return(0 == mismatches ? 0 : 1);
+}
+
+/******************************************************************* local definitions */
+
+double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+void
+bench_report(const char *what, double libc, double stamp)
+{
+	printf("%-26s %8.1f ns  stamp %6.1f ns  %5.1fx\n", what,
+	       libc * 1e9 / BENCH_COUNT, stamp * 1e9 / BENCH_COUNT, libc / stamp);
+}
@@ -0,0 +1,30 @@
+# bash completion for ccharm
+#
+# Source this file from ~/.bashrc or drop it in bash-completion's
+# completions directory.
+
+_ccharm()
+{
+	local cur prev what
+	local IFS=$'\n'
+
+	cur="${COMP_WORDS[COMP_CWORD]}"
+	prev="${COMP_WORDS[COMP_CWORD-1]}"
+
+	case "$prev" in
+	-i|--task-id)            what=ids ;;
+	-b|--bookmark|bookmark)  what=bookmarks ;;
+	-r|--recent)             what=recent ;;
+	tasks)                   what=tasks ;;
+	-C|--charm-db|-D|--federate-db|sync|import-tasks)
+		COMPREPLY=($(compgen -f -- "$cur"))
+		return 0
+		;;
+	*)                       what=commands ;;
+	esac
+
+	COMPREPLY=($(ccharm complete "$what" "$cur" 2>/dev/null | cut -f1))
+	return 0
+}
+
+complete -F _ccharm ccharm
@@ -0,0 +1,26 @@
+# fish completion for ccharm
+#
+# Copy this file to ~/.config/fish/completions/ccharm.fish.
+
+function __ccharm_complete
+	set -l tokens (commandline -opc)
+	set -l what commands
+
+	switch $tokens[-1]
+	case -i --task-id
+		set what ids
+	case -b --bookmark bookmark
+		set what bookmarks
+	case -r --recent
+		set what recent
+	case tasks
+		set what tasks
+	case -C --charm-db -D --federate-db sync import-tasks
+		__fish_complete_path (commandline -ct)
+		return
+	end
+
+	ccharm complete $what (commandline -ct) 2>/dev/null
+end
+
+complete -c ccharm -f -a '(__ccharm_complete)'
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "archive.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "epoch.h"
+#include "session.h"
+
+/*************************************************************************** constants */
+
+/* SQLite attaches ten databases at most, one is the task tree */
+#define ARCHIVE_ATTACHED_MAX 9
+#define ARCHIVE_YEARS_MAX    256
+
+/************************************************************************ declarations */
+
+static void   archive_exec(sqlite3 *, const char *);
+static void   archive_move(int, const char *);
+static size_t archive_stem(const char *);
+static int    archive_year_compare(const void *, const void *);
+
+/************************************************************************* definitions */
+
+void
+archive_events(const char *cutoff)
+{
+	sqlite3_stmt *stmt;
+	int years[ARCHIVE_YEARS_MAX];
+	int years_count = 0;
+	int ret, i;
+
+	const char querystr[] =
+	    "SELECT DISTINCT CAST(substr(`start`, 1, 4) AS INTEGER) FROM `Events` "
+	    "WHERE (`start` < ?) ORDER BY 1";
+
+	use_database(DB_PROFILE_WRITE);
+
+	ret = sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+	sqlite3_bind_text(stmt, 1, cutoff, -1, SQLITE_STATIC);
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt)) && ARCHIVE_YEARS_MAX > years_count)
+		years[years_count++] = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	/* One year at a time, each move is its own transaction */
+	for (i = 0; i < years_count; ++i)
+		archive_move(years[i], cutoff);
+
+	printf("Archived %d year(s) before %s.\n\n", years_count, cutoff);
+}
+
+void
+archive_path(int year, char *path, size_t size)
+{
+	size_t len = archive_stem(session.db_path);
+
+	/* Next to the database and named after it, Charm.db has Charm-archive-YYYY.db */
+	snprintf(path, size, "%.*s" ARCHIVE_SUFFIX, (int) len, session.db_path, year);
+}
+
+const char *
+archive_view(sqlite3 *db, const char *from, const char *until)
+{
+	char querystr[4096];
+	char path[256];
+	char attach[320];
+	int years[ARCHIVE_ATTACHED_MAX];
+	int years_count;
+	int i;
+
+	/* Nothing archived in range, keep reading Events directly */
+	years_count = archive_years(from, until, years, ARCHIVE_ATTACHED_MAX);
+	if (0 == years_count)
+		return("Events");
+	if (ARCHIVE_ATTACHED_MAX < years_count) {
+		ERROR((stderr, "Range spans %d archived years, at most %d can be read at once.\nAbort.\n",
+		       years_count, ARCHIVE_ATTACHED_MAX));
+		quit(-1);
+	}
+
+	strcpy(querystr, "CREATE TEMP VIEW IF NOT EXISTS `ccharm_events` AS "
+	                 "SELECT * FROM main.`Events`");
+
+	for (i = 0; i < years_count; ++i) {
+		char *quoted;
+
+		archive_path(years[i], path, sizeof(path));
+		quoted = sqlite3_mprintf("ATTACH DATABASE %Q AS `archive_%d`", path, years[i]);
+		strncpy(attach, quoted, sizeof(attach) - 1);
+		attach[sizeof(attach) - 1] = '\0';
+		sqlite3_free(quoted);
+		archive_exec(db, attach);
+
+		/* Rows an interrupted move left behind in both are read from main only */
+		snprintf(path, sizeof(path), " UNION ALL SELECT * FROM `archive_%d`.`Events` AS `a` "
+		         "WHERE NOT EXISTS (SELECT 1 FROM main.`Events` AS `m` WHERE `m`.`id` = `a`.`id`)",
+		         years[i]);
+		strncat(querystr, path, sizeof(querystr) - strlen(querystr) - 1);
+	}
+
+	/* The view lives in temp, which query_only would refuse */
+	archive_exec(db, "PRAGMA query_only = 0");
+	archive_exec(db, querystr);
+	archive_exec(db, "PRAGMA query_only = 1");
+
+	return("ccharm_events");
+}
+
+int
+archive_years(const char *from, const char *until, int *years, int max)
+{
+	struct dirent *entry;
+	char dir_path[FILENAME_MAX];
+	char expected[256];
+	const char *base;
+	size_t base_len;
+	int found[ARCHIVE_YEARS_MAX];
+	int found_count = 0;
+	int first = atoi(from);
+	int last = atoi(until);
+	int year, i;
+	DIR *dir;
+
+	/* Archives sit in the database's directory, named after its file */
+	if (0 != (base = strrchr(session.db_path, '/'))) {
+		snprintf(dir_path, sizeof(dir_path), "%.*s",
+		         base == session.db_path ? 1 : (int) (base - session.db_path), session.db_path);
+		++base;
+	} else {
+		strcpy(dir_path, ".");
+		base = session.db_path;
+	}
+	base_len = archive_stem(base);
+
+	if (0 == (dir = opendir(dir_path)))
+		return(0);
+
+	/* Prune by the years the range touches, newest first */
+	while (0 != (entry = readdir(dir)) && ARCHIVE_YEARS_MAX > found_count) {
+		if (0 != strncmp(entry->d_name, base, base_len) ||
+		    1 != sscanf(entry->d_name + base_len, ARCHIVE_SUFFIX, &year))
+			continue;
+		snprintf(expected, sizeof(expected), "%.*s" ARCHIVE_SUFFIX, (int) base_len, base, year);
+		if (0 != strcmp(expected, entry->d_name))
+			continue;
+		if (year < first || year > last)
+			continue;
+		found[found_count++] = year;
+	}
+	closedir(dir);
+
+	qsort(found, (size_t) found_count, sizeof(int), archive_year_compare);
+
+	/* All of them are counted, callers refuse what they can't read at once */
+	for (i = 0; i < found_count && i < max; ++i)
+		years[i] = found[i];
+
+	return(found_count);
+}
+
+/******************************************************************* local definitions */
+
+void
+archive_exec(sqlite3 *db, const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+void
+archive_move(int year, const char *cutoff)
+{
+	sqlite3 *archive;
+	sqlite3_stmt *stmt;
+	char path[256];
+	char *querystr;
+	char columns[2048];
+	BOOL shadowed;
+	int ret;
+
+	archive_path(year, path, sizeof(path));
+
+	/* ATTACH inherits the open flags of the main connection, create first */
+	if (SQLITE_OK != sqlite3_open_v2(path, &archive, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0)) {
+		ERROR((stderr, "Can't create archive: %s\n%s\n", path, sqlite3_errmsg(archive)));
+		sqlite3_close(archive);
+		quit(-1);
+	}
+	sqlite3_close(archive);
+
+	querystr = sqlite3_mprintf("ATTACH DATABASE %Q AS `archive`", path);
+	archive_exec(session.db, querystr);
+	sqlite3_free(querystr);
+
+	/* Mirror the live table layout, whatever Charm version created it */
+	ret = sqlite3_prepare_v2(session.db, "PRAGMA main.table_info(`Events`)", -1, &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	columns[0] = '\0';
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		char *column = sqlite3_mprintf("%s`%w` %s%s",
+		    columns[0] ? ", " : "",
+		    (const char *) sqlite3_column_text(stmt, 1),
+		    sqlite3_column_text(stmt, 2) ? (const char *) sqlite3_column_text(stmt, 2) : "",
+		    0 < sqlite3_column_int(stmt, 5) ? " PRIMARY KEY" : "");
+		strncat(columns, column, sizeof(columns) - strlen(columns) - 1);
+		sqlite3_free(column);
+	}
+	sqlite3_finalize(stmt);
+
+	querystr = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS `archive`.`Events` (%s)", columns);
+	archive_exec(session.db, querystr);
+	sqlite3_free(querystr);
+	archive_exec(session.db, "CREATE INDEX IF NOT EXISTS `archive`.`ccharm_events_start` "
+	                         "ON `Events` (`start`)");
+
+	/*
+	 * WAL commits are atomic per file only, so the copy lands in the archive
+	 * first and the live rows go in a second transaction. Should the delete
+	 * never happen, the next run copies the same ids over themselves, the
+	 * live rows still winning, and deletes them then.
+	 */
+	archive_exec(session.db, "BEGIN IMMEDIATE");
+
+	/* Archives keep the integer shadow times, its triggers fill them on copy */
+	shadowed = epoch_available(session.db, "main");
+	if (TRUE == shadowed)
+		epoch_prepare(session.db, "archive");
+
+	querystr = sqlite3_mprintf(
+	    "INSERT OR REPLACE INTO `archive`.`Events` SELECT * FROM main.`Events` "
+	    "WHERE (`start` >= '%04d-01-01') AND (`start` < '%04d-01-01') AND (`start` < %Q)",
+	    year, year + 1, cutoff);
+	archive_exec(session.db, querystr);
+	sqlite3_free(querystr);
+
+	if (TRUE == shadowed)
+		epoch_finish(session.db, "archive");
+
+	archive_exec(session.db, "COMMIT");
+	archive_exec(session.db, "BEGIN IMMEDIATE");
+
+	querystr = sqlite3_mprintf(
+	    "DELETE FROM main.`Events` "
+	    "WHERE (`start` >= '%04d-01-01') AND (`start` < '%04d-01-01') AND (`start` < %Q)",
+	    year, year + 1, cutoff);
+	archive_exec(session.db, querystr);
+	sqlite3_free(querystr);
+
+	archive_exec(session.db, "COMMIT");
+	archive_exec(session.db, "DETACH DATABASE `archive`");
+
+	INFO((stderr, "Archived %04d into %s\n", year, path));
+}
+
+size_t
+archive_stem(const char *path)
+{
+	size_t len = strlen(path);
+
+	/* The name archives are derived from, without a .db extension */
+	if (3 < len && 0 == strcmp(path + len - 3, ".db"))
+		len -= 3;
+
+	return(len);
+}
+
+int
+archive_year_compare(const void *a, const void *b)
+{
+	return(*(const int *)b - *(const int *)a);
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "audit.h"
+
+#include <assert.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "epoch.h"
+#include "frecency.h"
+#include "session.h"
+#include "stamp.h"
+
+/************************************************************************ declarations */
+
+/*
+ * Events are swept in start order while a min-heap holds the end times
+ * of those still running: whatever ended before the next start is
+ * popped, whatever is left overlaps it. Memory follows how many events
+ * run at once, never how many there are.
+ */
+struct t_AUDIT_ACTIVE {
+	sqlite3_int64 end_time;
+	sqlite3_int64 start_time;
+	sqlite3_int64 id;
+	char          end[32];
+};
+
+struct t_AUDIT_HEAP {
+	struct t_AUDIT_ACTIVE *items;
+	int                    count;
+	int                    capacity;
+};
+
+struct t_AUDIT_COUNT {
+	sqlite3_int64 events;
+	sqlite3_int64 overlaps;
+	sqlite3_int64 gaps;
+	sqlite3_int64 outliers;
+	sqlite3_int64 trimmed;
+};
+
+static void        audit_exec(const char *);
+static const char *audit_format(sqlite3_int64, char *, size_t);
+static void        audit_push(struct t_AUDIT_HEAP *, sqlite3_int64, sqlite3_int64, sqlite3_int64,
+                               const char *);
+static void        audit_remove(struct t_AUDIT_HEAP *, int);
+static void        audit_trim(sqlite3_stmt *, sqlite3_int64, const char *);
+
+/************************************************************************* definitions */
+
+void
+audit(int gap, int max, BOOL fix)
+{
+	struct t_AUDIT_COUNT count;
+	struct t_AUDIT_HEAP heap;
+	sqlite3_stmt *stmt, *trim = 0;
+	sqlite3_int64 covered_time = 0;
+	char *covered = 0;
+	char span[32];
+	BOOL epoch;
+	int latest;
+	int ret;
+	int i;
+
+	const char textstr[] =
+	    "SELECT `id`, `task`, `start`, `end` FROM `Events` "
+	    "ORDER BY `start`, `id`";
+	const char epochstr[] =
+	    "SELECT `e`.`id`, `e`.`task`, `e`.`start`, `e`.`end`, `t`.`start`, `t`.`end` "
+	    "FROM `ccharm_event_times` AS `t` CROSS JOIN `Events` AS `e` ON `e`.`id` = `t`.`id` "
+	    "ORDER BY `t`.`start`, `t`.`id`";
+	const char trimstr[] =
+	    "INSERT OR REPLACE INTO temp.`ccharm_audit` (`id`, `end`) VALUES (?, ?)";
+	const char *querystr;
+
+	/* Fixes are staged while Events is walked and applied in the same transaction */
+	if (TRUE == fix) {
+		use_database(DB_PROFILE_WRITE);
+		audit_exec("BEGIN IMMEDIATE");
+		audit_exec("CREATE TEMP TABLE IF NOT EXISTS `ccharm_audit` "
+		           "(`id` INTEGER PRIMARY KEY, `end` TEXT)");
+		audit_exec("DELETE FROM temp.`ccharm_audit`");
+	} else use_database(DB_PROFILE_READ);
+
+	epoch = epoch_available(session.db, "main");
+	querystr = TRUE == epoch ? epochstr : textstr;
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, &stmt, NULL) ||
+	    (TRUE == fix &&
+	     SQLITE_OK != sqlite3_prepare_v2(session.db, trimstr, sizeof(trimstr), &trim, NULL))) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	memset(&count, 0, sizeof(count));
+	memset(&heap, 0, sizeof(heap));
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *start = (const char *) sqlite3_column_text(stmt, 2);
+		const char *end = (const char *) sqlite3_column_text(stmt, 3);
+		sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+		sqlite3_int64 start_time = 0;
+		sqlite3_int64 end_time = 0;
+		int64_t parsed = 0;
+		BOOL ended;
+		int task_id = sqlite3_column_int(stmt, 1);
+
+		/* Shadow times where they exist, the text parsed in place otherwise */
+		if (TRUE == epoch) {
+			start_time = sqlite3_column_int64(stmt, 4);
+			end_time = sqlite3_column_int64(stmt, 5);
+			ended = SQLITE_NULL != sqlite3_column_type(stmt, 5);
+		} else {
+			if (TRUE == stamp_parse(start, (size_t) sqlite3_column_bytes(stmt, 2), &parsed))
+				start_time = (sqlite3_int64) parsed;
+			ended = stamp_parse(end, (size_t) sqlite3_column_bytes(stmt, 3), &parsed);
+			end_time = (sqlite3_int64) parsed;
+		}
+
+		if (0 == start)
+			start = "";
+		if (0 == end || FALSE == ended) {
+			end = start;
+			end_time = start_time;
+		}
+		++count.events;
+
+		if (end_time < start_time) {
+			printf("invalid  event %lld [%04d] from %s ends before it starts\n",
+			       (long long) id, task_id, start);
+			++count.outliers;
+			continue;
+		}
+		if (end_time - start_time > max) {
+			printf("outlier  event %lld [%04d] from %s lasts %s\n",
+			       (long long) id, task_id, start,
+			       audit_format(end_time - start_time, span, sizeof(span)));
+			++count.outliers;
+		}
+
+		while (0 < heap.count && heap.items[0].end_time <= start_time)
+			audit_remove(&heap, 0);
+
+		if (0 < heap.count) {
+			printf("overlap  event %lld [%04d] from %s overlaps event %lld by %s\n",
+			       (long long) id, task_id, start, (long long) heap.items[0].id,
+			       audit_format((heap.items[0].end_time < end_time ? heap.items[0].end_time : end_time)
+			                    - start_time, span, sizeof(span)));
+			++count.overlaps;
+
+			/*
+			 * A timer left running is the usual culprit, it stops where the
+			 * next one starts. Only the latest started is cut, whatever ran
+			 * longer around it is nesting and only reported.
+			 */
+			if (TRUE == fix) {
+				for (latest = 0, i = 1; i < heap.count; ++i)
+					if (heap.items[latest].start_time < heap.items[i].start_time ||
+					    (heap.items[latest].start_time == heap.items[i].start_time &&
+					     heap.items[latest].id < heap.items[i].id))
+						latest = i;
+				audit_trim(trim, heap.items[latest].id, start);
+				audit_remove(&heap, latest);
+				++count.trimmed;
+
+				/* Coverage falls back to what still runs, or to where the cut was */
+				free(covered);
+				covered = strdup(start);
+				covered_time = start_time;
+				for (i = 0; i < heap.count; ++i)
+					if (heap.items[i].end_time > covered_time) {
+						free(covered);
+						covered = strdup(heap.items[i].end);
+						covered_time = heap.items[i].end_time;
+					}
+			}
+		} else if (0 != covered && start_time - covered_time > gap
+		           && 0 == strncmp(covered, start, 10)) {
+			/* Only gaps within a day, nights and weekends are not worth a line */
+			printf("gap      from %s until %s, %s\n", covered, start,
+			       audit_format(start_time - covered_time, span, sizeof(span)));
+			++count.gaps;
+		}
+
+		audit_push(&heap, end_time, start_time, id, end);
+		if (0 == covered || end_time >= covered_time) {
+			free(covered);
+			covered = strdup(end);
+			covered_time = end_time;
+		}
+	}
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+
+	sqlite3_finalize(stmt);
+	free(heap.items);
+	free(covered);
+
+	if (TRUE == fix) {
+		sqlite3_finalize(trim);
+		audit_exec("UPDATE `Events` SET `end` = "
+		           "(SELECT `end` FROM temp.`ccharm_audit` a WHERE a.`id` = `Events`.`id`) "
+		           "WHERE `id` IN (SELECT `id` FROM temp.`ccharm_audit`)");
+		audit_exec("DROP TABLE temp.`ccharm_audit`");
+		audit_exec("COMMIT");
+
+		if (0 < count.trimmed)
+			frecency_invalidate();
+	}
+
+	printf("Audited %lld event(s): %lld overlap(s), %lld gap(s), %lld outlier(s)",
+	       (long long) count.events, (long long) count.overlaps,
+	       (long long) count.gaps, (long long) count.outliers);
+	if (TRUE == fix)
+		printf(", trimmed %lld event(s)", (long long) count.trimmed);
+	printf(".\n\n");
+}
+
+/******************************************************************* local definitions */
+
+void
+audit_exec(const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+const char *
+audit_format(sqlite3_int64 seconds, char *buffer, size_t size)
+{
+	snprintf(buffer, size, "%02lld:%02lld:%02lld",
+	         (long long) (seconds / 3600), (long long) (seconds / 60 % 60), (long long) (seconds % 60));
+
+	return(buffer);
+}
+
+void
+audit_push(struct t_AUDIT_HEAP *heap, sqlite3_int64 end_time, sqlite3_int64 start_time,
+           sqlite3_int64 id, const char *end)
+{
+	int i;
+
+	if (heap->count == heap->capacity) {
+		heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+		heap->items = realloc(heap->items, sizeof(struct t_AUDIT_ACTIVE) * (size_t) heap->capacity);
+	}
+
+	/* Sift up from the bottom */
+	for (i = heap->count++; 0 < i && end_time < heap->items[(i - 1) / 2].end_time; i = (i - 1) / 2)
+		heap->items[i] = heap->items[(i - 1) / 2];
+
+	heap->items[i].end_time = end_time;
+	heap->items[i].start_time = start_time;
+	heap->items[i].id = id;
+	strncpy(heap->items[i].end, end, sizeof(heap->items[i].end) - 1);
+	heap->items[i].end[sizeof(heap->items[i].end) - 1] = '\0';
+}
+
+void
+audit_remove(struct t_AUDIT_HEAP *heap, int i)
+{
+	struct t_AUDIT_ACTIVE last = heap->items[--heap->count];
+
+	if (i == heap->count)
+		return;
+
+	/* The last item takes the hole, sifted up or down from there */
+	while (0 < i && last.end_time < heap->items[(i - 1) / 2].end_time) {
+		heap->items[i] = heap->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	for (;;) {
+		int child = 2 * i + 1;
+
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count && heap->items[child + 1].end_time < heap->items[child].end_time)
+			++child;
+		if (last.end_time <= heap->items[child].end_time)
+			break;
+
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+	heap->items[i] = last;
+}
+
+void
+audit_trim(sqlite3_stmt *trim, sqlite3_int64 id, const char *end)
+{
+	sqlite3_bind_int64(trim, 1, id);
+	sqlite3_bind_text(trim, 2, end, -1, SQLITE_TRANSIENT);
+
+	if (SQLITE_DONE != sqlite3_step(trim)) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_reset(trim);
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "query.h"
+#include "session.h"
+
+/*************************************************************************** constants */
+
+static const char cache_magic[8] = "CCHQRY1";
+
+#define CACHE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+/************************************************************************ declarations */
+
+/*
+ * Query cache layout, private to this host (native endianness):
+ *
+ *   header | entry | key | results | entry | key | results | ...
+ *
+ * Keys are normalized queries, results the printed leaves each NUL
+ * terminated, padded to 8 bytes. An entry holds for the database
+ * signature and the day (task validity follows CURRENT_DATE) it was
+ * computed on. Hits bump its use stamp in place, so the file is only
+ * rewritten on a miss, dropping the least recently used entries.
+ */
+struct t_CACHE_HEADER {
+	char     magic[8];
+	uint64_t clock;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct t_CACHE_ENTRY {
+	DB_SIGNATURE signature;
+	int64_t      day;
+	uint64_t     used;
+	uint32_t     key_size;
+	uint32_t     results_size;
+	uint32_t     results;
+	uint32_t     complete;
+};
+
+struct t_CACHE_PENDING {
+	char        *key;
+	DB_SIGNATURE signature;
+	int64_t      day;
+};
+
+static struct t_CACHE_ENTRY *cache_entry(void *, size_t, size_t *);
+static size_t                cache_entry_size(const struct t_CACHE_ENTRY *);
+static const char           *cache_key(const struct t_CACHE_ENTRY *);
+static BOOL                  cache_lookup(FILE *, int);
+
+/********************************************************************* local variables */
+
+static struct t_CACHE_PENDING pending;
+
+/************************************************************************* definitions */
+
+BOOL
+cache_tasks_print(const char *query, FILE *out, int limit)
+{
+	BOOL hit;
+
+	/* Remembered for the store, results belong to the database as it was before the query */
+	free(pending.key);
+	pending.key = query_normalize(query);
+	pending.day = (int64_t) (time(0) / 86400);
+	signature_database(session.db_path, &pending.signature);
+
+	/* Queries without a key are never stored, so there is nothing to find */
+	if (0 == pending.key)
+		return(FALSE);
+
+	hit = cache_lookup(out, limit);
+	INFO((stderr, "Query cache %s: %s\n", TRUE == hit ? "hit" : "miss", pending.key));
+
+	return(hit);
+}
+
+void
+cache_tasks_store(const char *results, size_t size, int count, BOOL complete)
+{
+	struct t_CACHE_HEADER header;
+	struct t_CACHE_ENTRY entry;
+	struct t_CACHE_ENTRY **kept;
+	static const char padding[8];
+	uint32_t kept_count = 0;
+	size_t kept_size;
+	size_t offset;
+	char *buffer = 0;
+	long buffer_size = 0;
+	uint32_t i;
+	FILE *in;
+	FILE *out;
+
+	if (0 == pending.key)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.signature = pending.signature;
+	entry.day = pending.day;
+	entry.key_size = (uint32_t) strlen(pending.key) + 1;
+	entry.results_size = (uint32_t) size;
+	entry.results = (uint32_t) count;
+	entry.complete = TRUE == complete ? 1 : 0;
+
+	kept_size = sizeof(struct t_CACHE_HEADER) + cache_entry_size(&entry);
+	if (QUERY_CACHE_SIZE < kept_size) {
+		INFO((stderr, "Query cache skipped: %lu bytes\n", (unsigned long) kept_size));
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, cache_magic, sizeof(header.magic));
+
+	if (0 != (in = fopen(QUERY_CACHE_PATH, "rb"))) {
+		if (0 == fseek(in, 0, SEEK_END) && 0 < (buffer_size = ftell(in)) &&
+		    0 == fseek(in, 0, SEEK_SET)) {
+			buffer = malloc((size_t) buffer_size);
+			if (1 != fread(buffer, (size_t) buffer_size, 1, in) ||
+			    (size_t) buffer_size < sizeof(struct t_CACHE_HEADER) ||
+			    0 != memcmp(buffer, cache_magic, sizeof(cache_magic))) {
+				free(buffer);
+				buffer = 0;
+			}
+		}
+		fclose(in);
+	}
+
+	kept = malloc(sizeof(struct t_CACHE_ENTRY *) *
+	              ((size_t) buffer_size / sizeof(struct t_CACHE_ENTRY) + 1));
+	if (0 != buffer) {
+		const struct t_CACHE_HEADER *old = (const struct t_CACHE_HEADER *) buffer;
+
+		header.clock = old->clock;
+		offset = sizeof(struct t_CACHE_HEADER);
+
+		for (i = 0; i < old->count; ++i) {
+			struct t_CACHE_ENTRY *other = cache_entry(buffer, (size_t) buffer_size, &offset);
+
+			if (0 == other)
+				break;
+
+			/* The same query, or anything its database has moved on from */
+			if (0 == strcmp(pending.key, cache_key(other)) ||
+			    (other->signature.db[0] == entry.signature.db[0] &&
+			     (other->day != entry.day ||
+			      0 != memcmp(&other->signature, &entry.signature, sizeof(DB_SIGNATURE)))))
+				continue;
+
+			kept[kept_count++] = other;
+			kept_size += cache_entry_size(other);
+		}
+	}
+
+	/* Least recently used entries make room for the new one */
+	while (0 < kept_count && (QUERY_CACHE_MAX <= kept_count || QUERY_CACHE_SIZE < kept_size)) {
+		uint32_t oldest = 0, j;
+
+		for (j = 1; j < kept_count; ++j) {
+			if (kept[j]->used < kept[oldest]->used)
+				oldest = j;
+		}
+		kept_size -= cache_entry_size(kept[oldest]);
+		kept[oldest] = kept[--kept_count];
+	}
+
+	entry.used = ++header.clock;
+	header.count = kept_count + 1;
+
+	/* Write aside and rename, concurrent lookups never see a partial cache */
+	if (0 == (out = fopen(QUERY_CACHE_PATH ".tmp", "wb"))) {
+		WARNING((stderr, "Unable to write query cache.\n"));
+		free(kept);
+		free(buffer);
+		return;
+	}
+
+	fwrite(&header, sizeof(header), 1, out);
+	for (i = 0; i < kept_count; ++i)
+		fwrite(kept[i], cache_entry_size(kept[i]), 1, out);
+
+	fwrite(&entry, sizeof(entry), 1, out);
+	fwrite(pending.key, entry.key_size, 1, out);
+	fwrite(results, size, 1, out);
+	fwrite(padding, cache_entry_size(&entry) - sizeof(entry) - entry.key_size - size, 1, out);
+
+	if (0 != fclose(out) || 0 != rename(QUERY_CACHE_PATH ".tmp", QUERY_CACHE_PATH))
+		WARNING((stderr, "Unable to write query cache.\n"));
+
+	free(kept);
+	free(buffer);
+}
+
+/******************************************************************* local definitions */
+
+struct t_CACHE_ENTRY *
+cache_entry(void *map, size_t map_size, size_t *offset)
+{
+	struct t_CACHE_ENTRY *entry = (struct t_CACHE_ENTRY *) ((char *) map + *offset);
+
+	/* A torn or foreign file ends the walk rather than the process */
+	if (*offset + sizeof(struct t_CACHE_ENTRY) > map_size ||
+	    *offset + cache_entry_size(entry) > map_size ||
+	    0 == entry->key_size || '\0' != cache_key(entry)[entry->key_size - 1])
+		return(0);
+
+	*offset += cache_entry_size(entry);
+
+	return(entry);
+}
+
+size_t
+cache_entry_size(const struct t_CACHE_ENTRY *entry)
+{
+	return(sizeof(struct t_CACHE_ENTRY) +
+	       CACHE_ALIGN((size_t) entry->key_size + entry->results_size));
+}
+
+const char *
+cache_key(const struct t_CACHE_ENTRY *entry)
+{
+	return((const char *) (entry + 1));
+}
+
+BOOL
+cache_lookup(FILE *out, int limit)
+{
+	struct t_CACHE_HEADER *header;
+	struct t_CACHE_ENTRY *entry;
+	struct stat cache_stat;
+	size_t offset = sizeof(struct t_CACHE_HEADER);
+	void *map;
+	BOOL hit = FALSE;
+	uint32_t i;
+	int fd;
+
+	if (-1 == (fd = open(QUERY_CACHE_PATH, O_RDWR)))
+		return(FALSE);
+
+	if (0 != fstat(fd, &cache_stat) ||
+	    (size_t) cache_stat.st_size < sizeof(struct t_CACHE_HEADER)) {
+		close(fd);
+		return(FALSE);
+	}
+
+	map = mmap(0, (size_t) cache_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == map)
+		return(FALSE);
+
+	header = map;
+	if (0 != memcmp(header->magic, cache_magic, sizeof(header->magic))) {
+		munmap(map, (size_t) cache_stat.st_size);
+		return(FALSE);
+	}
+
+	for (i = 0; i < header->count; ++i) {
+		const char *result, *end;
+		uint32_t printed;
+
+		if (0 == (entry = cache_entry(map, (size_t) cache_stat.st_size, &offset)))
+			break;
+
+		if (pending.day != entry->day ||
+		    0 != memcmp(&pending.signature, &entry->signature, sizeof(DB_SIGNATURE)) ||
+		    0 != strcmp(pending.key, cache_key(entry)))
+			continue;
+
+		/* A search cut short answers no more than it found */
+		if (0 == entry->complete && (0 == limit || (uint32_t) limit > entry->results))
+			break;
+
+		result = cache_key(entry) + entry->key_size;
+		end = result + entry->results_size;
+		for (printed = 0; printed < entry->results && (0 == limit || printed < (uint32_t) limit); ++printed) {
+			const char *next = memchr(result, '\0', (size_t) (end - result));
+
+			if (0 == next)
+				break;
+			fputs(result, out);
+			result = next + 1;
+		}
+		fflush(out);
+
+		entry->used = ++header->clock;
+		hit = TRUE;
+		break;
+	}
+
+	munmap(map, (size_t) cache_stat.st_size);
+
+	return(hit);
+}
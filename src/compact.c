@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "compact.h"
+
+#include <assert.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "epoch.h"
+#include "frecency.h"
+#include "session.h"
+#include "stamp.h"
+
+/************************************************************************ declarations */
+
+struct t_COMPACT_RUN {
+	sqlite3_int64 id;
+	sqlite3_int64 end_time;
+	int           task_id;
+	char         *comment;
+	char         *end;
+	int           merged;
+};
+
+static void compact_exec(const char *);
+static void compact_flush(struct t_COMPACT_RUN *, sqlite3_stmt *);
+static void compact_stage(sqlite3_stmt *, sqlite3_int64, const char *);
+
+/************************************************************************* definitions */
+
+void
+compact(int gap, BOOL dry_run)
+{
+	struct t_COMPACT_RUN run;
+	sqlite3_stmt *stmt, *stage;
+	sqlite3_int64 saved = 0;
+	BOOL epoch;
+	int ret;
+
+	const char textstr[] =
+	    "SELECT `id`, `task`, `comment`, `end`, `start` FROM `Events` "
+	    "ORDER BY `start`, `id`";
+	const char epochstr[] =
+	    "SELECT `e`.`id`, `e`.`task`, `e`.`comment`, `e`.`end`, `t`.`start`, `t`.`end` "
+	    "FROM `ccharm_event_times` AS `t` CROSS JOIN `Events` AS `e` ON `e`.`id` = `t`.`id` "
+	    "ORDER BY `t`.`start`, `t`.`id`";
+	const char *querystr;
+	const char stagestr[] =
+	    "INSERT INTO temp.`ccharm_compact` (`id`, `end`) VALUES (?, ?)";
+
+	use_database(DB_PROFILE_WRITE);
+
+	/*
+	 * Merges are staged in a temp table while Events is being walked and
+	 * only applied once the walk is over, all in the same transaction.
+	 */
+	compact_exec("BEGIN IMMEDIATE");
+	compact_exec("CREATE TEMP TABLE IF NOT EXISTS `ccharm_compact` "
+	             "(`id` INTEGER PRIMARY KEY, `end` TEXT)");
+	compact_exec("DELETE FROM temp.`ccharm_compact`");
+
+	/* The shadow index hands rows over in order, no sort and no parsing */
+	epoch = epoch_available(session.db, "main");
+	querystr = TRUE == epoch ? epochstr : textstr;
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, &stmt, NULL) ||
+	    SQLITE_OK != sqlite3_prepare_v2(session.db, stagestr, sizeof(stagestr), &stage, NULL)) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+	assert(stage);
+
+	memset(&run, 0, sizeof(run));
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *comment = (const char *) sqlite3_column_text(stmt, 2);
+		const char *end = (const char *) sqlite3_column_text(stmt, 3);
+		sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+		sqlite3_int64 start_time = 0;
+		sqlite3_int64 end_time = 0;
+		int64_t parsed = 0;
+		int task_id = sqlite3_column_int(stmt, 1);
+		BOOL valid;
+
+		/* Without shadow times the text is parsed here rather than by SQLite */
+		if (TRUE == epoch) {
+			valid = SQLITE_NULL != sqlite3_column_type(stmt, 4) &&
+			        SQLITE_NULL != sqlite3_column_type(stmt, 5) ? TRUE : FALSE;
+			start_time = sqlite3_column_int64(stmt, 4);
+			end_time = sqlite3_column_int64(stmt, 5);
+		} else {
+			valid = stamp_parse((const char *) sqlite3_column_text(stmt, 4),
+			                    (size_t) sqlite3_column_bytes(stmt, 4), &parsed);
+			start_time = (sqlite3_int64) parsed;
+			if (TRUE == valid)
+				valid = stamp_parse(end, (size_t) sqlite3_column_bytes(stmt, 3), &parsed);
+			end_time = (sqlite3_int64) parsed;
+		}
+
+		/* Times we can't read never merge, nor let a run reach across them */
+		if (FALSE == valid) {
+			compact_flush(&run, stage);
+			continue;
+		}
+
+		if (0 == comment)
+			comment = "";
+		if (0 == end)
+			end = "";
+
+		/* Only fragments directly following each other fold together */
+		if (0 != run.id &&
+		    task_id == run.task_id &&
+		    0 == strcmp(comment, run.comment) &&
+		    start_time - run.end_time <= gap) {
+			if (end_time > run.end_time) {
+				free(run.end);
+				run.end = strdup(end);
+				run.end_time = end_time;
+			}
+			compact_stage(stage, id, 0);
+			++run.merged;
+			++saved;
+			continue;
+		}
+
+		compact_flush(&run, stage);
+
+		run.id = id;
+		run.task_id = task_id;
+		run.comment = strdup(comment);
+		run.end = strdup(end);
+		run.end_time = end_time;
+		run.merged = 0;
+	}
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	compact_flush(&run, stage);
+
+	sqlite3_finalize(stage);
+	sqlite3_finalize(stmt);
+
+	if (TRUE == dry_run) {
+		compact_exec("ROLLBACK");
+		printf("Compacting would save %lld event(s).\n\n", (long long) saved);
+		return;
+	}
+
+	compact_exec("UPDATE `Events` SET `end` = "
+	             "(SELECT `end` FROM temp.`ccharm_compact` c WHERE c.`id` = `Events`.`id`) "
+	             "WHERE `id` IN (SELECT `id` FROM temp.`ccharm_compact` WHERE `end` NOTNULL)");
+	compact_exec("DELETE FROM `Events` "
+	             "WHERE `id` IN (SELECT `id` FROM temp.`ccharm_compact` WHERE `end` ISNULL)");
+	compact_exec("DROP TABLE temp.`ccharm_compact`");
+	compact_exec("COMMIT");
+
+	/* Scores counted the fragments, let them be recounted */
+	if (0 < saved)
+		frecency_invalidate();
+
+	printf("Compacted, saved %lld event(s).\n\n", (long long) saved);
+}
+
+/******************************************************************* local definitions */
+
+void
+compact_exec(const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+void
+compact_flush(struct t_COMPACT_RUN *run, sqlite3_stmt *stage)
+{
+	if (0 != run->id && 0 < run->merged)
+		compact_stage(stage, run->id, run->end);
+
+	free(run->comment);
+	free(run->end);
+	memset(run, 0, sizeof(struct t_COMPACT_RUN));
+}
+
+void
+compact_stage(sqlite3_stmt *stage, sqlite3_int64 id, const char *end)
+{
+	sqlite3_bind_int64(stage, 1, id);
+	if (end)
+		sqlite3_bind_text(stage, 2, end, -1, SQLITE_TRANSIENT);
+	else
+		sqlite3_bind_null(stage, 2);
+
+	if (SQLITE_DONE != sqlite3_step(stage)) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_reset(stage);
+}
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "complete.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "session.h"
+#include "task.h"
+
+/*************************************************************************** constants */
+
+static const char complete_magic[8] = "CCHCMP2";
+
+static const char * const complete_words[] = {
+	"help", "archive", "audit", "bookmark", "bookmarks", "compact", "complete", "discard", "import-tasks", "log",
+	"optimize", "recent", "report", "start", "stats", "status", "stop", "sync", "tasks", "wipe",
+	"--after", "--bookmark", "--charm-db", "--comment", "--dry-run", "--federate-db", "--fix",
+	"--from", "--gap", "--help", "--limit", "--max", "--recent", "--reset", "--task", "--task-id", "--top",
+	"--until", "--watch",
+	0
+};
+
+/************************************************************************ declarations */
+
+/*
+ * Completion index layout, private to this host (native endianness):
+ *
+ *   header | name offsets[names] | id offsets[ids] | strings
+ *
+ * Name entries are task names sorted case-insensitively, id entries are
+ * "ID\tNAME" sorted as strings, so both can be prefix searched in place.
+ */
+struct t_COMPLETE_HEADER {
+	char         magic[8];
+	DB_SIGNATURE signature;
+	uint32_t     names;
+	uint32_t     ids;
+};
+
+struct t_COMPLETE_INDEX {
+	const struct t_COMPLETE_HEADER *header;
+	const uint32_t                 *names;
+	const uint32_t                 *ids;
+	const char                     *strings;
+	void                           *map;
+	size_t                          map_size;
+};
+
+struct t_COMPLETE_ENTRY {
+	char    *name;
+	char    *id;
+	uint32_t name_offset;
+	uint32_t id_offset;
+};
+
+static void   complete_build(const DB_SIGNATURE *);
+static int    complete_entry_id_compare(const void *, const void *);
+static int    complete_entry_name_compare(const void *, const void *);
+static BOOL   complete_map(struct t_COMPLETE_INDEX *, const DB_SIGNATURE *);
+static void   complete_search(const struct t_COMPLETE_INDEX *, const uint32_t *,
+                              uint32_t, const char *, BOOL);
+static void   complete_slots(const TASK *, int, const char *);
+
+/************************************************************************* definitions */
+
+void
+complete(const char *what, const char *prefix)
+{
+	struct t_COMPLETE_INDEX index;
+	DB_SIGNATURE signature;
+	struct stat db_stat;
+	size_t prefix_len = strlen(prefix);
+	int i;
+
+	if (0 == strcasecmp("commands", what)) {
+		for (i = 0; complete_words[i]; ++i) {
+			if (0 == strncmp(complete_words[i], prefix, prefix_len))
+				printf("%s\n", complete_words[i]);
+		}
+		return;
+	} else if (0 == strcasecmp("bookmarks", what)) {
+		complete_slots(bookmark.tasks, MAX_TASK_BOOKMARK_LEN, prefix);
+		return;
+	} else if (0 == strcasecmp("recent", what)) {
+		complete_slots(recent.tasks, MAX_TASK_RECENT_LEN, prefix);
+		return;
+	} else if (0 != strcasecmp("tasks", what) && 0 != strcasecmp("ids", what)) {
+		ERROR((stderr, "Invalid completion: %s\nAbort.\n", what));
+		quit(-1);
+	}
+
+	if (0 != stat(session.db_path, &db_stat)) {
+		ERROR((stderr, "Can't stat database: %s\n", session.db_path));
+		quit(-1);
+	}
+
+	/* Rebuild only when the database or its WAL changed since the index was written */
+	signature_database(session.db_path, &signature);
+	if (FALSE == complete_map(&index, &signature)) {
+		complete_build(&signature);
+		if (FALSE == complete_map(&index, &signature)) {
+			ERROR((stderr, "Unable to read completion index.\n"));
+			quit(-1);
+		}
+	}
+
+	if (0 == strcasecmp("tasks", what))
+		complete_search(&index, index.names, index.header->names, prefix, TRUE);
+	else
+		complete_search(&index, index.ids, index.header->ids, prefix, FALSE);
+
+	munmap(index.map, index.map_size);
+}
+
+/******************************************************************* local definitions */
+
+void
+complete_build(const DB_SIGNATURE *signature)
+{
+	struct t_COMPLETE_HEADER header;
+	struct t_COMPLETE_ENTRY *entries = 0;
+	struct t_COMPLETE_ENTRY **order;
+	size_t entries_count = 0;
+	size_t entries_capacity = 0;
+	sqlite3_stmt *stmt;
+	uint32_t offset;
+	size_t i;
+	FILE *out;
+	int ret;
+
+	const char querystr[] =
+	    "SELECT `task_id`, `name` FROM `Tasks` "
+	    "WHERE (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
+	      "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL)";
+
+	use_database(DB_PROFILE_READ);
+
+	/* A single flat scan, names are completed without their ancestors */
+	ret = sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 1);
+		int task_id = sqlite3_column_int(stmt, 0);
+
+		if (0 == name)
+			name = "";
+
+		if (entries_count == entries_capacity) {
+			entries_capacity = entries_capacity ? entries_capacity * 2 : 256;
+			entries = realloc(entries, entries_capacity * sizeof(struct t_COMPLETE_ENTRY));
+		}
+
+		entries[entries_count].name = strdup(name);
+		entries[entries_count].id = malloc(strlen(name) + 16);
+		sprintf(entries[entries_count].id, "%d\t%s", task_id, name);
+		++entries_count;
+	}
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_finalize(stmt);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, complete_magic, sizeof(header.magic));
+	header.signature = *signature;
+	header.names     = (uint32_t) entries_count;
+	header.ids       = (uint32_t) entries_count;
+
+	/* Write aside and rename, concurrent completions never see a partial index */
+	if (0 == (out = fopen(COMPLETE_INDEX_PATH ".tmp", "wb"))) {
+		ERROR((stderr, "Unable to write completion index.\n"));
+		quit(-1);
+	}
+
+	/* Strings keep scan order, the two offset tables carry the sorting */
+	order = malloc((entries_count + 1) * sizeof(struct t_COMPLETE_ENTRY *));
+	for (i = 0, offset = 0; i < entries_count; ++i) {
+		order[i] = &entries[i];
+		entries[i].name_offset = offset;
+		offset += (uint32_t) strlen(entries[i].name) + 1;
+		entries[i].id_offset = offset;
+		offset += (uint32_t) strlen(entries[i].id) + 1;
+	}
+
+	fwrite(&header, sizeof(header), 1, out);
+
+	qsort(order, entries_count, sizeof(struct t_COMPLETE_ENTRY *), complete_entry_name_compare);
+	for (i = 0; i < entries_count; ++i)
+		fwrite(&order[i]->name_offset, sizeof(uint32_t), 1, out);
+
+	qsort(order, entries_count, sizeof(struct t_COMPLETE_ENTRY *), complete_entry_id_compare);
+	for (i = 0; i < entries_count; ++i)
+		fwrite(&order[i]->id_offset, sizeof(uint32_t), 1, out);
+
+	for (i = 0; i < entries_count; ++i) {
+		fwrite(entries[i].name, strlen(entries[i].name) + 1, 1, out);
+		fwrite(entries[i].id, strlen(entries[i].id) + 1, 1, out);
+	}
+
+	if (0 != fclose(out) || 0 != rename(COMPLETE_INDEX_PATH ".tmp", COMPLETE_INDEX_PATH)) {
+		ERROR((stderr, "Unable to write completion index.\n"));
+		quit(-1);
+	}
+
+	for (i = 0; i < entries_count; ++i) {
+		free(entries[i].name);
+		free(entries[i].id);
+	}
+	free(entries);
+	free(order);
+
+	INFO((stderr, "Completion index rebuilt: %lu tasks\n", (unsigned long) entries_count));
+}
+
+int
+complete_entry_id_compare(const void *a, const void *b)
+{
+	return(strcmp((*(struct t_COMPLETE_ENTRY * const *)a)->id,
+	              (*(struct t_COMPLETE_ENTRY * const *)b)->id));
+}
+
+int
+complete_entry_name_compare(const void *a, const void *b)
+{
+	return(strcasecmp((*(struct t_COMPLETE_ENTRY * const *)a)->name,
+	                  (*(struct t_COMPLETE_ENTRY * const *)b)->name));
+}
+
+BOOL
+complete_map(struct t_COMPLETE_INDEX *index, const DB_SIGNATURE *signature)
+{
+	const struct t_COMPLETE_HEADER *header;
+	const uint32_t *offsets;
+	struct stat index_stat;
+	size_t tables, i;
+	int fd;
+
+	if (-1 == (fd = open(COMPLETE_INDEX_PATH, O_RDONLY)))
+		return(FALSE);
+
+	if (0 != fstat(fd, &index_stat) ||
+	    (size_t) index_stat.st_size < sizeof(struct t_COMPLETE_HEADER)) {
+		close(fd);
+		return(FALSE);
+	}
+
+	index->map_size = (size_t) index_stat.st_size;
+	index->map = mmap(0, index->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (MAP_FAILED == index->map)
+		return(FALSE);
+
+	header = index->map;
+	tables = sizeof(struct t_COMPLETE_HEADER) +
+	         ((size_t) header->names + header->ids) * sizeof(uint32_t);
+
+	if (0 != memcmp(header->magic, complete_magic, sizeof(header->magic)) ||
+	    0 != memcmp(&header->signature, signature, sizeof(*signature)) ||
+	    tables > index->map_size ||
+	    (tables < index->map_size && '\0' != ((const char *) index->map)[index->map_size - 1])) {
+		munmap(index->map, index->map_size);
+		return(FALSE);
+	}
+
+	/* Every offset must land on a string, a damaged index is rebuilt instead */
+	offsets = (const uint32_t *) (header + 1);
+	for (i = 0; i < (size_t) header->names + header->ids; ++i) {
+		if (offsets[i] >= index->map_size - tables) {
+			munmap(index->map, index->map_size);
+			return(FALSE);
+		}
+	}
+
+	index->header  = header;
+	index->names   = offsets;
+	index->ids     = index->names + header->names;
+	index->strings = (const char *) index->map + tables;
+
+	return(TRUE);
+}
+
+void
+complete_search(const struct t_COMPLETE_INDEX *index, const uint32_t *table,
+                uint32_t count, const char *prefix, BOOL nocase)
+{
+	size_t prefix_len = strlen(prefix);
+	uint32_t lo = 0;
+	uint32_t hi = count;
+
+	/* Lower bound of the prefix, then walk while entries still match */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		const char *entry = index->strings + table[mid];
+		int cmp = nocase ? strncasecmp(entry, prefix, prefix_len)
+		                 : strncmp(entry, prefix, prefix_len);
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < count; ++lo) {
+		const char *entry = index->strings + table[lo];
+		int cmp = nocase ? strncasecmp(entry, prefix, prefix_len)
+		                 : strncmp(entry, prefix, prefix_len);
+
+		if (0 != cmp)
+			break;
+		printf("%s\n", entry);
+	}
+}
+
+void
+complete_slots(const TASK *tasks, int count, const char *prefix)
+{
+	char idx[16];
+	size_t prefix_len = strlen(prefix);
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (0 == tasks[i].task_id)
+			continue;
+
+		/* Only the leaf, the name carries its ancestors on following lines */
+		sprintf(idx, "%d", i);
+		if (0 == strncmp(idx, prefix, prefix_len))
+			printf("%s\t%.*s\n", idx,
+			       (int) strcspn(tasks[i].task_name, "\n"), tasks[i].task_name);
+	}
+}
@@ -26,19 +26,143 @@
 
 #include "db.h"
 
+#include <sys/stat.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "pool.h"
 #include "session.h"
+#include "stats.h"
+
+/*************************************************************************** constants */
+
+#define DB_PREFETCH_WAIT     50
+#define DB_SNAPSHOT_RESTARTS 8
+#define DB_SNAPSHOT_SLEEP    10
+#define DB_TRACE_LOG_MAX     64
+
+enum {DB_TRACE_PREPARED, DB_TRACE_EXECUTED, DB_TRACE_ROWS, DB_TRACE_COMMITS, DB_TRACE_MAX};
+
+static const char * const trace_keys[DB_TRACE_MAX] = {
+	"prepared", "executed", "rows", "commits"
+};
+
+/************************************************************************ declarations */
+
+struct t_DB_PROFILE {
+	sqlite3_int64 mmap_size;
+	int           cache_size;
+	int           busy_timeout;
+	BOOL          prefetch;
+	BOOL          snapshot;
+	BOOL          wal;
+};
+
+struct t_DB_PREFETCH {
+	pthread_t       thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  finished;
+	sqlite3        *db;
+	char            path[FILENAME_MAX];
+	int             profile;
+	BOOL            started;
+	BOOL            cancel;
+	BOOL            done;
+};
+
+struct t_DB_TRACE_ENTRY {
+	char         *sql;
+	unsigned long executed;
+};
+
+struct t_DB_TRACE {
+	BOOL                   enabled;
+	long                   budget[DB_TRACE_MAX];
+	unsigned long          counts[DB_TRACE_MAX];
+	struct t_DB_TRACE_ENTRY log[DB_TRACE_LOG_MAX];
+	int                    log_count;
+	unsigned long          log_dropped;
+	pthread_mutex_t        lock;
+};
+
+static int  database_commit(void *);
+static void database_exec(sqlite3 *, const char *);
+static void *database_prefetch(void *);
+static void database_prefetch_done(void);
+static void database_prefetch_join(int);
+static void database_profile_load(void);
+static void database_profile_set(const char *, const char *);
+static BOOL database_snapshot(void);
+static BOOL database_snapshot_fresh(const DB_SIGNATURE *);
+static int  database_trace(unsigned, void *, void *, void *);
+static void database_trace_budget(const char *);
+
+/********************************************************************* local variables */
+
+static struct t_DB_PROFILE profile = {
+	DB_MMAP_SIZE, DB_CACHE_SIZE, DB_BUSY_TIMEOUT, DB_PREFETCH, DB_SNAPSHOT, DB_WAL
+};
+static BOOL profile_loaded;
+static struct t_DB_PREFETCH prefetch = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, "", DB_PROFILE_NONE, FALSE, FALSE, FALSE };
+static char snapshot_path[FILENAME_MAX];
+static BOOL snapshot_open;
+static struct t_DB_TRACE trace = { FALSE, {0}, {0}, {{0, 0}}, 0, 0, PTHREAD_MUTEX_INITIALIZER };
 
 /************************************************************************* definitions */
 
+BOOL
+budget_database(void)
+{
+	BOOL within = TRUE;
+	int i;
+
+	/* Commands that never touched the database still get a verdict */
+	if (FALSE == profile_loaded)
+		database_profile_load();
+	if (FALSE == trace.enabled)
+		return(TRUE);
+
+	ERROR((stderr, "SQL:"));
+	for (i = 0; i < DB_TRACE_MAX; ++i)
+		ERROR((stderr, " %s=%lu", trace_keys[i], trace.counts[i]));
+	ERROR((stderr, "\n"));
+
+	for (i = 0; i < DB_TRACE_MAX; ++i) {
+		if (0 <= trace.budget[i] && (unsigned long) trace.budget[i] < trace.counts[i]) {
+			ERROR((stderr, "SQL budget exceeded: %s=%lu (max %ld)\n",
+			       trace_keys[i], trace.counts[i], trace.budget[i]));
+			within = FALSE;
+		}
+	}
+
+	/* Attach the statement log so the offender is obvious */
+	if (FALSE == within) {
+		for (i = 0; i < trace.log_count; ++i)
+			ERROR((stderr, "%8lu  %s\n", trace.log[i].executed, trace.log[i].sql));
+		if (0 < trace.log_dropped)
+			ERROR((stderr, "%8lu  (other statements)\n", trace.log_dropped));
+	}
+
+	for (i = 0; i < trace.log_count; ++i)
+		free(trace.log[i].sql);
+	trace.log_count = 0;
+	trace.enabled = FALSE;
+
+	return(within);
+}
+
 void
 change_database(const char *path)
 {
 	close_database();
 	strncpy(session.db_path, path, session.max_path);
-	open_database();
+
+	/* Opened on first use, with the profile the command asks for */
+	INFO((stderr, "Database Changed: %s\n", session.db_path));
 }
 
 void
@@ -48,18 +172,503 @@ close_database(void)
 		sqlite3_close(session.db);
 
 	session.db = 0;
+	session.db_profile = DB_PROFILE_NONE;
+	snapshot_open = FALSE;
 }
 
 void
-open_database(void)
+join_database(void)
 {
-	if (SQLITE_OK != sqlite3_open_v2(session.db_path, &session.db,
-	    SQLITE_OPEN_READWRITE, 0)) {
+	/* Nobody claimed the warm connection, whatever it still does is wasted */
+	database_prefetch_join(0);
+
+	if (0 != prefetch.db)
+		sqlite3_close(prefetch.db);
+	prefetch.db = 0;
+}
+
+void
+open_database(int db_profile)
+{
+	int flags = (DB_PROFILE_WRITE == db_profile) ? SQLITE_OPEN_READWRITE
+	                                             : SQLITE_OPEN_READONLY;
+
+	if (FALSE == profile_loaded)
+		database_profile_load();
+
+	/* Adopt the startup connection when it is the one we would open,
+	 * letting the warm up finish unless it keeps us waiting */
+	if (TRUE == prefetch.started) {
+		database_prefetch_join(DB_PREFETCH_WAIT);
+
+		if (0 != prefetch.db && prefetch.profile >= db_profile &&
+		    0 == strcmp(prefetch.path, session.db_path)) {
+			session.db = prefetch.db;
+			session.db_profile = prefetch.profile;
+			prefetch.db = 0;
+			tune_database(session.db, session.db_profile);
+
+			INFO((stderr, "Database Adopted: %s (%s)\n", path_database(),
+			      DB_PROFILE_WRITE == session.db_profile ? "write" : "read"));
+			return;
+		}
+		join_database();
+	}
+
+	/* Readers stay off the shared database while a snapshot can serve them */
+	if (DB_PROFILE_READ == db_profile && TRUE == profile.snapshot)
+		snapshot_open = database_snapshot();
+
+	if (SQLITE_OK != sqlite3_open_v2(path_database(), &session.db, flags, 0)) {
 		ERROR((stderr, "Can't open database: %s\n%s\n",
-		       session.db_path, sqlite3_errmsg(session.db)));
+		       path_database(), sqlite3_errmsg(session.db)));
 		quit(-1);
 	}
 
-	INFO((stderr, "Database Changed: %s\n", session.db_path));
+	session.db_profile = db_profile;
+	tune_database(session.db, db_profile);
+
+	INFO((stderr, "Database Opened: %s (%s)\n", path_database(),
+	      DB_PROFILE_WRITE == db_profile ? "write" : "read"));
 }
 
+void
+prefetch_database(const char *path, int db_profile)
+{
+	if (FALSE == profile_loaded)
+		database_profile_load();
+
+	/* Snapshot readers open a copy, which is no startup work worth racing,
+	 * and on a single processor there is nothing to overlap with */
+	if (DB_PROFILE_NONE == db_profile || FALSE == profile.prefetch ||
+	    (DB_PROFILE_READ == db_profile && TRUE == profile.snapshot) ||
+	    TRUE == prefetch.started || sizeof(prefetch.path) <= strlen(path) ||
+	    2 > pool_threads(2))
+		return;
+
+	strcpy(prefetch.path, path);
+	prefetch.profile = db_profile;
+	prefetch.cancel = FALSE;
+	prefetch.done = FALSE;
+
+	if (0 == pthread_create(&prefetch.thread, 0, database_prefetch, 0))
+		prefetch.started = TRUE;
+}
+
+const char *
+path_database(void)
+{
+	return(TRUE == snapshot_open ? snapshot_path : session.db_path);
+}
+
+void
+signature_database(const char *path, DB_SIGNATURE *signature)
+{
+	char wal_path[FILENAME_MAX];
+	struct stat st;
+
+	memset(signature, 0, sizeof(*signature));
+
+	/*
+	 * Committed WAL frames leave the main file alone, watch both; an empty
+	 * WAL comes and goes with readers and says nothing about the content.
+	 */
+	if (0 == stat(path, &st)) {
+		signature->db[0] = (sqlite3_int64) st.st_ino;
+		signature->db[1] = (sqlite3_int64) st.st_size;
+		signature->db[2] = (sqlite3_int64) st.st_mtim.tv_sec;
+		signature->db[3] = (sqlite3_int64) st.st_mtim.tv_nsec;
+	}
+
+	snprintf(wal_path, sizeof(wal_path), "%s-wal", path);
+	if (0 == stat(wal_path, &st) && 0 < st.st_size) {
+		signature->wal[0] = (sqlite3_int64) st.st_ino;
+		signature->wal[1] = (sqlite3_int64) st.st_size;
+		signature->wal[2] = (sqlite3_int64) st.st_mtim.tv_sec;
+		signature->wal[3] = (sqlite3_int64) st.st_mtim.tv_nsec;
+	}
+}
+
+void
+tune_database(sqlite3 *db, int db_profile)
+{
+	char querystr[128];
+
+	if (FALSE == profile_loaded)
+		database_profile_load();
+
+	sqlite3_busy_timeout(db, profile.busy_timeout);
+
+	if (TRUE == trace.enabled) {
+		sqlite3_trace_v2(db, SQLITE_TRACE_STMT | SQLITE_TRACE_ROW, database_trace, 0);
+		sqlite3_commit_hook(db, database_commit, 0);
+	}
+
+	if (DB_PROFILE_WRITE == db_profile) {
+		/* Not every database allows it (network filesystems), that's fine */
+		if (TRUE == profile.wal)
+			sqlite3_exec(db, "PRAGMA journal_mode = WAL", 0, 0, 0);
+		return;
+	}
+
+	sprintf(querystr, "PRAGMA mmap_size = %lld", (long long) profile.mmap_size);
+	database_exec(db, querystr);
+	sprintf(querystr, "PRAGMA cache_size = %d", profile.cache_size);
+	database_exec(db, querystr);
+	database_exec(db, "PRAGMA temp_store = MEMORY");
+	database_exec(db, "PRAGMA query_only = 1");
+}
+
+void
+use_database(int db_profile)
+{
+	/* A write connection serves reads too, only ever upgrade */
+	if (0 != session.db && session.db_profile >= db_profile)
+		return;
+
+	stats_begin(STATS_PHASE_OPEN);
+	close_database();
+	open_database(db_profile);
+	stats_end(STATS_PHASE_OPEN);
+}
+
+/******************************************************************* local definitions */
+
+int
+database_commit(void *data)
+{
+	UNUSED(data);
+
+	pthread_mutex_lock(&trace.lock);
+	++trace.counts[DB_TRACE_COMMITS];
+	pthread_mutex_unlock(&trace.lock);
+
+	return(0);
+}
+
+void
+database_exec(sqlite3 *db, const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+void *
+database_prefetch(void *data)
+{
+	sqlite3 *db = 0;
+	sqlite3_stmt *stmt;
+	BOOL cancel;
+	int flags = (DB_PROFILE_WRITE == prefetch.profile) ? SQLITE_OPEN_READWRITE
+	                                                   : SQLITE_OPEN_READONLY;
+
+	UNUSED(data);
+
+	/* Failures are left for the foreground open to report */
+	if (SQLITE_OK != sqlite3_open_v2(prefetch.path, &db, flags, 0)) {
+		sqlite3_close(db);
+		database_prefetch_done();
+		return(0);
+	}
+
+	pthread_mutex_lock(&prefetch.lock);
+	prefetch.db = db;
+	cancel = prefetch.cancel;
+	pthread_mutex_unlock(&prefetch.lock);
+
+	if (TRUE == cancel) {
+		database_prefetch_done();
+		return(0);
+	}
+
+	/* Parses the schema and pulls the task pages into cache */
+	if (SQLITE_OK == sqlite3_prepare_v2(db, "SELECT `task_id`, `parent`, `name` FROM `Tasks`", -1, &stmt, 0)) {
+		while (SQLITE_ROW == sqlite3_step(stmt))
+			;
+		sqlite3_finalize(stmt);
+	}
+
+	database_prefetch_done();
+	return(0);
+}
+
+void
+database_prefetch_done(void)
+{
+	pthread_mutex_lock(&prefetch.lock);
+	prefetch.done = TRUE;
+	pthread_cond_signal(&prefetch.finished);
+	pthread_mutex_unlock(&prefetch.lock);
+}
+
+void
+database_prefetch_join(int wait)
+{
+	struct timespec deadline;
+
+	if (FALSE == prefetch.started)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += wait / 1000;
+	deadline.tv_nsec += (long) (wait % 1000) * 1000000L;
+	if (1000000000L <= deadline.tv_nsec) {
+		++deadline.tv_sec;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	/* Give the warm up a short while, only a slow one is cut short */
+	pthread_mutex_lock(&prefetch.lock);
+	while (FALSE == prefetch.done &&
+	       0 == pthread_cond_timedwait(&prefetch.finished, &prefetch.lock, &deadline))
+		;
+	if (FALSE == prefetch.done) {
+		prefetch.cancel = TRUE;
+		if (0 != prefetch.db)
+			sqlite3_interrupt(prefetch.db);
+	}
+	pthread_mutex_unlock(&prefetch.lock);
+
+	pthread_join(prefetch.thread, 0);
+	prefetch.started = FALSE;
+}
+
+void
+database_profile_load(void)
+{
+	static const char * const keys[] = {
+		"mmap_size", "cache_size", "busy_timeout", "prefetch", "snapshot", "wal", 0
+	};
+	char line[256];
+	char env[64];
+	const char *value;
+	FILE *in;
+	int i;
+
+	profile_loaded = TRUE;
+
+	if (0 != (value = getenv("CCHARM_SQL_BUDGET")))
+		database_trace_budget(value);
+
+	/* Config file first, environment overrides it */
+	if (0 != (in = fopen(DB_CONFIG_PATH, "r"))) {
+		while (fgets(line, sizeof(line), in)) {
+			char *key = line + strspn(line, " \t");
+			char *sep;
+
+			if ('#' == *key || 0 == (sep = strchr(key, '=')))
+				continue;
+
+			*sep = '\0';
+			key[strcspn(key, " \t")] = '\0';
+			value = sep + 1 + strspn(sep + 1, " \t");
+			sep[1 + strcspn(sep + 1, "\r\n")] = '\0';
+
+			database_profile_set(key, value);
+		}
+		fclose(in);
+	}
+
+	for (i = 0; keys[i]; ++i) {
+		size_t j;
+
+		strcpy(env, "CCHARM_");
+		for (j = 0; keys[i][j]; ++j)
+			env[7 + j] = (char) (keys[i][j] - ('a' <= keys[i][j] && 'z' >= keys[i][j] ? 32 : 0));
+		env[7 + j] = '\0';
+
+		if (0 != (value = getenv(env)))
+			database_profile_set(keys[i], value);
+	}
+}
+
+void
+database_profile_set(const char *key, const char *value)
+{
+	if (0 == strcmp("mmap_size", key))
+		profile.mmap_size = strtoll(value, 0, 10);
+	else if (0 == strcmp("cache_size", key))
+		profile.cache_size = atoi(value);
+	else if (0 == strcmp("busy_timeout", key))
+		profile.busy_timeout = atoi(value);
+	else if (0 == strcmp("prefetch", key))
+		profile.prefetch = (0 != atoi(value)) ? TRUE : FALSE;
+	else if (0 == strcmp("snapshot", key))
+		profile.snapshot = (0 != atoi(value)) ? TRUE : FALSE;
+	else if (0 == strcmp("wal", key))
+		profile.wal = (0 != atoi(value)) ? TRUE : FALSE;
+	else
+		WARNING((stderr, "Unknown database setting: %s\n", key));
+}
+
+BOOL
+database_snapshot(void)
+{
+	DB_SIGNATURE signature;
+	sqlite3_backup *backup;
+	sqlite3_stmt *stmt;
+	sqlite3 *source = 0;
+	sqlite3 *target = 0;
+	int remaining = -1;
+	int restarts = 0;
+	int slept = 0;
+	int ret;
+
+	snprintf(snapshot_path, sizeof(snapshot_path), "%s" SNAPSHOT_SUFFIX, session.db_path);
+
+	signature_database(session.db_path, &signature);
+	if (TRUE == database_snapshot_fresh(&signature))
+		return(TRUE);
+
+	if (SQLITE_OK != sqlite3_open_v2(session.db_path, &source, SQLITE_OPEN_READONLY, 0) ||
+	    SQLITE_OK != sqlite3_open_v2(snapshot_path, &target,
+	                                 SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0) ||
+	    0 == (backup = sqlite3_backup_init(target, "main", source, "main"))) {
+		WARNING((stderr, "Can't snapshot database: %s\n", snapshot_path));
+		sqlite3_close(source);
+		sqlite3_close(target);
+		return(FALSE);
+	}
+	sqlite3_busy_timeout(target, profile.busy_timeout);
+
+	/*
+	 * Copy in page batches; the source read lock is dropped between steps
+	 * so the desktop app can keep writing, a write by it simply restarts
+	 * the copy on the next step. Waits and restarts are both bounded, a
+	 * busy database is read live rather than waited on.
+	 */
+	do {
+		ret = sqlite3_backup_step(backup, DB_SNAPSHOT_PAGES);
+		if (SQLITE_BUSY == ret || SQLITE_LOCKED == ret) {
+			sqlite3_sleep(DB_SNAPSHOT_SLEEP);
+			slept += DB_SNAPSHOT_SLEEP;
+		} else if (SQLITE_OK == ret) {
+			if (0 <= remaining && sqlite3_backup_remaining(backup) > remaining)
+				++restarts;
+			remaining = sqlite3_backup_remaining(backup);
+		}
+	} while ((SQLITE_OK == ret || SQLITE_BUSY == ret || SQLITE_LOCKED == ret) &&
+	         slept < profile.busy_timeout && DB_SNAPSHOT_RESTARTS > restarts);
+	sqlite3_backup_finish(backup);
+	sqlite3_close(source);
+
+	if (SQLITE_DONE != ret) {
+		WARNING((stderr, "Can't snapshot database: %s\n%s\n", snapshot_path,
+		         SQLITE_OK == ret ? "source kept changing" : sqlite3_errstr(ret)));
+		sqlite3_close(target);
+		return(FALSE);
+	}
+
+	/* Signature taken before the copy, a change during it only costs a refresh */
+	ret = sqlite3_exec(target, "CREATE TABLE IF NOT EXISTS `ccharm_snapshot` (`signature` BLOB); "
+	                           "DELETE FROM `ccharm_snapshot`", 0, 0, 0);
+	if (SQLITE_OK == ret)
+		ret = sqlite3_prepare_v2(target, "INSERT INTO `ccharm_snapshot` VALUES (?)", -1, &stmt, NULL);
+	if (SQLITE_OK == ret) {
+		sqlite3_bind_blob(stmt, 1, &signature, sizeof(signature), SQLITE_STATIC);
+		sqlite3_step(stmt);
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(target);
+
+	INFO((stderr, "Database Snapshot: %s\n", snapshot_path));
+
+	return(TRUE);
+}
+
+BOOL
+database_snapshot_fresh(const DB_SIGNATURE *signature)
+{
+	sqlite3_stmt *stmt;
+	sqlite3 *db = 0;
+	BOOL fresh = FALSE;
+
+	if (SQLITE_OK == sqlite3_open_v2(snapshot_path, &db, SQLITE_OPEN_READONLY, 0) &&
+	    SQLITE_OK == sqlite3_prepare_v2(db, "SELECT `signature` FROM `ccharm_snapshot`",
+	                                    -1, &stmt, NULL)) {
+		if (SQLITE_ROW == sqlite3_step(stmt) &&
+		    sizeof(*signature) == (size_t) sqlite3_column_bytes(stmt, 0) &&
+		    0 == memcmp(signature, sqlite3_column_blob(stmt, 0), sizeof(*signature)))
+			fresh = TRUE;
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_close(db);
+
+	return(fresh);
+}
+
+int
+database_trace(unsigned type, void *data, void *p, void *x)
+{
+	const char *sql;
+	int i;
+
+	UNUSED(data);
+
+	pthread_mutex_lock(&trace.lock);
+
+	if (SQLITE_TRACE_ROW == type) {
+		++trace.counts[DB_TRACE_ROWS];
+	} else if (SQLITE_TRACE_STMT == type) {
+		++trace.counts[DB_TRACE_EXECUTED];
+
+		/* First run of a statement handle means it was just prepared */
+#ifdef SQLITE_STMTSTATUS_RUN
+		if (0 == sqlite3_stmt_status(p, SQLITE_STMTSTATUS_RUN, 0))
+			++trace.counts[DB_TRACE_PREPARED];
+#else
+		++trace.counts[DB_TRACE_PREPARED];
+#endif
+
+		sql = x;
+		for (i = 0; i < trace.log_count; ++i) {
+			if (0 == strcmp(sql, trace.log[i].sql))
+				break;
+		}
+		if (i < trace.log_count) {
+			++trace.log[i].executed;
+		} else if (DB_TRACE_LOG_MAX > trace.log_count) {
+			trace.log[i].sql = strdup(sql);
+			trace.log[i].executed = 1;
+			++trace.log_count;
+		} else ++trace.log_dropped;
+	}
+
+	pthread_mutex_unlock(&trace.lock);
+
+	return(0);
+}
+
+void
+database_trace_budget(const char *budget)
+{
+	char buffer[256];
+	char *item, *save;
+	int i;
+
+	/* "executed=10,commits=1", unlisted counters are unbounded */
+	for (i = 0; i < DB_TRACE_MAX; ++i)
+		trace.budget[i] = -1;
+	trace.enabled = TRUE;
+
+	strncpy(buffer, budget, sizeof(buffer) - 1);
+	buffer[sizeof(buffer) - 1] = '\0';
+
+	for (item = strtok_r(buffer, ", ", &save); item; item = strtok_r(0, ", ", &save)) {
+		char *sep = strchr(item, '=');
+
+		if (0 == sep)
+			continue;
+		*sep = '\0';
+
+		for (i = 0; i < DB_TRACE_MAX; ++i) {
+			if (0 == strcmp(trace_keys[i], item))
+				trace.budget[i] = atol(sep + 1);
+		}
+	}
+}
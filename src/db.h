@@ -27,12 +27,29 @@
 #ifndef DB_H
 #define DB_H 1
 
+#include <sqlite3.h>
+
 #include "common.h"
 
 /************************************************************************ declarations */
 
+enum {DB_PROFILE_NONE = 0, DB_PROFILE_READ = 1, DB_PROFILE_WRITE = 2};
+
+/* Identifies a database's content without opening it */
+typedef struct t_DB_SIGNATURE {
+	sqlite3_int64 db[4];
+	sqlite3_int64 wal[4];
+} DB_SIGNATURE;
+
+BOOL budget_database(void);
 void change_database(const char *);
 void close_database(void);
-void open_database(void);
+void join_database(void);
+void open_database(int profile);
+void prefetch_database(const char *, int profile);
+const char *path_database(void);
+void signature_database(const char *, DB_SIGNATURE *);
+void tune_database(sqlite3 *, int profile);
+void use_database(int profile);
 
 #endif
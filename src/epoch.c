@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "epoch.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stamp.h"
+
+/*************************************************************************** constants */
+
+#define EPOCH_BATCH 50000
+
+/* Charm stores local wall clock text, the shadow columns are UTC seconds */
+#define EPOCH_OF(column) "CAST(strftime('%%s', " column ", 'utc') AS INTEGER)"
+
+/************************************************************************ declarations */
+
+static BOOL          epoch_backfill(sqlite3 *, const char *, sqlite3_int64 *, int, sqlite3_int64 *);
+static void          epoch_exec(sqlite3 *, char *);
+
+/************************************************************************* definitions */
+
+BOOL
+epoch_available(sqlite3 *db, const char *schema)
+{
+	sqlite3_stmt *stmt;
+	char *querystr;
+	BOOL available = FALSE;
+
+	/* The index is only created once the backfill is through */
+	querystr = sqlite3_mprintf("SELECT 1 FROM %w.`sqlite_master` "
+	                           "WHERE `type` = 'index' AND `name` = 'ccharm_event_times_start'",
+	                           schema);
+	if (SQLITE_OK == sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL)) {
+		if (SQLITE_ROW == sqlite3_step(stmt))
+			available = TRUE;
+		sqlite3_finalize(stmt);
+	}
+	sqlite3_free(querystr);
+
+	return(available);
+}
+
+sqlite3_int64
+epoch_build(sqlite3 *db, const char *schema)
+{
+	sqlite3_int64 total = 0, last = 0;
+	BOOL more = TRUE;
+
+	if (TRUE == epoch_available(db, schema))
+		return(0);
+
+	/* Triggers first, so rows written while we backfill are caught too */
+	epoch_exec(db, sqlite3_mprintf("BEGIN IMMEDIATE"));
+	epoch_prepare(db, schema);
+	epoch_exec(db, sqlite3_mprintf("COMMIT"));
+
+	/* Short transactions, Charm may want to write in between */
+	while (TRUE == more) {
+		epoch_exec(db, sqlite3_mprintf("BEGIN IMMEDIATE"));
+		more = epoch_backfill(db, schema, &last, EPOCH_BATCH, &total);
+		epoch_exec(db, sqlite3_mprintf("COMMIT"));
+	}
+
+	epoch_exec(db, sqlite3_mprintf("BEGIN IMMEDIATE"));
+	epoch_finish(db, schema);
+	epoch_exec(db, sqlite3_mprintf("COMMIT"));
+
+	return(total);
+}
+
+void
+epoch_finish(sqlite3 *db, const char *schema)
+{
+	sqlite3_int64 last = 0, count = 0;
+
+	epoch_backfill(db, schema, &last, -1, &count);
+	epoch_exec(db, sqlite3_mprintf(
+	    "CREATE INDEX IF NOT EXISTS %w.`ccharm_event_times_start` "
+	    "ON `ccharm_event_times` (`start`)", schema));
+}
+
+BOOL
+epoch_parse(sqlite3 *db, const char *date, sqlite3_int64 *epoch)
+{
+	sqlite3_stmt *stmt;
+	BOOL parsed = FALSE;
+	int64_t parsed_epoch;
+
+	const char querystr[] = "SELECT CAST(strftime('%s', ?, 'utc') AS INTEGER)";
+
+	/* SQLite still knows the forms we don't, 'now' and Julian days among them */
+	if (TRUE == stamp_epoch(date, strlen(date), &parsed_epoch)) {
+		*epoch = (sqlite3_int64) parsed_epoch;
+		return(TRUE);
+	}
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, sizeof(querystr), &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	sqlite3_bind_text(stmt, 1, date, -1, SQLITE_STATIC);
+	if (SQLITE_ROW == sqlite3_step(stmt) && SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+		*epoch = sqlite3_column_int64(stmt, 0);
+		parsed = TRUE;
+	}
+	sqlite3_finalize(stmt);
+
+	return(parsed);
+}
+
+void
+epoch_prepare(sqlite3 *db, const char *schema)
+{
+	epoch_exec(db, sqlite3_mprintf(
+	    "CREATE TABLE IF NOT EXISTS %w.`ccharm_event_times` ("
+	        "`id` INTEGER PRIMARY KEY, `task` INTEGER, `start` INTEGER, `end` INTEGER)",
+	    schema));
+
+	/* Triggers live in the database, so Charm's own writes keep them current */
+	epoch_exec(db, sqlite3_mprintf(
+	    "CREATE TRIGGER IF NOT EXISTS %w.`ccharm_event_times_insert` "
+	    "AFTER INSERT ON `Events` BEGIN "
+	        "INSERT OR REPLACE INTO `ccharm_event_times` VALUES (NEW.`id`, NEW.`task`, "
+	            EPOCH_OF("NEW.`start`") ", " EPOCH_OF("NEW.`end`") "); "
+	    "END", schema));
+	epoch_exec(db, sqlite3_mprintf(
+	    "CREATE TRIGGER IF NOT EXISTS %w.`ccharm_event_times_update` "
+	    "AFTER UPDATE OF `id`, `task`, `start`, `end` ON `Events` BEGIN "
+	        "DELETE FROM `ccharm_event_times` WHERE `id` = OLD.`id`; "
+	        "INSERT OR REPLACE INTO `ccharm_event_times` VALUES (NEW.`id`, NEW.`task`, "
+	            EPOCH_OF("NEW.`start`") ", " EPOCH_OF("NEW.`end`") "); "
+	    "END", schema));
+	epoch_exec(db, sqlite3_mprintf(
+	    "CREATE TRIGGER IF NOT EXISTS %w.`ccharm_event_times_delete` "
+	    "AFTER DELETE ON `Events` BEGIN "
+	        "DELETE FROM `ccharm_event_times` WHERE `id` = OLD.`id`; "
+	    "END", schema));
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+epoch_backfill(sqlite3 *db, const char *schema, sqlite3_int64 *last, int batch, sqlite3_int64 *count)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 hi = 0;
+	char *querystr;
+
+	/* Walk Events by id from where the previous batch stopped */
+	querystr = sqlite3_mprintf("SELECT MAX(`id`) FROM (SELECT `id` FROM %w.`Events` "
+	                           "WHERE `id` > %lld ORDER BY `id` LIMIT %d)",
+	                           schema, (long long) *last, batch);
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		quit(-1);
+	}
+	assert(stmt);
+	if (SQLITE_ROW == sqlite3_step(stmt))
+		hi = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+	sqlite3_free(querystr);
+
+	if (hi <= *last)
+		return(FALSE);
+
+	/* Rows the triggers already shadowed are newer, keep those */
+	epoch_exec(db, sqlite3_mprintf(
+	    "INSERT OR IGNORE INTO %w.`ccharm_event_times` "
+	    "SELECT `id`, `task`, " EPOCH_OF("`start`") ", " EPOCH_OF("`end`") " "
+	    "FROM %w.`Events` WHERE `id` > %lld AND `id` <= %lld",
+	    schema, schema, (long long) *last, (long long) hi));
+	*last = hi;
+	*count += sqlite3_changes(db);
+
+	return(TRUE);
+}
+
+void
+epoch_exec(sqlite3 *db, char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+	sqlite3_free(querystr);
+}
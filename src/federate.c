@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "federate.h"
+
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "pool.h"
+#include "query.h"
+#include "session.h"
+#include "task.h"
+
+/************************************************************************ declarations */
+
+struct t_FEDERATE_JOB {
+	const char *path;
+	const char *tag;
+	const char *keyword;
+	int         limit;
+	char       *result;
+	size_t      result_len;
+	BOOL        failed;
+	BOOL        aborted;
+};
+
+static BOOL federate_flush(struct t_FEDERATE_JOB *, int *);
+static void federate_worker(void *, int);
+
+/********************************************************************* local variables */
+
+static char *federated[FEDERATE_DB_MAX];
+static int   federated_count;
+
+/************************************************************************* definitions */
+
+void
+federate_add(const char *path)
+{
+	if (FEDERATE_DB_MAX <= federated_count) {
+		ERROR((stderr, "Too many federated databases (max %d).\nAbort.\n",
+		       FEDERATE_DB_MAX));
+		quit(-1);
+	}
+
+	federated[federated_count++] = strdup(path);
+	INFO((stderr, "Database Federated: %s\n", path));
+}
+
+BOOL
+federate_active(void)
+{
+	return(0 < federated_count ? TRUE : FALSE);
+}
+
+void
+federate_clear(void)
+{
+	while (0 < federated_count)
+		free(federated[--federated_count]);
+}
+
+void
+federate_tasks(const char *keyword, int limit)
+{
+	struct t_FEDERATE_JOB jobs[FEDERATE_DB_MAX + 1];
+	POOL pool;
+	BOOL more = TRUE;
+	BOOL aborted = FALSE;
+	int jobs_count;
+	int i;
+
+	/* A bad query fails every database alike, report it once up front */
+	if (FALSE == query_valid(keyword))
+		quit(-1);
+
+	/* Settles the read profile before workers tune their own connections */
+	use_database(DB_PROFILE_READ);
+
+	/* Primary database goes first, federated ones follow in argument order */
+	memset(jobs, 0, sizeof(jobs));
+	jobs[0].path = path_database();
+	jobs[0].tag  = session.db_path;
+	for (i = 0; i < federated_count; ++i)
+		jobs[i + 1].path = jobs[i + 1].tag = federated[i];
+	jobs_count = federated_count + 1;
+	for (i = 0; i < jobs_count; ++i) {
+		jobs[i].keyword = keyword;
+		jobs[i].limit = limit;
+	}
+
+	pool = pool_create(FEDERATE_THREADS_MAX, jobs_count, federate_worker, jobs);
+
+	/*
+	 * Merge results in database order; each database is flushed as soon as
+	 * it and all the ones before it are done, so the total wait is bound by
+	 * the slowest database rather than the sum of all of them.
+	 */
+	for (i = 0; i < jobs_count; ++i) {
+		pool_wait(pool, i);
+
+		if (TRUE == jobs[i].aborted)
+			aborted = TRUE;
+		else if (TRUE == jobs[i].failed)
+			ERROR((stderr, "Can't open database: %s\n", jobs[i].tag));
+		else if (jobs[i].result && FALSE == aborted && TRUE == more)
+			more = federate_flush(&jobs[i], &limit);
+		free(jobs[i].result);
+	}
+
+	/* Workers can't quit under the pool, their errors are raised once all joined */
+	pool_destroy(pool);
+
+	if (TRUE == aborted) {
+		for (i = 0; i < jobs_count; ++i) {
+			if (TRUE == jobs[i].aborted)
+				ERROR((stderr, "Can't search database: %s\n", jobs[i].tag));
+		}
+		quit(-1);
+	}
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+federate_flush(struct t_FEDERATE_JOB *job, int *limit)
+{
+	size_t len = job->result_len;
+
+	/*
+	 * Workers stop at the limit each, the merge cuts it down to the total;
+	 * a task ends where the next line isn't an indented parent.
+	 */
+	if (0 < *limit) {
+		size_t off;
+
+		for (off = 0; off < len; ++off) {
+			if ('\n' == job->result[off] &&
+			    (off + 1 == len || ' ' != job->result[off + 1]) && 0 == --*limit) {
+				len = off + 1;
+				break;
+			}
+		}
+	}
+
+	if (len != fwrite(job->result, 1, len, stdout) || 0 != fflush(stdout))
+		return(FALSE);
+
+	return(0 != *limit || 0 == job->limit);
+}
+
+void
+federate_worker(void *data, int index)
+{
+	struct t_FEDERATE_JOB *job = (struct t_FEDERATE_JOB *)data + index;
+	sqlite3 *db = 0;
+	FILE *out;
+
+	/* Each worker owns its connection, sqlite handles can't be shared */
+	if (SQLITE_OK != sqlite3_open_v2(job->path, &db, SQLITE_OPEN_READONLY, 0)) {
+		job->failed = TRUE;
+	} else if (0 == (out = open_memstream(&job->result, &job->result_len))) {
+		job->failed = TRUE;
+	} else {
+		tune_database(db, DB_PROFILE_READ);
+		if (FALSE == task_tasks_query(db, job->keyword, out, job->tag, job->limit))
+			job->aborted = TRUE;
+		fclose(out);
+	}
+	sqlite3_close(db);
+}
@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "frecency.h"
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <math.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "epoch.h"
+#include "session.h"
+#include "stamp.h"
+#include "task.h"
+
+/*************************************************************************** constants */
+
+static const char frecency_magic[8] = "CCHFRC1";
+
+#define FRECENCY_HALF_LIFE (FRECENCY_HALF_LIFE_DAYS * 86400.)
+
+/************************************************************************ declarations */
+
+/*
+ * Scores are use counts decayed exponentially by age, stored as of the
+ * reference time in the header. Events past the high water mark are
+ * folded in on refresh, so Events is only ever scanned once.
+ */
+struct t_FRECENCY_HEADER {
+	char          magic[8];
+	int64_t       db_dev;
+	int64_t       db_ino;
+	sqlite3_int64 high_water;
+	int64_t       reference;
+	uint32_t      count;
+};
+
+struct t_FRECENCY_SCORE {
+	int    task_id;
+	double score;
+};
+
+static int    frecency_compare(const void *, const void *);
+static void   frecency_heap_down(struct t_FRECENCY_SCORE *, int, int);
+static BOOL   frecency_heap_less(const struct t_FRECENCY_SCORE *, const struct t_FRECENCY_SCORE *);
+static void   frecency_load(const struct stat *);
+static double frecency_score(int);
+static void   frecency_save(void);
+
+/********************************************************************* local variables */
+
+static struct t_FRECENCY_HEADER header;
+static struct t_FRECENCY_SCORE *scores;
+static size_t                   scores_capacity;
+
+/************************************************************************* definitions */
+
+void
+frecency_invalidate(void)
+{
+	unlink(FRECENCY_CACHE_PATH);
+}
+
+int
+frecency_rank(const int *ids, int count, int *ranked, int top)
+{
+	struct t_FRECENCY_SCORE *heap;
+	int heap_count = 0;
+	int i;
+
+	if (0 >= top)
+		return(0);
+
+	/* Bounded min-heap, the root is the weakest of the best so far */
+	heap = malloc(sizeof(struct t_FRECENCY_SCORE) * (size_t) top);
+	for (i = 0; i < count; ++i) {
+		struct t_FRECENCY_SCORE candidate;
+
+		candidate.task_id = ids[i];
+		candidate.score = frecency_score(ids[i]);
+
+		if (heap_count < top) {
+			int child = heap_count++;
+
+			heap[child] = candidate;
+			while (0 < child && frecency_heap_less(&heap[child], &heap[(child - 1) / 2])) {
+				struct t_FRECENCY_SCORE swap = heap[child];
+				heap[child] = heap[(child - 1) / 2];
+				heap[(child - 1) / 2] = swap;
+				child = (child - 1) / 2;
+			}
+		} else if (frecency_heap_less(&heap[0], &candidate)) {
+			heap[0] = candidate;
+			frecency_heap_down(heap, heap_count, 0);
+		}
+	}
+
+	/* Pop weakest first, filling the result back to front */
+	for (i = heap_count; 0 < i; --i) {
+		ranked[i - 1] = heap[0].task_id;
+		heap[0] = heap[i - 1];
+		frecency_heap_down(heap, i - 1, 0);
+	}
+
+	free(heap);
+
+	return(heap_count);
+}
+
+void
+frecency_refresh(void)
+{
+	sqlite3_stmt *stmt;
+	struct stat db_stat;
+	size_t count;
+	time_t now = time(0);
+	double decay;
+	BOOL epoch;
+	int ret;
+	size_t i;
+
+	const char textstr[] =
+	    "SELECT `id`, `task`, `end` FROM `Events` "
+	    "WHERE (`id` > ?) ORDER BY `task`";
+	const char epochstr[] =
+	    "SELECT `id`, `task`, `end` FROM `ccharm_event_times` "
+	    "WHERE (`id` > ?) ORDER BY `task`";
+	const char *querystr;
+
+	use_database(DB_PROFILE_READ);
+
+	if (0 != stat(session.db_path, &db_stat)) {
+		ERROR((stderr, "Can't stat database: %s\n", session.db_path));
+		quit(-1);
+	}
+	frecency_load(&db_stat);
+
+	/* Age everything to now, new events are then weighted against now too */
+	decay = exp2(-difftime(now, (time_t) header.reference) / FRECENCY_HALF_LIFE);
+	for (i = 0; i < header.count; ++i)
+		scores[i].score *= decay;
+	header.reference = (int64_t) now;
+
+	epoch = epoch_available(session.db, "main");
+	querystr = TRUE == epoch ? epochstr : textstr;
+	ret = sqlite3_prepare_v2(session.db, querystr, -1, &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+	sqlite3_bind_int64(stmt, 1, header.high_water);
+
+	/* Rows come grouped by task, look each task up once per group */
+	count = header.count;
+	{
+		struct t_FRECENCY_SCORE *current = 0;
+
+		while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+			sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+			int task_id = sqlite3_column_int(stmt, 1);
+			int64_t end = 0;
+			double age;
+
+			/* Ages are against UTC now, like the shadow times already are */
+			if (TRUE == epoch)
+				end = sqlite3_column_int64(stmt, 2);
+			else if (FALSE == stamp_epoch((const char *) sqlite3_column_text(stmt, 2),
+			                              (size_t) sqlite3_column_bytes(stmt, 2), &end))
+				end = 0;
+			age = difftime(now, (time_t) end);
+
+			if (0 == current || current->task_id != task_id) {
+				struct t_FRECENCY_SCORE key;
+
+				key.task_id = task_id;
+				current = bsearch(&key, scores, header.count,
+				                  sizeof(struct t_FRECENCY_SCORE), frecency_compare);
+				if (0 == current) {
+					if (count == scores_capacity) {
+						scores_capacity = scores_capacity ? scores_capacity * 2 : 256;
+						scores = realloc(scores, scores_capacity * sizeof(struct t_FRECENCY_SCORE));
+					}
+					current = &scores[count++];
+					current->task_id = task_id;
+					current->score = 0;
+				}
+			}
+
+			current->score += exp2(-age / FRECENCY_HALF_LIFE);
+			if (id > header.high_water)
+				header.high_water = id;
+		}
+	}
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_finalize(stmt);
+
+	if (count != header.count) {
+		header.count = (uint32_t) count;
+		qsort(scores, count, sizeof(struct t_FRECENCY_SCORE), frecency_compare);
+	}
+
+	frecency_save();
+}
+
+/******************************************************************* local definitions */
+
+int
+frecency_compare(const void *a, const void *b)
+{
+	return(((const struct t_FRECENCY_SCORE *)a)->task_id -
+	       ((const struct t_FRECENCY_SCORE *)b)->task_id);
+}
+
+void
+frecency_heap_down(struct t_FRECENCY_SCORE *heap, int count, int parent)
+{
+	for (;;) {
+		int child = parent * 2 + 1;
+		struct t_FRECENCY_SCORE swap;
+
+		if (child >= count)
+			break;
+		if (child + 1 < count && frecency_heap_less(&heap[child + 1], &heap[child]))
+			++child;
+		if (FALSE == frecency_heap_less(&heap[child], &heap[parent]))
+			break;
+
+		swap = heap[child];
+		heap[child] = heap[parent];
+		heap[parent] = swap;
+		parent = child;
+	}
+}
+
+BOOL
+frecency_heap_less(const struct t_FRECENCY_SCORE *a, const struct t_FRECENCY_SCORE *b)
+{
+	/* Ties favour the lower task id */
+	if (a->score != b->score)
+		return(a->score < b->score ? TRUE : FALSE);
+	return(a->task_id > b->task_id ? TRUE : FALSE);
+}
+
+void
+frecency_load(const struct stat *db_stat)
+{
+	sqlite3_stmt *stmt;
+	sqlite3_int64 max_id = 0;
+	FILE *in;
+
+	const char querystr[] = "SELECT MAX(`id`) FROM `Events`";
+
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+	if (SQLITE_ROW == sqlite3_step(stmt))
+		max_id = sqlite3_column_int64(stmt, 0);
+	sqlite3_finalize(stmt);
+
+	if (0 != (in = fopen(FRECENCY_CACHE_PATH, "rb"))) {
+		if (1 == fread(&header, sizeof(header), 1, in) &&
+		    0 == memcmp(header.magic, frecency_magic, sizeof(header.magic)) &&
+		    header.db_dev == (int64_t) db_stat->st_dev &&
+		    header.db_ino == (int64_t) db_stat->st_ino &&
+		    header.high_water <= max_id) {
+			scores_capacity = header.count ? header.count : 1;
+			scores = malloc(scores_capacity * sizeof(struct t_FRECENCY_SCORE));
+			if (header.count == fread(scores, sizeof(struct t_FRECENCY_SCORE), header.count, in)) {
+				fclose(in);
+				return;
+			}
+			free(scores);
+		}
+		fclose(in);
+	}
+
+	/* Missing, foreign or rewound (events removed), start from scratch */
+	INFO((stderr, "Frecency cache rebuilt.\n"));
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, frecency_magic, sizeof(header.magic));
+	header.db_dev = (int64_t) db_stat->st_dev;
+	header.db_ino = (int64_t) db_stat->st_ino;
+	header.reference = (int64_t) time(0);
+	scores = 0;
+	scores_capacity = 0;
+}
+
+double
+frecency_score(int task_id)
+{
+	struct t_FRECENCY_SCORE key;
+	struct t_FRECENCY_SCORE *found;
+	double score = 0;
+	int i;
+
+	key.task_id = task_id;
+	found = bsearch(&key, scores, header.count, sizeof(struct t_FRECENCY_SCORE), frecency_compare);
+	if (found)
+		score = found->score;
+
+	/* Recent slots weigh in by position, they're not part of the cache */
+	for (i = 0; i < MAX_TASK_RECENT_LEN; ++i) {
+		if (task_id == recent.tasks[i].task_id)
+			score += (double) (MAX_TASK_RECENT_LEN - i) / MAX_TASK_RECENT_LEN;
+	}
+
+	return(score);
+}
+
+void
+frecency_save(void)
+{
+	FILE *out;
+
+	if (0 == (out = fopen(FRECENCY_CACHE_PATH ".tmp", "wb"))) {
+		WARNING((stderr, "Unable to write frecency cache.\n"));
+		return;
+	}
+
+	fwrite(&header, sizeof(header), 1, out);
+	if (header.count)
+		fwrite(scores, sizeof(struct t_FRECENCY_SCORE), header.count, out);
+
+	if (0 != fclose(out) || 0 != rename(FRECENCY_CACHE_PATH ".tmp", FRECENCY_CACHE_PATH))
+		WARNING((stderr, "Unable to write frecency cache.\n"));
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "history.h"
+
+#include <assert.h>
+#include <sqlite3.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "db.h"
+#include "epoch.h"
+#include "report.h"
+#include "session.h"
+#include "tree.h"
+
+/*************************************************************************** constants */
+
+#define HISTORY_DEPTH_MAX 64
+#define HISTORY_FROM_ALL  "0000-00-00"
+#define HISTORY_UNTIL_ALL "9999-99-99"
+
+/*
+ * Keyset pagination: resume strictly below the last (start, id) seen,
+ * so every page is one index range scan however deep it is. Shadow
+ * times key it on integers where they exist, as compact and audit do.
+ * Both take the events table, then the subtree below.
+ */
+const char history_text_query[] =
+	"SELECT `id`, `task`, `comment`, `start`, `end` FROM `%s` "
+	"WHERE (`start` >= ?2) AND (`start` < ?3) "
+	  "AND (?1 = 0 OR `task` = ?1 OR `task` IN (%s)) "
+	  "AND (?4 ISNULL OR `start` < ?4 OR (`start` = ?4 AND `id` < ?5)) "
+	"ORDER BY `start` DESC, `id` DESC "
+	"LIMIT ?6";
+const char history_epoch_query[] =
+	"SELECT `e`.`id`, `e`.`task`, `e`.`comment`, `e`.`start`, `e`.`end` "
+	"FROM `ccharm_event_times` AS `t` CROSS JOIN `%s` AS `e` ON `e`.`id` = `t`.`id` "
+	"WHERE (`t`.`start` >= ?2) AND (`t`.`start` < ?3) "
+	  "AND (?1 = 0 OR `t`.`task` = ?1 OR `t`.`task` IN (%s)) "
+	  "AND (?4 ISNULL OR `t`.`start` < ?4 OR (`t`.`start` = ?4 AND `t`.`id` < ?5)) "
+	"ORDER BY `t`.`start` DESC, `t`.`id` DESC "
+	"LIMIT ?6";
+
+/* A subtree is one range of the task tree, or a walk down the parents without it */
+const char history_ranged_query[] =
+	"SELECT `d`.`task_id` FROM `ccharm_tree`.`tree` AS `r`, `ccharm_tree`.`tree` AS `d` "
+	"WHERE `r`.`task_id` = ?1 AND `d`.`pre` BETWEEN `r`.`pre` AND `r`.`post`";
+const char history_walk_query[] =
+	"WITH RECURSIVE `subtree`(`task_id`) AS ("
+	    "SELECT ?1 "
+	    "UNION SELECT `Tasks`.`task_id` FROM `Tasks`, `subtree` "
+	    "WHERE `Tasks`.`parent` = `subtree`.`task_id`) "
+	"SELECT `task_id` FROM `subtree`";
+
+/************************************************************************ declarations */
+
+struct t_HISTORY_PATH {
+	int   task_id;
+	char *path;
+};
+
+struct t_HISTORY_PATHS {
+	struct t_HISTORY_PATH *slots;
+	size_t                 capacity;
+	size_t                 count;
+	sqlite3_stmt          *stmt;
+};
+
+static BOOL        history_bound(const char *, const char *, sqlite3_int64, sqlite3_int64 *);
+static BOOL        history_cursor_decode(const char *, char *, size_t, sqlite3_int64 *);
+static void        history_cursor_encode(const char *, sqlite3_int64);
+static BOOL        history_cursor_epoch(const char *, sqlite3_int64, sqlite3_int64 *);
+static const char *history_path(struct t_HISTORY_PATHS *, int, int);
+static void        history_paths_free(struct t_HISTORY_PATHS *);
+static void        history_paths_insert(struct t_HISTORY_PATHS *, int, char *);
+
+/************************************************************************* definitions */
+
+void
+history_init(HISTORY_QUERY *query)
+{
+	query->from = HISTORY_FROM_ALL;
+	query->until = HISTORY_UNTIL_ALL;
+	query->cursor = 0;
+	query->task_id = 0;
+	query->limit = HISTORY_PAGE_SIZE;
+}
+
+void
+history_log(const HISTORY_QUERY *query)
+{
+	struct t_HISTORY_PATHS paths;
+	sqlite3_stmt *stmt;
+	char cursor_start[64];
+	char last_start[64];
+	sqlite3_int64 cursor_id, last_id = 0;
+	sqlite3_int64 from_epoch = 0, until_epoch = 0, cursor_epoch = 0;
+	BOOL epoch;
+	int rows = 0;
+	int ret;
+
+	char querystr[1024];
+	const char *events;
+	const char *tpl;
+
+	cursor_id = 0;
+	if (query->cursor &&
+	    FALSE == history_cursor_decode(query->cursor, cursor_start, sizeof(cursor_start), &cursor_id)) {
+		ERROR((stderr, "Invalid log cursor: %s\nAbort.\n", query->cursor));
+		quit(-1);
+	}
+
+	use_database(DB_PROFILE_READ);
+
+	/* Archived years in range are read through a view over all partitions */
+	events = archive_view(session.db, query->from, query->until);
+
+	/* Shadow times only cover the live Events, anything unconvertible stays on text */
+	epoch = 0 == strcmp("Events", events) && epoch_available(session.db, "main") &&
+	        history_bound(query->from, HISTORY_FROM_ALL, INT64_MIN, &from_epoch) &&
+	        history_bound(query->until, HISTORY_UNTIL_ALL, INT64_MAX, &until_epoch) &&
+	        (0 == query->cursor || history_cursor_epoch(cursor_start, cursor_id, &cursor_epoch))
+	        ? TRUE : FALSE;
+	tpl = TRUE == epoch ? history_epoch_query : history_text_query;
+
+	snprintf(querystr, sizeof(querystr), tpl, events,
+	         TRUE == tree_attach(session.db) ? history_ranged_query : history_walk_query);
+
+	ret = sqlite3_prepare_v2(session.db, querystr, -1, &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	sqlite3_bind_int(stmt, 1, query->task_id);
+	if (TRUE == epoch) {
+		sqlite3_bind_int64(stmt, 2, from_epoch);
+		sqlite3_bind_int64(stmt, 3, until_epoch);
+		if (query->cursor)
+			sqlite3_bind_int64(stmt, 4, cursor_epoch);
+	} else {
+		sqlite3_bind_text(stmt, 2, query->from, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, query->until, -1, SQLITE_STATIC);
+		if (query->cursor)
+			sqlite3_bind_text(stmt, 4, cursor_start, -1, SQLITE_STATIC);
+	}
+	if (query->cursor)
+		sqlite3_bind_int64(stmt, 5, cursor_id);
+	sqlite3_bind_int(stmt, 6, query->limit);
+
+	memset(&paths, 0, sizeof(paths));
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *comment = (const char *) sqlite3_column_text(stmt, 2);
+		const char *start = (const char *) sqlite3_column_text(stmt, 3);
+		int task_id = sqlite3_column_int(stmt, 1);
+
+		last_id = sqlite3_column_int64(stmt, 0);
+		strncpy(last_start, start ? start : "", sizeof(last_start) - 1);
+		last_start[sizeof(last_start) - 1] = '\0';
+
+		printf("%s  %s  [%04d] %s", last_start,
+		       report_duration(report_span(stmt, 3)),
+		       task_id, history_path(&paths, task_id, 0));
+		if (comment && *comment)
+			printf(" (%s)", comment);
+		printf("\n");
+
+		++rows;
+	}
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_finalize(stmt);
+	history_paths_free(&paths);
+
+	/* A full page might have more behind it */
+	if (rows == query->limit && 0 < rows)
+		history_cursor_encode(last_start, last_id);
+	printf("\n");
+}
+
+BOOL
+history_option(HISTORY_QUERY *query, const char *option, const char *value)
+{
+	if (0 == strcmp("--from", option))
+		query->from = value;
+	else if (0 == strcmp("--until", option))
+		query->until = value;
+	else if (0 == strcmp("--after", option))
+		query->cursor = value;
+	else if (0 == strcmp("--task", option))
+		query->task_id = atoi(value);
+	else if (0 == strcmp("--limit", option))
+		query->limit = atoi(value);
+	else
+		return(FALSE);
+
+	return(TRUE);
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+history_bound(const char *date, const char *all, sqlite3_int64 open, sqlite3_int64 *epoch)
+{
+	/* The default bounds aren't dates, they just leave the range open */
+	if (0 == strcmp(all, date)) {
+		*epoch = open;
+		return(TRUE);
+	}
+
+	return(epoch_parse(session.db, date, epoch));
+}
+
+BOOL
+history_cursor_decode(const char *cursor, char *start, size_t size, sqlite3_int64 *id)
+{
+	char decoded[128];
+	char *sep;
+	size_t i, len = strlen(cursor);
+
+	if (0 != len % 2 || len / 2 >= sizeof(decoded))
+		return(FALSE);
+
+	for (i = 0; i < len / 2; ++i) {
+		unsigned int byte;
+
+		if (1 != sscanf(cursor + i * 2, "%2x", &byte))
+			return(FALSE);
+		decoded[i] = (char) byte;
+	}
+	decoded[i] = '\0';
+
+	if (0 == (sep = strchr(decoded, '|')) || (size_t) (sep - decoded) >= size)
+		return(FALSE);
+
+	*sep = '\0';
+	strcpy(start, decoded);
+	*id = strtoll(sep + 1, 0, 10);
+
+	return(TRUE);
+}
+
+void
+history_cursor_encode(const char *start, sqlite3_int64 id)
+{
+	char raw[128];
+	size_t i;
+
+	snprintf(raw, sizeof(raw), "%s|%lld", start, (long long) id);
+
+	printf("Next: ");
+	for (i = 0; raw[i]; ++i)
+		printf("%02x", (unsigned char) raw[i]);
+	printf("\n");
+}
+
+BOOL
+history_cursor_epoch(const char *start, sqlite3_int64 id, sqlite3_int64 *epoch)
+{
+	sqlite3_stmt *stmt;
+	BOOL found = FALSE;
+
+	const char querystr[] =
+	    "SELECT `t`.`start` FROM `ccharm_event_times` AS `t` CROSS JOIN `Events` AS `e` "
+	    "ON `e`.`id` = `t`.`id` WHERE `t`.`id` = ?1 AND `e`.`start` = ?2";
+
+	/* The row the cursor ends on has the exact shadow time, unless it changed since */
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	sqlite3_bind_int64(stmt, 1, id);
+	sqlite3_bind_text(stmt, 2, start, -1, SQLITE_STATIC);
+	if (SQLITE_ROW == sqlite3_step(stmt) && SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+		*epoch = sqlite3_column_int64(stmt, 0);
+		found = TRUE;
+	}
+	sqlite3_finalize(stmt);
+
+	return(TRUE == found ? TRUE : epoch_parse(session.db, start, epoch));
+}
+
+const char *
+history_path(struct t_HISTORY_PATHS *paths, int task_id, int depth)
+{
+	const char *parent_path = 0;
+	char *leaf = 0;
+	char *path;
+	int parent = 0;
+	size_t i, len;
+
+	const char querystr[] =
+	    "SELECT `parent`, `name` FROM `Tasks` WHERE `task_id` = ? LIMIT 1";
+
+	if (0 < paths->capacity) {
+		i = ((size_t) task_id * 2654435761u) & (paths->capacity - 1);
+		while (0 != paths->slots[i].task_id) {
+			if (task_id == paths->slots[i].task_id)
+				return(paths->slots[i].path);
+			i = (i + 1) & (paths->capacity - 1);
+		}
+	}
+
+	/* Each task is resolved once, ancestors come out of the memo */
+	if (0 == paths->stmt &&
+	    SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &paths->stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+
+	sqlite3_bind_int(paths->stmt, 1, task_id);
+	if (SQLITE_ROW == sqlite3_step(paths->stmt)) {
+		parent = sqlite3_column_int(paths->stmt, 0);
+		if (sqlite3_column_text(paths->stmt, 1))
+			leaf = strdup((const char *) sqlite3_column_text(paths->stmt, 1));
+	}
+	sqlite3_reset(paths->stmt);
+
+	/* Guard against cycles in broken trees */
+	if (0 != parent && parent != task_id && HISTORY_DEPTH_MAX > depth)
+		parent_path = history_path(paths, parent, depth + 1);
+
+	len = (leaf ? strlen(leaf) : 1) + (parent_path ? strlen(parent_path) + 1 : 0) + 1;
+	path = malloc(len);
+	snprintf(path, len, "%s%s%s", parent_path ? parent_path : "",
+	         parent_path ? "/" : "", leaf ? leaf : "?");
+	free(leaf);
+
+	if (paths->count * 2 >= paths->capacity) {
+		struct t_HISTORY_PATH *old = paths->slots;
+		size_t old_capacity = paths->capacity;
+
+		paths->capacity = old_capacity ? old_capacity * 2 : 64;
+		paths->slots = calloc(paths->capacity, sizeof(struct t_HISTORY_PATH));
+		paths->count = 0;
+		for (i = 0; i < old_capacity; ++i) {
+			if (0 != old[i].task_id)
+				history_paths_insert(paths, old[i].task_id, old[i].path);
+		}
+		free(old);
+	}
+	history_paths_insert(paths, task_id, path);
+
+	return(path);
+}
+
+void
+history_paths_insert(struct t_HISTORY_PATHS *paths, int task_id, char *path)
+{
+	size_t i = ((size_t) task_id * 2654435761u) & (paths->capacity - 1);
+
+	while (0 != paths->slots[i].task_id)
+		i = (i + 1) & (paths->capacity - 1);
+
+	paths->slots[i].task_id = task_id;
+	paths->slots[i].path = path;
+	++paths->count;
+}
+
+void
+history_paths_free(struct t_HISTORY_PATHS *paths)
+{
+	size_t i;
+
+	for (i = 0; i < paths->capacity; ++i)
+		free(paths->slots[i].path);
+	free(paths->slots);
+	sqlite3_finalize(paths->stmt);
+	memset(paths, 0, sizeof(struct t_HISTORY_PATHS));
+}
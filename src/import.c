@@ -0,0 +1,755 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "import.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "db.h"
+#include "session.h"
+#include "task.h"
+
+/*************************************************************************** constants */
+
+#define IMPORT_COLUMNS_MAX 16
+#define IMPORT_ERRORS_MAX  10
+#define IMPORT_KEY_LEN     32
+#define IMPORT_DATE_LEN    64
+
+enum {
+	IMPORT_FIELD_NONE,
+	IMPORT_FIELD_TASK_ID,
+	IMPORT_FIELD_PARENT,
+	IMPORT_FIELD_NAME,
+	IMPORT_FIELD_TRACKABLE,
+	IMPORT_FIELD_VALIDFROM,
+	IMPORT_FIELD_VALIDUNTIL
+};
+
+/************************************************************************ declarations */
+
+/*
+ * Task definitions are read one byte at a time through stdio, either as
+ * Charm's XML export (<task taskid=".." parentid="..">Name</task>, fields
+ * as attributes or child elements) or as CSV with a header row. Only
+ * the task being read is held in memory; every one is written through
+ * prepared statements as soon as it is complete, all in one transaction
+ * that is only committed once parent links and cycles check out.
+ */
+struct t_IMPORT_TEXT {
+	char   data[MAX_TASK_NAME_LEN + 1];
+	size_t len;
+};
+
+struct t_IMPORT_TASK {
+	int  line;
+	BOOL invalid;
+	BOOL has_task_id;
+	BOOL has_name;
+	int  task_id;
+	int  parent;
+	int  trackable;
+	char name[MAX_TASK_NAME_LEN + 1];
+	char validfrom[IMPORT_DATE_LEN];
+	char validuntil[IMPORT_DATE_LEN];
+};
+
+struct t_IMPORT {
+	FILE         *in;
+	int           line;
+	sqlite3_stmt *insert;
+	sqlite3_stmt *update;
+	sqlite3_stmt *seen;
+	int           inserted;
+	int           updated;
+	int           unchanged;
+	int           errors;
+};
+
+static BOOL import_check(void);
+static void import_csv(struct t_IMPORT *);
+static void import_entity(struct t_IMPORT *, struct t_IMPORT_TEXT *);
+static void import_error(struct t_IMPORT *, int, const char *, ...);
+static void import_exec(const char *);
+static int  import_field(const char *);
+static int  import_getc(struct t_IMPORT *);
+static void import_prepare(const char *, sqlite3_stmt **);
+static void import_reset(struct t_IMPORT *, struct t_IMPORT_TASK *);
+static void import_set(struct t_IMPORT *, struct t_IMPORT_TASK *, int, const char *);
+static void import_skip(struct t_IMPORT *, const char *);
+static void import_store(struct t_IMPORT *, struct t_IMPORT_TASK *);
+static void import_text_add(struct t_IMPORT_TEXT *, int);
+static void import_xml(struct t_IMPORT *);
+static int  import_xml_name(struct t_IMPORT *, char *, size_t);
+
+/************************************************************************* definitions */
+
+void
+import_tasks(const char *path, BOOL dry_run)
+{
+	struct t_IMPORT import;
+	int c;
+
+	memset(&import, 0, sizeof(import));
+	import.line = 1;
+
+	if (0 == strcmp("-", path))
+		import.in = stdin;
+	else if (0 == (import.in = fopen(path, "r"))) {
+		ERROR((stderr, "Can't read task definitions: %s\n", path));
+		quit(-1);
+	}
+
+	use_database(DB_PROFILE_WRITE);
+
+	import_exec("BEGIN IMMEDIATE");
+	import_exec("CREATE TEMP TABLE IF NOT EXISTS `ccharm_import` (`task_id` INTEGER PRIMARY KEY)");
+	import_exec("DELETE FROM temp.`ccharm_import`");
+
+	import_prepare("INSERT OR IGNORE INTO `Tasks` "
+	               "(`task_id`, `parent`, `name`, `trackable`, `validfrom`, `validuntil`) "
+	               "VALUES (?1, ?2, ?3, ?4, ?5, ?6)", &import.insert);
+	import_prepare("UPDATE `Tasks` SET `parent` = ?2, `name` = ?3, `trackable` = ?4, "
+	                                  "`validfrom` = ?5, `validuntil` = ?6 "
+	               "WHERE `task_id` = ?1 AND (`parent` IS NOT ?2 OR `name` IS NOT ?3 "
+	                 "OR `trackable` IS NOT ?4 OR `validfrom` IS NOT ?5 OR `validuntil` IS NOT ?6)",
+	               &import.update);
+	import_prepare("INSERT OR IGNORE INTO temp.`ccharm_import` VALUES (?1)", &import.seen);
+
+	/* Skip a byte order mark, then the first character tells the format */
+	while (EOF != (c = import_getc(&import)) && (isspace(c) || 0xef == c || 0xbb == c || 0xbf == c))
+		;
+	if (EOF != c) {
+		ungetc(c, import.in);
+
+		if ('<' == c)
+			import_xml(&import);
+		else
+			import_csv(&import);
+	}
+
+	if (stdin != import.in)
+		fclose(import.in);
+
+	sqlite3_finalize(import.insert);
+	sqlite3_finalize(import.update);
+	sqlite3_finalize(import.seen);
+
+	if (0 < import.errors || FALSE == import_check()) {
+		import_exec("ROLLBACK");
+		ERROR((stderr, "Import aborted, no task was changed.\n"));
+		quit(-1);
+	}
+
+	if (TRUE == dry_run)
+		import_exec("ROLLBACK");
+	else
+		import_exec("COMMIT");
+
+	printf("%s %d task(s): %d new, %d updated, %d unchanged.\n",
+	       dry_run ? "Would import" : "Imported",
+	       import.inserted + import.updated + import.unchanged,
+	       import.inserted, import.updated, import.unchanged);
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+import_check(void)
+{
+	sqlite3_stmt *stmt;
+	int *ids = 0, *parents = 0;
+	char *marks;
+	int count = 0;
+	int capacity = 0;
+	int errors = 0;
+	int i;
+
+	/* Parents must exist, checked for the imported tasks only */
+	import_prepare("SELECT `t`.`task_id`, `t`.`parent` "
+	               "FROM temp.`ccharm_import` AS `i` JOIN `Tasks` AS `t` ON `t`.`task_id` = `i`.`task_id` "
+	               "WHERE `t`.`parent` != 0 "
+	                 "AND NOT EXISTS (SELECT 1 FROM `Tasks` AS `p` WHERE `p`.`task_id` = `t`.`parent`)",
+	               &stmt);
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		if (errors++ < IMPORT_ERRORS_MAX)
+			ERROR((stderr, "Task %d: parent %d doesn't exist.\n",
+			       sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1)));
+	}
+	sqlite3_finalize(stmt);
+
+	/*
+	 * Cycles are looked for in the whole table, they would send
+	 * task_recurse_name() around forever whoever made them. Tasks are
+	 * read in task id order so parents can be found by bisection.
+	 */
+	import_prepare("SELECT `task_id`, `parent` FROM `Tasks` ORDER BY `task_id`", &stmt);
+	while (SQLITE_ROW == sqlite3_step(stmt)) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 1024;
+			ids = realloc(ids, sizeof(int) * (size_t) capacity);
+			parents = realloc(parents, sizeof(int) * (size_t) capacity);
+		}
+		ids[count] = sqlite3_column_int(stmt, 0);
+		parents[count++] = sqlite3_column_int(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+
+	/* Parents become indexes, -1 when there is none */
+	for (i = 0; i < count; ++i) {
+		int lo = 0, hi = count;
+		int parent = parents[i];
+
+		parents[i] = -1;
+		while (0 != parent && lo < hi) {
+			int mid = lo + (hi - lo) / 2;
+
+			if (ids[mid] == parent) {
+				parents[i] = mid;
+				break;
+			}
+			if (ids[mid] < parent)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	/* 0 unvisited, 1 on the walk in progress, 2 known to reach a root */
+	marks = calloc((size_t) count + 1, 1);
+	for (i = 0; i < count; ++i) {
+		int j;
+
+		for (j = i; -1 != j && 0 == marks[j]; j = parents[j])
+			marks[j] = 1;
+
+		if (-1 != j && 1 == marks[j] && errors++ < IMPORT_ERRORS_MAX)
+			ERROR((stderr, "Task %d: parent %d closes a cycle.\n", ids[j], ids[parents[j]]));
+
+		for (j = i; -1 != j && 1 == marks[j]; j = parents[j])
+			marks[j] = 2;
+	}
+
+	free(marks);
+	free(parents);
+	free(ids);
+
+	return(0 == errors);
+}
+
+void
+import_csv(struct t_IMPORT *import)
+{
+	struct t_IMPORT_TASK def;
+	struct t_IMPORT_TEXT text;
+	int columns[IMPORT_COLUMNS_MAX];
+	int column = 0;
+	BOOL header = TRUE;
+	BOOL quoted = FALSE;
+	BOOL content = FALSE;
+	int c;
+
+	import_reset(import, &def);
+	memset(&text, 0, sizeof(text));
+	memset(columns, 0, sizeof(columns));
+
+	for (;;) {
+		c = import_getc(import);
+
+		if (TRUE == quoted) {
+			if (EOF != c && '"' != c) {
+				import_text_add(&text, c);
+				continue;
+			}
+			/* A doubled quote is a quote, anything else ends the field */
+			if ('"' == c && '"' == (c = import_getc(import))) {
+				import_text_add(&text, c);
+				continue;
+			}
+			quoted = FALSE;
+		}
+
+		if (EOF == c || '\n' == c || ',' == c) {
+			/* Unknown columns, and those past the last known one, are ignored */
+			while (0 < text.len && TRUE == header && isspace((unsigned char) text.data[text.len - 1]))
+				--text.len;
+			text.data[text.len] = '\0';
+			if (column < IMPORT_COLUMNS_MAX) {
+				if (TRUE == header) {
+					char *key = text.data;
+
+					while (isspace((unsigned char) *key))
+						++key;
+					columns[column] = import_field(key);
+				} else import_set(import, &def, columns[column], text.data);
+			}
+			content = content || 0 < text.len || ',' == c;
+			text.len = 0;
+			++column;
+
+			if (',' != c) {
+				if (TRUE == content && TRUE == header)
+					header = FALSE;
+				else if (TRUE == content)
+					import_store(import, &def);
+
+				import_reset(import, &def);
+				column = 0;
+				content = FALSE;
+			}
+			if (EOF == c)
+				break;
+		} else if ('\r' == c) {
+			continue;
+		} else if ('"' == c && 0 == text.len) {
+			quoted = TRUE;
+		} else import_text_add(&text, c);
+	}
+}
+
+void
+import_entity(struct t_IMPORT *import, struct t_IMPORT_TEXT *text)
+{
+	char entity[12];
+	size_t len = 0;
+	long code = -1;
+	int c;
+
+	while (EOF != (c = import_getc(import)) && ';' != c && len + 1 < sizeof(entity))
+		entity[len++] = (char) c;
+	entity[len] = '\0';
+
+	if ('#' == entity[0])
+		code = 'x' == entity[1] ? strtol(entity + 2, 0, 16) : strtol(entity + 1, 0, 10);
+	else if (0 == strcmp("amp", entity))
+		code = '&';
+	else if (0 == strcmp("lt", entity))
+		code = '<';
+	else if (0 == strcmp("gt", entity))
+		code = '>';
+	else if (0 == strcmp("quot", entity))
+		code = '"';
+	else if (0 == strcmp("apos", entity))
+		code = '\'';
+
+	/* Unknown entities are kept as written */
+	if (code <= 0 || 0x10ffff < code) {
+		import_text_add(text, '&');
+		for (len = 0; entity[len]; ++len)
+			import_text_add(text, entity[len]);
+		if (';' == c)
+			import_text_add(text, ';');
+		return;
+	}
+
+	if (code < 0x80) {
+		import_text_add(text, (int) code);
+	} else if (code < 0x800) {
+		import_text_add(text, (int) (0xc0 | (code >> 6)));
+		import_text_add(text, (int) (0x80 | (code & 0x3f)));
+	} else if (code < 0x10000) {
+		import_text_add(text, (int) (0xe0 | (code >> 12)));
+		import_text_add(text, (int) (0x80 | ((code >> 6) & 0x3f)));
+		import_text_add(text, (int) (0x80 | (code & 0x3f)));
+	} else {
+		import_text_add(text, (int) (0xf0 | (code >> 18)));
+		import_text_add(text, (int) (0x80 | ((code >> 12) & 0x3f)));
+		import_text_add(text, (int) (0x80 | ((code >> 6) & 0x3f)));
+		import_text_add(text, (int) (0x80 | (code & 0x3f)));
+	}
+}
+
+void
+import_error(struct t_IMPORT *import, int line, const char *format, ...)
+{
+	va_list args;
+
+	if (import->errors++ >= IMPORT_ERRORS_MAX)
+		return;
+
+	fprintf(stderr, "Line %d: ", line);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fprintf(stderr, ".\n");
+}
+
+void
+import_exec(const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+int
+import_field(const char *key)
+{
+	if (0 == strcasecmp("taskid", key) || 0 == strcasecmp("task_id", key) || 0 == strcasecmp("id", key))
+		return(IMPORT_FIELD_TASK_ID);
+	if (0 == strcasecmp("parentid", key) || 0 == strcasecmp("parent_id", key) || 0 == strcasecmp("parent", key))
+		return(IMPORT_FIELD_PARENT);
+	if (0 == strcasecmp("name", key))
+		return(IMPORT_FIELD_NAME);
+	if (0 == strcasecmp("trackable", key))
+		return(IMPORT_FIELD_TRACKABLE);
+	if (0 == strcasecmp("validfrom", key) || 0 == strcasecmp("valid_from", key))
+		return(IMPORT_FIELD_VALIDFROM);
+	if (0 == strcasecmp("validuntil", key) || 0 == strcasecmp("valid_until", key))
+		return(IMPORT_FIELD_VALIDUNTIL);
+
+	return(IMPORT_FIELD_NONE);
+}
+
+int
+import_getc(struct t_IMPORT *import)
+{
+	int c = getc(import->in);
+
+	if ('\n' == c)
+		++import->line;
+
+	return(c);
+}
+
+void
+import_prepare(const char *querystr, sqlite3_stmt **stmt)
+{
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(*stmt);
+}
+
+void
+import_reset(struct t_IMPORT *import, struct t_IMPORT_TASK *def)
+{
+	memset(def, 0, sizeof(*def));
+	def->line = import->line;
+	def->trackable = 1;
+}
+
+void
+import_set(struct t_IMPORT *import, struct t_IMPORT_TASK *def, int field, const char *value)
+{
+	char *end;
+	long number;
+
+	/* Empty values are as good as missing */
+	while (isspace((unsigned char) *value))
+		++value;
+	if ('\0' == *value)
+		return;
+
+	switch (field) {
+	case IMPORT_FIELD_TASK_ID:
+	case IMPORT_FIELD_PARENT:
+		number = strtol(value, &end, 10);
+		while (isspace((unsigned char) *end))
+			++end;
+		if (*end || number < 0 || 2147483647 < number || (IMPORT_FIELD_TASK_ID == field && 0 == number)) {
+			import_error(import, def->line, "invalid %s '%s'",
+			             IMPORT_FIELD_TASK_ID == field ? "task id" : "parent", value);
+			def->invalid = TRUE;
+			return;
+		}
+		if (IMPORT_FIELD_TASK_ID == field) {
+			def->task_id = (int) number;
+			def->has_task_id = TRUE;
+		} else def->parent = (int) number;
+		break;
+	case IMPORT_FIELD_NAME:
+		snprintf(def->name, sizeof(def->name), "%s", value);
+		def->has_name = TRUE;
+		break;
+	case IMPORT_FIELD_TRACKABLE:
+		def->trackable = (0 == strcasecmp("true", value) || 0 == strcasecmp("yes", value)
+		                   || 0 != atoi(value)) ? 1 : 0;
+		break;
+	case IMPORT_FIELD_VALIDFROM:
+		snprintf(def->validfrom, sizeof(def->validfrom), "%s", value);
+		break;
+	case IMPORT_FIELD_VALIDUNTIL:
+		snprintf(def->validuntil, sizeof(def->validuntil), "%s", value);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+import_skip(struct t_IMPORT *import, const char *until)
+{
+	size_t len = strlen(until);
+	size_t matched = 0;
+	int c;
+
+	/* Good enough for the terminators we look for, none repeats its start */
+	while (matched < len && EOF != (c = import_getc(import))) {
+		if (c == until[matched])
+			++matched;
+		else
+			matched = (c == until[0]) ? 1 : 0;
+	}
+}
+
+void
+import_store(struct t_IMPORT *import, struct t_IMPORT_TASK *def)
+{
+	sqlite3_stmt *stmt;
+	char *name;
+	size_t len;
+	int i;
+
+	if (TRUE == def->invalid)
+		return;
+	if (FALSE == def->has_task_id) {
+		import_error(import, def->line, "task without an id");
+		return;
+	}
+	if (def->parent == def->task_id) {
+		import_error(import, def->line, "task %d is its own parent", def->task_id);
+		return;
+	}
+
+	/* Names come trimmed, exports tend to indent element text */
+	name = def->name;
+	while (isspace((unsigned char) *name))
+		++name;
+	for (len = strlen(name); 0 < len && isspace((unsigned char) name[len - 1]); --len)
+		name[len - 1] = '\0';
+
+	for (i = 0; i < 2; ++i) {
+		stmt = 0 == i ? import->insert : import->update;
+
+		sqlite3_bind_int(stmt, 1, def->task_id);
+		sqlite3_bind_int(stmt, 2, def->parent);
+		sqlite3_bind_text(stmt, 3, name, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, 4, def->trackable);
+		if (def->validfrom[0])
+			sqlite3_bind_text(stmt, 5, def->validfrom, -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_null(stmt, 5);
+		if (def->validuntil[0])
+			sqlite3_bind_text(stmt, 6, def->validuntil, -1, SQLITE_STATIC);
+		else
+			sqlite3_bind_null(stmt, 6);
+
+		if (SQLITE_DONE != sqlite3_step(stmt)) {
+			ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+			quit(-1);
+		}
+		sqlite3_reset(stmt);
+
+		/* New tasks are done after the insert, known ones only change if they differ */
+		if (0 < sqlite3_changes(session.db)) {
+			if (0 == i)
+				++import->inserted;
+			else
+				++import->updated;
+			break;
+		}
+		if (1 == i)
+			++import->unchanged;
+	}
+
+	sqlite3_bind_int(import->seen, 1, def->task_id);
+	if (SQLITE_DONE != sqlite3_step(import->seen)) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_reset(import->seen);
+}
+
+void
+import_text_add(struct t_IMPORT_TEXT *text, int c)
+{
+	/* Longer values are cut, there is nowhere to put them anyway */
+	if (text->len < sizeof(text->data) - 1)
+		text->data[text->len++] = (char) c;
+}
+
+void
+import_xml(struct t_IMPORT *import)
+{
+	struct t_IMPORT_TASK def;
+	struct t_IMPORT_TEXT text;
+	char element[IMPORT_KEY_LEN];
+	BOOL in_task = FALSE;
+	int field = IMPORT_FIELD_NONE;
+	int c;
+
+	import_reset(import, &def);
+	memset(&text, 0, sizeof(text));
+
+	while (EOF != (c = import_getc(import))) {
+		if ('&' == c) {
+			if (TRUE == in_task)
+				import_entity(import, &text);
+			continue;
+		}
+		if ('<' != c) {
+			if (TRUE == in_task)
+				import_text_add(&text, c);
+			continue;
+		}
+
+		c = import_getc(import);
+		if ('?' == c) {
+			import_skip(import, "?>");
+		} else if ('!' == c) {
+			/* Comments and declarations are skipped, CDATA is text */
+			c = import_getc(import);
+			if ('-' == c) {
+				import_skip(import, "-->");
+			} else if ('[' == c) {
+				int brackets = 0;
+
+				import_skip(import, "CDATA[");
+				while (EOF != (c = import_getc(import))) {
+					if (']' == c) {
+						++brackets;
+						continue;
+					}
+					if ('>' == c && 2 <= brackets) {
+						for (brackets -= 2; 0 < brackets; --brackets) {
+							if (TRUE == in_task)
+								import_text_add(&text, ']');
+						}
+						break;
+					}
+					for (; 0 < brackets; --brackets) {
+						if (TRUE == in_task)
+							import_text_add(&text, ']');
+					}
+					if (TRUE == in_task)
+						import_text_add(&text, c);
+				}
+			} else import_skip(import, ">");
+		} else if ('/' == c) {
+			if ('>' != import_xml_name(import, element, sizeof(element)))
+				import_skip(import, ">");
+			text.data[text.len] = '\0';
+
+			if (TRUE == in_task && 0 == strcasecmp("task", element)) {
+				if (FALSE == def.has_name)
+					import_set(import, &def, IMPORT_FIELD_NAME, text.data);
+				import_store(import, &def);
+				in_task = FALSE;
+			} else if (TRUE == in_task && IMPORT_FIELD_NONE != field) {
+				import_set(import, &def, field, text.data);
+				field = IMPORT_FIELD_NONE;
+			}
+			text.len = 0;
+		} else {
+			BOOL task_element;
+
+			ungetc(c, import->in);
+			c = import_xml_name(import, element, sizeof(element));
+			task_element = 0 == strcasecmp("task", element);
+
+			if (TRUE == task_element) {
+				import_reset(import, &def);
+				in_task = TRUE;
+			} else field = TRUE == in_task ? import_field(element) : IMPORT_FIELD_NONE;
+			text.len = 0;
+
+			/* Attributes, only those of task elements matter */
+			while (EOF != c && '>' != c && '/' != c) {
+				struct t_IMPORT_TEXT value;
+				char key[IMPORT_KEY_LEN];
+				int quote;
+
+				c = import_xml_name(import, key, sizeof(key));
+				while (isspace(c))
+					c = import_getc(import);
+				if ('=' != c) {
+					if (EOF != c && '>' != c && '/' != c)
+						ungetc(c, import->in);
+					continue;
+				}
+
+				while (isspace(c = import_getc(import)))
+					;
+				if ('"' != c && '\'' != c)
+					break;
+				quote = c;
+
+				memset(&value, 0, sizeof(value));
+				while (EOF != (c = import_getc(import)) && quote != c) {
+					if ('&' == c)
+						import_entity(import, &value);
+					else
+						import_text_add(&value, c);
+				}
+				value.data[value.len] = '\0';
+
+				if (TRUE == task_element)
+					import_set(import, &def, import_field(key), value.data);
+				c = import_getc(import);
+			}
+
+			if ('/' == c) {
+				import_skip(import, ">");
+				if (TRUE == task_element) {
+					import_store(import, &def);
+					in_task = FALSE;
+				}
+				field = IMPORT_FIELD_NONE;
+			}
+		}
+	}
+}
+
+int
+import_xml_name(struct t_IMPORT *import, char *name, size_t size)
+{
+	size_t len = 0;
+	int c;
+
+	while (isspace(c = import_getc(import)))
+		;
+
+	/* Returns the character that ended the name */
+	while (EOF != c && !isspace(c) && '>' != c && '/' != c && '=' != c) {
+		if (len + 1 < size)
+			name[len++] = (char) c;
+		c = import_getc(import);
+	}
+	name[len] = '\0';
+
+	return(c);
+}
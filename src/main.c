@@ -29,14 +29,27 @@
 #include <sys/stat.h>
 
 #include <fcntl.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "audit.h"
+#include "compact.h"
+#include "complete.h"
 #include "db.h"
+#include "federate.h"
+#include "history.h"
+#include "import.h"
+#include "optimize.h"
+#include "report.h"
 #include "session.h"
+#include "stats.h"
+#include "sync.h"
 #include "task.h"
+#include "watch.h"
 
 /****************************************************************** external variables */
 
@@ -52,7 +65,8 @@ static int    exit_code;
 /************************************************************************ declarations */
 
 static void finalize(void);
-static void initialize(void);
+static void initialize(int, char **);
+static void prefetch(int, char **);
 static void print_help(const char *);
 static void process_arguments(int, char **);
 
@@ -61,9 +75,15 @@ static void process_arguments(int, char **);
 int
 main(int argc, char ** argv)
 {
-	initialize();
+	stats_start();
 
+	stats_begin(STATS_PHASE_INIT);
+	initialize(argc, argv);
+	stats_end(STATS_PHASE_INIT);
+
+	stats_begin(STATS_PHASE_COMMAND);
 	process_arguments(argc, argv);
+	stats_end(STATS_PHASE_COMMAND);
 
 	finalize();
 
@@ -75,24 +95,42 @@ main(int argc, char ** argv)
 void
 finalize(void)
 {
+	stats_begin(STATS_PHASE_FINISH);
+
+	join_database();
 	close_database();
+	federate_clear();
+
+	if (FALSE == budget_database())
+		exit_code = -1;
 
 	/* Storage current task */
-	task_save(session.taskfd);
-	close(session.taskfd);
+	if (session.taskstate) {
+		task_save(session.taskstate);
+		state_close(session.taskstate);
+		session.taskstate = 0;
+	}
 
-	task_bookmark_save(session.bookmarkfd);
-	close(session.bookmarkfd);
+	if (session.bookmarkstate) {
+		task_bookmark_save(session.bookmarkstate);
+		state_close(session.bookmarkstate);
+		session.bookmarkstate = 0;
+	}
 
-	task_recent_save(session.recentfd);
-	close(session.recentfd);
+	if (session.recentstate) {
+		task_recent_save(session.recentstate);
+		state_close(session.recentstate);
+		session.recentstate = 0;
+	}
 
 	free(session.db_path);
 	free(session.home_path);
+
+	stats_record();
 }
 
 void
-initialize(void)
+initialize(int argc, char **argv)
 {
 	int fd;
 
@@ -100,10 +138,14 @@ initialize(void)
 	session.db_path      = malloc(session.max_path);
 	session.home_path    = malloc(session.max_path);
 	session.db           = 0;
+	session.db_profile   = DB_PROFILE_NONE;
 
 	/* Set exit code to normal */
 	exit_code            = 0;
 
+	/* Writes to a closed pipe fail with EPIPE instead, so output can stop early */
+	signal(SIGPIPE, SIG_IGN);
+
 	/* Set default Charm path */
 	strcpy(session.home_path, getenv("HOME"));
 	strcat(session.home_path, "/"CHARM_DIRECTORY);
@@ -124,26 +166,85 @@ initialize(void)
 		change_database(CHARM_DB_DEBUG);
 	}
 
+	/* Open the database behind the state files and argument parsing */
+	prefetch(argc, argv);
+
 	/* Load current task */
-	if (-1 == (session.taskfd = open(TASK_PATH, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR))) {
+	if (0 == (session.taskstate = state_open(TASK_PATH, sizeof(TASK)))) {
 		ERROR((stderr, "Unable to access task file.\n"));
 		quit(-1);
 	}
-	task_load(session.taskfd);
+	task_load(session.taskstate);
 
 	/* Load bookmark tasks */
-	if (-1 == (session.bookmarkfd = open(BOOKMARK_TASKS_PATH, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR))) {
+	if (0 == (session.bookmarkstate = state_open(BOOKMARK_TASKS_PATH, sizeof(TASK_BOOKMARK)))) {
 		ERROR((stderr, "Unable to access bookmarked tasks file.\n"));
 		quit(-1);
 	}
-	task_bookmark_load(session.bookmarkfd);
+	task_bookmark_load(session.bookmarkstate);
 
 	/* Load recent tasks */
-	if (-1 == (session.recentfd = open(RECENT_TASKS_PATH, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR))) {
+	if (0 == (session.recentstate = state_open(RECENT_TASKS_PATH, sizeof(TASK_RECENT)))) {
 		ERROR((stderr, "Unable to access recent tasks file.\n"));
 		quit(-1);
 	}
-	task_recent_load(session.recentfd);
+	task_recent_load(session.recentstate);
+}
+
+void
+prefetch(int argc, char **argv)
+{
+	static const struct {
+		const char *command;
+		int         profile;
+	} commands[] = {
+		{"archive",      DB_PROFILE_WRITE},
+		{"audit",        DB_PROFILE_READ},
+		{"compact",      DB_PROFILE_WRITE},
+		{"import-tasks", DB_PROFILE_WRITE},
+		{"log",          DB_PROFILE_READ},
+		{"optimize",     DB_PROFILE_WRITE},
+		{"report",       DB_PROFILE_READ},
+		{"stop",         DB_PROFILE_WRITE},
+		{"sync",         DB_PROFILE_WRITE},
+		{"tasks",        DB_PROFILE_READ},
+		{0,              DB_PROFILE_NONE}
+	};
+	const char *path = session.db_path;
+	int db_profile = DB_PROFILE_NONE;
+	int i, j;
+
+	/* Guess what the first command needs, a wrong guess only wastes the warm up */
+	for (i = 1; i < argc; ++i) {
+		if ('-' != argv[i][0]) {
+			for (j = 0; commands[j].command; ++j)
+				if (0 == strcasecmp(commands[j].command, argv[i]))
+					break;
+			if (db_profile < commands[j].profile)
+				db_profile = commands[j].profile;
+
+			if (0 == strcasecmp("audit", argv[i])) {
+				for (j = i + 1; j < argc && '-' == argv[j][0]; ++j) {
+					if (0 == strcmp("--fix", argv[j]))
+						db_profile = DB_PROFILE_WRITE;
+					else
+						++j;
+				}
+			}
+			break;
+		}
+
+		/* Every option but help takes a value */
+		if (i + 1 >= argc)
+			break;
+		if ((0 == strcmp("--charm-db", argv[i])) || (0 == strcmp("-C", argv[i])))
+			path = argv[i + 1];
+		else if ((0 == strcmp("--task-id", argv[i])) || (0 == strcmp("-i", argv[i])))
+			db_profile = DB_PROFILE_READ;
+		++i;
+	}
+
+	prefetch_database(path, db_profile);
 }
 
 void
@@ -154,21 +255,37 @@ print_help(const char * cmd)
 	       "\n", cmd);
 
 	printf("  Commands: help                          This thing your reading right now.\n"
+	       "            archive        [DATE]         Move events before date to yearly archives.\n"
+	       "            audit [--fix] [--gap S] [--max S]\n"
+	       "                                          Report (or trim) overlapping, gapped and long events.\n"
 	       "            bookmark       [INDEX]        Bookmark current task.\n"
 	       "            bookmarks                     Print out bookmarked tasks.\n"
+	       "            compact [-n] [--gap SECONDS]  Merge back to back event fragments.\n"
+	       "            complete [WHAT] [PREFIX]      Print out shell completions.\n"
 	       "            discard                       Discard current task.\n"
+	       "            import-tasks [-n]   [PATH]    Upsert task definitions from XML or CSV.\n"
+	       "            optimize [-n, --dry-run]      Index and analyze charm db.\n"
 	       "            recent                        Print out recent tasks.\n");
 	printf("            start                         Start task timer.\n"
-	       "            status                        Print out current task.\n"
+	       "            stats          [--reset]      Print out (or reset) latency percentiles.\n"
+	       "            status         [-w, --watch]  Print out current task.\n"
 	       "            stop                          Stop task timer and save.\n"
+	       "            sync [-n]      [PATH]         Exchange new events with another charm db.\n"
 	       "            wipe                          Discard and wipe task clean.\n"
 	       "\n");
 
-	printf("   Queries: tasks [KEYWORD]               Print out tasks matching keyword.\n"
+	printf("   Queries: log [--from DATE] [--until DATE] [--task ID] [--limit N] [--after CURSOR]\n"
+	       "                                          Print out logged events, newest first.\n"
+	       "            report [FROM] [UNTIL]         Print out time spent per task.\n"
+	       "            tasks [-l N]   [KEYWORD]      Print out (first N) tasks matching keyword.\n"
+	       "            tasks -t [N] [KEYWORD]        Print out top N most used matching tasks.\n"
+	       "                                          Keywords combine with AND, OR, NOT or -word,\n"
+	       "                                          ( ) and \"quoted phrases\"; a/b matches b below a.\n"
 	       "\n");
 
 	printf("   Options: -h, --help                    This thing your reading right now.\n"
 	       "            -C, --charm-db [PATH]         Override default charm db path.\n"
+	       "            -D, --federate-db [PATH]      Also query another charm db (repeatable).\n"
 	       "            -b, --bookmark [INDEX]        Clone bookmarked task.\n"
 	       "            -c, --comment  [COMMENT]      Change comment for current task.\n"
 	       "            -i, --task-id  [ID]           Change id for current task.\n"
@@ -186,6 +303,7 @@ process_arguments(int argc, char **argv)
 	register int i;
 
 	if (argc <= 1) {
+		stats_command("none");
 		task_print();
 		exit_code = (TRUE == task_active() ? 1 : 0);
 	}
@@ -196,9 +314,37 @@ process_arguments(int argc, char **argv)
 		const char is_command = ('-' != argv[i][0]);
 
 		if (is_command) {
+			stats_command(argv[i]);
+
 			if (0 == strcasecmp("help", argv[i])) {
 				print_help(argv[0]);
 				quit(0);
+			} else if (0 == strcasecmp("archive", argv[i])) {
+				if ( ++i >= argc ) {
+					ERROR((stderr, "No archive cutoff date was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				archive_events(argv[i]);
+				INFO((stderr, "Events archived.\n"));
+			} else if (0 == strcasecmp("audit", argv[i])) {
+				BOOL fix = FALSE;
+				int gap = AUDIT_GAP;
+				int max = AUDIT_MAX;
+
+				for (;;) {
+					if (i + 1 < argc && 0 == strcmp("--fix", argv[i + 1])) {
+						fix = TRUE;
+						++i;
+					} else if (i + 2 < argc && 0 == strcmp("--gap", argv[i + 1])) {
+						gap = atoi(argv[i + 2]);
+						i += 2;
+					} else if (i + 2 < argc && 0 == strcmp("--max", argv[i + 1])) {
+						max = atoi(argv[i + 2]);
+						i += 2;
+					} else break;
+				}
+				audit(gap, max, fix);
+				INFO((stderr, "Events audited.\n"));
 			} else if (0 == strcasecmp("bookmark", argv[i])) {
 				if ( ++i >= argc ) {
 					ERROR((stderr, "No bookmark index was specified.\nAbort.\n"));
@@ -208,9 +354,56 @@ process_arguments(int argc, char **argv)
 				INFO((stderr, "Tasks bookmarked.\n"));
 			} else if (0 == strcasecmp("bookmarks", argv[i])) {
 				task_bookmark_print();
+			} else if (0 == strcasecmp("compact", argv[i])) {
+				BOOL dry_run = FALSE;
+				int gap = COMPACT_GAP;
+
+				for (;;) {
+					if (i + 1 < argc &&
+					    ((0 == strcmp("--dry-run", argv[i + 1])) ||
+					     (0 == strcmp("-n",        argv[i + 1])))) {
+						dry_run = TRUE;
+						++i;
+					} else if (i + 2 < argc && 0 == strcmp("--gap", argv[i + 1])) {
+						gap = atoi(argv[i + 2]);
+						i += 2;
+					} else break;
+				}
+				compact(gap, dry_run);
+				INFO((stderr, "Events compacted.\n"));
+			} else if (0 == strcasecmp("complete", argv[i])) {
+				if ( ++i >= argc ) {
+					ERROR((stderr, "No completion was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				complete(argv[i], i + 1 < argc ? argv[i + 1] : "");
+				i = argc;
 			} else if (0 == strcasecmp("discard", argv[i])) {
 				task_clear(FALSE);
 				INFO((stderr, "Task discarted.\n"));
+			} else if (0 == strcasecmp("import-tasks", argv[i])) {
+				BOOL dry_run = FALSE;
+
+				if (i + 1 < argc &&
+				    ((0 == strcmp("--dry-run", argv[i + 1])) ||
+				     (0 == strcmp("-n",        argv[i + 1])))) {
+					dry_run = TRUE;
+					++i;
+				}
+				if ( ++i >= argc ) {
+					ERROR((stderr, "No task definitions file was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				import_tasks(argv[i], dry_run);
+				INFO((stderr, "Tasks imported.\n"));
+			} else if (0 == strcasecmp("report", argv[i])) {
+				if ( i + 2 >= argc ) {
+					ERROR((stderr, "No report date range was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				report_totals(argv[i + 1], argv[i + 2]);
+				i += 2;
+				INFO((stderr, "Report displayed.\n"));
 			} else if (0 == strcasecmp("start", argv[i])) {
 				if (FALSE == task_active()) {
 					task_reset();
@@ -218,21 +411,85 @@ process_arguments(int argc, char **argv)
 				} else {
 					INFO((stderr, "Task already started.\nIgnored.\n"));
 				}
+			} else if (0 == strcasecmp("log", argv[i])) {
+				HISTORY_QUERY query;
+
+				history_init(&query);
+				while (i + 2 < argc && TRUE == history_option(&query, argv[i + 1], argv[i + 2]))
+					i += 2;
+				history_log(&query);
+				INFO((stderr, "Log displayed.\n"));
+			} else if (0 == strcasecmp("optimize", argv[i])) {
+				if (i + 1 < argc &&
+				    ((0 == strcmp("--dry-run", argv[i + 1])) ||
+				     (0 == strcmp("-n",        argv[i + 1])))) {
+					optimize(TRUE);
+					++i;
+				} else optimize(FALSE);
+				INFO((stderr, "Database optimized.\n"));
 			} else if (0 == strcasecmp("recent", argv[i])) {
 				task_recent_print();
+			} else if (0 == strcasecmp("stats", argv[i])) {
+				if (i + 1 < argc && 0 == strcmp("--reset", argv[i + 1])) {
+					stats_reset();
+					++i;
+					INFO((stderr, "Stats reset.\n"));
+				} else stats_print();
 			} else if (0 == strcasecmp("status", argv[i])) {
+				if (i + 1 < argc &&
+				    ((0 == strcmp("--watch", argv[i + 1])) ||
+				     (0 == strcmp("-w",      argv[i + 1])))) {
+					watch_status();
+					quit(0);
+				}
 				task_print();
 				exit_code = (TRUE == task_active() ? 1 : 0);
 			} else if (0 == strcasecmp("stop", argv[i])) {
 				task_store();
 				task_clear(FALSE);
 				INFO((stderr, "Task stopped and stored.\n"));
+			} else if (0 == strcasecmp("sync", argv[i])) {
+				BOOL dry_run = FALSE;
+
+				if (i + 1 < argc &&
+				    ((0 == strcmp("--dry-run", argv[i + 1])) ||
+				     (0 == strcmp("-n",        argv[i + 1])))) {
+					dry_run = TRUE;
+					++i;
+				}
+				if ( ++i >= argc ) {
+					ERROR((stderr, "No database to sync with was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				sync_events(argv[i], dry_run);
+				INFO((stderr, "Events synced.\n"));
 			} else if (0 == strcasecmp("tasks", argv[i])) {
+				int limit = 0;
+				int top = -1;
+
+				for (;;) {
+					if (i + 2 < argc &&
+					    ((0 == strcmp("--top", argv[i + 1])) ||
+					     (0 == strcmp("-t",    argv[i + 1])))) {
+						top = atoi(argv[i + 2]);
+						i += 2;
+					} else if (i + 2 < argc &&
+					    ((0 == strcmp("--limit", argv[i + 1])) ||
+					     (0 == strcmp("-l",      argv[i + 1])))) {
+						limit = atoi(argv[i + 2]);
+						i += 2;
+					} else break;
+				}
 				if ( ++i >= argc ) {
 					ERROR((stderr, "No keyword was specified.\nAbort.\n"));
 					quit(-1);
 				}
-				task_tasks(argv[i]);
+				if (0 <= top)
+					task_tasks_top(argv[i], top);
+				else if (TRUE == federate_active())
+					federate_tasks(argv[i], limit);
+				else
+					task_tasks(argv[i], limit);
 				INFO((stderr, "Tasks displayed.\n"));
 			} else if (0 == strcasecmp("wipe", argv[i])) {
 				task_clear(TRUE);
@@ -260,6 +517,13 @@ process_arguments(int argc, char **argv)
 					quit(-1);
 				}
 				change_database(argv[i]);
+			} else if ((0 == strcmp("--federate-db", argv[i])) || 
+			           (0 == strcmp("-D",            argv[i]))) {
+				if ( ++i >= argc ) {
+					ERROR((stderr, "No database path was specified.\nAbort.\n"));
+					quit(-1);
+				}
+				federate_add(argv[i]);
 			} else if ((0 == strcmp("--task-id", argv[i])) || 
 			           (0 == strcmp("-i",        argv[i]))) {
 				if ( ++i >= argc ) {
@@ -297,6 +561,7 @@ quit(int code)
 	if ( 0 != code )
 		ERROR((stderr, "Force Quit\n"));
 
-	_exit(code);
+	fflush(stdout);
+	_exit(0 != code ? code : exit_code);
 }
 
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "optimize.h"
+
+#include <assert.h>
+#include <sqlite3.h>
+#include <string.h>
+
+#include "db.h"
+#include "epoch.h"
+#include "history.h"
+#include "report.h"
+#include "session.h"
+#include "sync.h"
+#include "task.h"
+#include "tree.h"
+
+/************************************************************************ declarations */
+
+struct t_OPTIMIZE_STATEMENT {
+	const char *name;
+	const char *query;
+	const char *args[2];
+};
+
+struct t_OPTIMIZE_INDEX {
+	const char *name;
+	const char *table;
+	const char *columns[8];
+};
+
+static void optimize_exec(const char *);
+static BOOL optimize_index_covered(const struct t_OPTIMIZE_INDEX *);
+static void optimize_index_create(const struct t_OPTIMIZE_INDEX *);
+static int  optimize_plans(BOOL);
+
+/*************************************************************************** constants */
+
+/* The statements ccharm issues against Charm tables, formatted as their modules do */
+static const struct t_OPTIMIZE_STATEMENT optimize_statements[] = {
+	{ "task_find_leafs", task_leafs_query, { 0, 0 } },
+	{ "task_walk_root", task_root_query, { 0, 0 } },
+	{ "task_walk_leafs", task_children_query, { 0, 0 } },
+	{ "task_recurse_name", task_name_query, { 0, 0 } },
+	{ "tree_load", tree_load_query, { 0, 0 } },
+	{ "report_totals", report_text_query, { 0, 0 } },
+	{ "report_totals_epoch", report_epoch_query, { 0, 0 } },
+	{ "history_log", history_text_query, { "Events", history_ranged_query } },
+	{ "history_log_walk", history_text_query, { "Events", history_walk_query } },
+	{ "history_log_epoch", history_epoch_query, { "Events", history_ranged_query } },
+	{ "history_log_epoch_walk", history_epoch_query, { "Events", history_walk_query } },
+	{ "sync_delta", sync_delta_query, { "main", 0 } },
+	{ 0, 0, { 0, 0 } }
+};
+
+static const struct t_OPTIMIZE_INDEX optimize_indexes[] = {
+	{ "ccharm_tasks_task_id", "Tasks",
+	  { "task_id", "validfrom", "validuntil", "trackable", "parent", "name", 0 } },
+	{ "ccharm_events_task_start", "Events",
+	  { "task", "start", 0 } },
+	{ "ccharm_events_start", "Events",
+	  { "start", 0 } },
+	{ "ccharm_events_origin", "Events",
+	  { "installation_id", "event_id", 0 } },
+	{ 0, 0, { 0 } }
+};
+
+/************************************************************************* definitions */
+
+void
+optimize(BOOL dry_run)
+{
+	BOOL ranged;
+	int scans, i;
+
+	use_database(DB_PROFILE_WRITE);
+
+	/* Attaching is not allowed once the savepoint below is open */
+	ranged = tree_attach(session.db);
+
+	printf("Query plans:\n");
+	scans = optimize_plans(ranged);
+	printf("%d statement(s) scanning.\n\n", scans);
+
+	optimize_exec("SAVEPOINT ccharm_optimize");
+
+	printf("Indexes:\n");
+	for (i = 0; optimize_indexes[i].name; ++i) {
+		if (TRUE == optimize_index_covered(&optimize_indexes[i])) {
+			printf("   %s: covered\n", optimize_indexes[i].name);
+		} else {
+			optimize_index_create(&optimize_indexes[i]);
+			printf("   %s: %s\n", optimize_indexes[i].name,
+			       dry_run ? "would create" : "created");
+		}
+	}
+	printf("\n");
+
+	/* Plans against the new indexes, dry runs roll them back afterwards */
+	printf("Query plans%s:\n", dry_run ? " (expected)" : "");
+	scans = optimize_plans(ranged);
+	printf("%d statement(s) scanning.\n\n", scans);
+
+	if (TRUE == dry_run) {
+		optimize_exec("ROLLBACK TO ccharm_optimize");
+		optimize_exec("RELEASE ccharm_optimize");
+		return;
+	}
+
+	optimize_exec("RELEASE ccharm_optimize");
+
+	/* Shadow times are a full pass over Events, only done for real */
+	if (FALSE == epoch_available(session.db, "main"))
+		printf("Event times: %lld event(s) backfilled.\n\n",
+		       (long long) epoch_build(session.db, "main"));
+
+	optimize_exec("ANALYZE");
+	optimize_exec("PRAGMA optimize");
+
+	printf("Statistics updated.\n\n");
+}
+
+/******************************************************************* local definitions */
+
+void
+optimize_exec(const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+BOOL
+optimize_index_covered(const struct t_OPTIMIZE_INDEX *index)
+{
+	sqlite3_stmt *list, *info;
+	char querystr[256];
+	BOOL covered = FALSE;
+	int column;
+
+	/* Any index whose leading key columns match ours does the same job */
+	snprintf(querystr, sizeof(querystr), "PRAGMA index_list(`%s`)", index->table);
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, &list, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(list);
+
+	while (FALSE == covered && SQLITE_ROW == sqlite3_step(list)) {
+		snprintf(querystr, sizeof(querystr), "PRAGMA index_info(`%s`)",
+		         (const char *) sqlite3_column_text(list, 1));
+		if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, &info, NULL)) {
+			ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+			quit(-1);
+		}
+		assert(info);
+
+		column = 0;
+		while (index->columns[column] && SQLITE_ROW == sqlite3_step(info)) {
+			const char *name = (const char *) sqlite3_column_text(info, 2);
+
+			if (0 == name || 0 != strcmp(name, index->columns[column]))
+				break;
+			++column;
+		}
+		covered = (0 == index->columns[column]) ? TRUE : FALSE;
+
+		sqlite3_finalize(info);
+	}
+
+	sqlite3_finalize(list);
+
+	return(covered);
+}
+
+void
+optimize_index_create(const struct t_OPTIMIZE_INDEX *index)
+{
+	char querystr[512];
+	int i;
+
+	snprintf(querystr, sizeof(querystr), "CREATE INDEX IF NOT EXISTS `%s` ON `%s` (",
+	         index->name, index->table);
+	for (i = 0; index->columns[i]; ++i) {
+		strncat(querystr, 0 == i ? "`" : ", `", sizeof(querystr) - strlen(querystr) - 1);
+		strncat(querystr, index->columns[i], sizeof(querystr) - strlen(querystr) - 1);
+		strncat(querystr, "`", sizeof(querystr) - strlen(querystr) - 1);
+	}
+	strncat(querystr, ")", sizeof(querystr) - strlen(querystr) - 1);
+
+	optimize_exec(querystr);
+}
+
+int
+optimize_plans(BOOL ranged)
+{
+	sqlite3_stmt *stmt;
+	char querystr[2048];
+	BOOL epoch;
+	int scans = 0;
+	int i, len;
+
+	epoch = epoch_available(session.db, "main");
+
+	for (i = 0; optimize_statements[i].name; ++i) {
+		const struct t_OPTIMIZE_STATEMENT *plan = &optimize_statements[i];
+		BOOL scanning = FALSE;
+
+		len = snprintf(querystr, sizeof(querystr), "EXPLAIN QUERY PLAN ");
+		snprintf(querystr + len, sizeof(querystr) - (size_t) len, plan->query,
+		         plan->args[0], plan->args[1]);
+
+		/* Without a task tree or shadow times their statements aren't issued either */
+		if (FALSE == ranged && strstr(querystr, "`ccharm_tree`"))
+			continue;
+		if (FALSE == epoch && strstr(querystr, "`ccharm_event_times`"))
+			continue;
+
+		if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, &stmt, NULL)) {
+			ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+			quit(-1);
+		}
+		assert(stmt);
+
+		printf("   %s\n", plan->name);
+		while (SQLITE_ROW == sqlite3_step(stmt)) {
+			/* The detail is the last column on every SQLite version */
+			const char *detail = (const char *)
+			    sqlite3_column_text(stmt, sqlite3_column_count(stmt) - 1);
+
+			if (0 == detail)
+				continue;
+			if (0 == strncmp("SCAN", detail, 4) && 0 == strstr(detail, "INDEX"))
+				scanning = TRUE;
+			printf("      %s\n", detail);
+		}
+		sqlite3_finalize(stmt);
+
+		if (TRUE == scanning)
+			++scans;
+	}
+
+	return(scans);
+}
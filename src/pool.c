@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/************************************************************************ declarations */
+
+struct t_POOL
+{
+	pthread_t      *threads;
+	int             threads_count;
+	BOOL           *done;
+	int             jobs;
+	int             next;
+	POOL_JOB        job;
+	void           *data;
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+};
+
+static void *pool_worker(void *);
+
+/************************************************************************* definitions */
+
+POOL
+pool_create(int threads, int jobs, POOL_JOB job, void *data)
+{
+	POOL p = malloc(sizeof(struct t_POOL));
+	int i;
+
+	if (threads > jobs)
+		threads = jobs;
+	if (threads < 1)
+		threads = 1;
+
+	p->threads = malloc(sizeof(pthread_t) * (size_t) threads);
+	p->threads_count = 0;
+	p->done = calloc((size_t) jobs + 1, sizeof(BOOL));
+	p->jobs = jobs;
+	p->next = 0;
+	p->job = job;
+	p->data = data;
+	pthread_mutex_init(&p->lock, 0);
+	pthread_cond_init(&p->cond, 0);
+
+	for (i = 0; i < threads; ++i) {
+		if (0 != pthread_create(&p->threads[i], 0, pool_worker, p)) {
+			ERROR((stderr, "Unable to spawn worker thread. ABORT.\n"));
+			quit(-1);
+		}
+		++p->threads_count;
+	}
+
+	return(p);
+}
+
+void
+pool_destroy(POOL p)
+{
+	int i;
+
+	for (i = 0; i < p->threads_count; ++i)
+		pthread_join(p->threads[i], 0);
+
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->lock);
+	free(p->done);
+	free(p->threads);
+	free(p);
+}
+
+void
+pool_wait(POOL p, int index)
+{
+	pthread_mutex_lock(&p->lock);
+	while (FALSE == p->done[index])
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+int
+pool_threads(int max)
+{
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (online < 1)
+		online = 1;
+
+	return(online < max ? (int) online : max);
+}
+
+/******************************************************************* local definitions */
+
+void *
+pool_worker(void *arg)
+{
+	POOL p = arg;
+	int index;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		index = (p->next < p->jobs) ? p->next++ : -1;
+		pthread_mutex_unlock(&p->lock);
+
+		if (0 > index)
+			break;
+
+		p->job(p->data, index);
+
+		pthread_mutex_lock(&p->lock);
+		p->done[index] = TRUE;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return(0);
+}
@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "query.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*************************************************************************** constants */
+
+#define QUERY_TOKENS_MAX 64
+
+/* A token adds at most a term, its NOT and the implicit AND before it */
+#define QUERY_NODES_MAX  (3 * QUERY_TOKENS_MAX)
+
+enum {QUERY_TERM, QUERY_AND, QUERY_OR, QUERY_NOT};
+
+/************************************************************************ declarations */
+
+/*
+ * A query is terms combined with AND (implicit), OR and NOT or -term,
+ * with parentheses and "quoted phrases". A term with slashes is a path:
+ * each segment must match an ancestor of the task matching the next
+ * one, a trailing slash means anything below and a leading one anchors
+ * the first segment at the top of the tree.
+ *
+ * Every term becomes a bitset over all tasks holding the matches and
+ * everything below them, built in one pass over the names and one over
+ * the tasks, parents first, to push the matches down; operators then
+ * combine whole words, so -old drops Old review from ClientB.
+ */
+struct t_QUERY_NODE {
+	int         type;
+	int         left;
+	int         right;
+	const char *text;
+};
+
+struct t_QUERY {
+	char               *tokens[QUERY_TOKENS_MAX];
+	int                 tokens_count;
+	int                 token;
+	struct t_QUERY_NODE nodes[QUERY_NODES_MAX];
+	int                 nodes_count;
+};
+
+struct t_QUERY_PAIR {
+	int key;
+	int index;
+};
+
+struct t_QUERY_TASKS {
+	int       count;
+	size_t    words;
+	int      *task_id;
+	int      *parent;
+	char    **name;
+	int      *order;
+	uint64_t *valid;
+	uint64_t *roots;
+};
+
+static uint64_t *query_bits(const struct t_QUERY_TASKS *);
+static BOOL      query_compile(struct t_QUERY *, const char *, int *);
+static BOOL      query_contains(const char *, const char *);
+static void      query_descend(const struct t_QUERY_TASKS *, const uint64_t *, uint64_t *);
+static int       query_id_compare(const void *, const void *);
+static uint64_t *query_eval(const struct t_QUERY *, const struct t_QUERY_TASKS *, int);
+static BOOL      query_load(sqlite3 *, struct t_QUERY_TASKS *);
+static uint64_t *query_match(const struct t_QUERY_TASKS *, const char *, size_t);
+static int       query_node(struct t_QUERY *, int, int, int, const char *);
+static int       query_pair_compare(const void *, const void *);
+static int       query_parse_and(struct t_QUERY *);
+static int       query_parse_or(struct t_QUERY *);
+static int       query_parse_unary(struct t_QUERY *);
+static void      query_release(struct t_QUERY *, struct t_QUERY_TASKS *);
+static uint64_t *query_term(const struct t_QUERY_TASKS *, const char *);
+static BOOL      query_tokenize(struct t_QUERY *, const char *);
+
+/************************************************************************* definitions */
+
+void
+query_free(QUERY_RESULT *result)
+{
+	free(result->tops);
+	free(result->members);
+	memset(result, 0, sizeof(*result));
+}
+
+BOOL
+query_member(const QUERY_RESULT *result, int task_id)
+{
+	int lo = 0, hi = result->members_count;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (result->members[mid] == task_id)
+			return(TRUE);
+		if (result->members[mid] < task_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return(FALSE);
+}
+
+char *
+query_normalize(const char *querystr)
+{
+	struct t_QUERY query;
+	char *normal;
+	size_t size = 1;
+	int i;
+
+	/* Too long to run is too long to cache, compiling it reports why */
+	memset(&query, 0, sizeof(query));
+	if (FALSE == query_tokenize(&query, querystr)) {
+		for (i = 0; i < query.tokens_count; ++i)
+			free(query.tokens[i]);
+		return(0);
+	}
+
+	for (i = 0; i < query.tokens_count; ++i)
+		size += strlen(query.tokens[i]) + 2;
+
+	/* Terms match case insensitively, only operators keep their case */
+	normal = malloc(size);
+	normal[0] = '\0';
+	for (i = 0; i < query.tokens_count; ++i) {
+		char *token = query.tokens[i];
+
+		if (0 != strcmp(token, "AND") && 0 != strcmp(token, "OR") && 0 != strcmp(token, "NOT")) {
+			char *c;
+
+			for (c = token; *c; ++c)
+				*c = (char) tolower((unsigned char) *c);
+		}
+		if (0 < i)
+			strcat(normal, " ");
+		strcat(normal, token);
+		if ('"' == token[0])
+			strcat(normal, "\"");
+		free(token);
+	}
+
+	return(normal);
+}
+
+BOOL
+query_tasks(sqlite3 *db, const char *querystr, QUERY_RESULT *result)
+{
+	struct t_QUERY_TASKS tasks;
+	struct t_QUERY query;
+	uint64_t *selected;
+	size_t w;
+	int root;
+	int i;
+
+	memset(result, 0, sizeof(*result));
+	memset(&tasks, 0, sizeof(tasks));
+
+	if (FALSE == query_compile(&query, querystr, &root) || FALSE == query_load(db, &tasks)) {
+		query_release(&query, &tasks);
+		return(FALSE);
+	}
+
+	selected = query_eval(&query, &tasks, root);
+	for (w = 0; w < tasks.words; ++w)
+		selected[w] &= tasks.valid[w];
+
+	/*
+	 * The topmost selected tasks, in table order as the plain keyword
+	 * search returned them, are where leaves are looked for; members
+	 * are kept sorted by id to filter those leaves.
+	 */
+	result->tops = malloc(sizeof(int) * (size_t) (tasks.count + 1));
+	result->members = malloc(sizeof(int) * (size_t) (tasks.count + 1));
+	for (i = 0; i < tasks.count; ++i) {
+		int p = tasks.parent[i];
+
+		if (!(selected[i / 64] & ((uint64_t) 1 << (i % 64))))
+			continue;
+
+		result->members[result->members_count++] = tasks.task_id[i];
+		if (0 > p || !(selected[p / 64] & ((uint64_t) 1 << (p % 64))))
+			result->tops[result->tops_count++] = tasks.task_id[i];
+	}
+	qsort(result->members, (size_t) result->members_count, sizeof(int), query_id_compare);
+
+	free(selected);
+	query_release(&query, &tasks);
+
+	return(TRUE);
+}
+
+BOOL
+query_valid(const char *querystr)
+{
+	struct t_QUERY_TASKS tasks;
+	struct t_QUERY query;
+	BOOL valid;
+	int root;
+
+	memset(&tasks, 0, sizeof(tasks));
+	valid = query_compile(&query, querystr, &root);
+	query_release(&query, &tasks);
+
+	return(valid);
+}
+
+/******************************************************************* local definitions */
+
+uint64_t *
+query_bits(const struct t_QUERY_TASKS *tasks)
+{
+	uint64_t *bits = calloc(tasks->words + 1, sizeof(uint64_t));
+
+	if (!bits) {
+		ERROR((stderr, "Out of memory.\n"));
+		quit(-1);
+	}
+
+	return(bits);
+}
+
+BOOL
+query_contains(const char *name, const char *term)
+{
+	size_t len = strlen(term);
+
+	/* Case insensitive substring, like LIKE '%term%' for ASCII */
+	if (0 == len)
+		return(TRUE);
+
+	for (; *name; ++name) {
+		size_t i;
+
+		for (i = 0; i < len && name[i]; ++i) {
+			if (tolower((unsigned char) name[i]) != tolower((unsigned char) term[i]))
+				break;
+		}
+		if (i == len)
+			return(TRUE);
+	}
+
+	return(FALSE);
+}
+
+void
+query_descend(const struct t_QUERY_TASKS *tasks, const uint64_t *set, uint64_t *below)
+{
+	int k;
+
+	/*
+	 * A task is below the set when its parent is in or below it; like
+	 * the leaf search, nothing is reached through an expired task.
+	 */
+	memset(below, 0, sizeof(uint64_t) * tasks->words);
+	for (k = 0; k < tasks->count; ++k) {
+		int i = tasks->order[k];
+		int p = tasks->parent[i];
+
+		if (0 <= p && (tasks->valid[p / 64] & ((uint64_t) 1 << (p % 64)))
+		    && ((set[p / 64] | below[p / 64]) & ((uint64_t) 1 << (p % 64))))
+			below[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+}
+
+BOOL
+query_compile(struct t_QUERY *query, const char *querystr, int *root)
+{
+	memset(query, 0, sizeof(*query));
+	if (FALSE == query_tokenize(query, querystr)) {
+		ERROR((stderr, "Task query too long: %s\nAbort.\n", querystr));
+		return(FALSE);
+	}
+
+	/* Nothing to match on selects every task, as LIKE '%%' did */
+	*root = 0 == query->tokens_count ? query_node(query, QUERY_TERM, 0, -1, "")
+	                                 : query_parse_or(query);
+	if (-1 == *root || query->token != query->tokens_count) {
+		ERROR((stderr, "Invalid task query: %s\nAbort.\n", querystr));
+		return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+uint64_t *
+query_eval(const struct t_QUERY *query, const struct t_QUERY_TASKS *tasks, int index)
+{
+	const struct t_QUERY_NODE *node = query->nodes + index;
+	uint64_t *left, *right;
+	size_t w;
+
+	if (QUERY_TERM == node->type)
+		return(query_term(tasks, node->text));
+
+	left = query_eval(query, tasks, node->left);
+	if (QUERY_NOT == node->type) {
+		for (w = 0; w < tasks->words; ++w)
+			left[w] = ~left[w];
+		return(left);
+	}
+
+	right = query_eval(query, tasks, node->right);
+	for (w = 0; w < tasks->words; ++w) {
+		if (QUERY_AND == node->type)
+			left[w] &= right[w];
+		else
+			left[w] |= right[w];
+	}
+	free(right);
+
+	return(left);
+}
+
+BOOL
+query_load(sqlite3 *db, struct t_QUERY_TASKS *tasks)
+{
+	struct t_QUERY_PAIR *pairs;
+	sqlite3_stmt *stmt;
+	BOOL *valid;
+	uint64_t *reached;
+	int *first, *children;
+	int capacity = 256;
+	int head, tail;
+	int ret;
+	int i;
+
+	const char querystr[] =
+	    "SELECT `task_id`, `parent`, `name`, "
+	           "(`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
+	       "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL) "
+	    "FROM `Tasks`";
+
+	ret = sqlite3_prepare_v2(db, querystr, sizeof(querystr), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		return(FALSE);
+	}
+	assert(stmt);
+
+	tasks->task_id = malloc(sizeof(int) * (size_t) capacity);
+	tasks->parent  = malloc(sizeof(int) * (size_t) capacity);
+	tasks->name    = malloc(sizeof(char *) * (size_t) capacity);
+	valid          = malloc(sizeof(BOOL) * (size_t) capacity);
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 2);
+
+		if (tasks->count == capacity) {
+			capacity *= 2;
+			tasks->task_id = realloc(tasks->task_id, sizeof(int) * (size_t) capacity);
+			tasks->parent  = realloc(tasks->parent, sizeof(int) * (size_t) capacity);
+			tasks->name    = realloc(tasks->name, sizeof(char *) * (size_t) capacity);
+			valid          = realloc(valid, sizeof(BOOL) * (size_t) capacity);
+		}
+
+		i = tasks->count++;
+		tasks->task_id[i] = sqlite3_column_int(stmt, 0);
+		tasks->parent[i]  = sqlite3_column_int(stmt, 1);
+		tasks->name[i]    = strdup(name ? name : "");
+		valid[i]          = 0 != sqlite3_column_int(stmt, 3);
+	}
+	sqlite3_finalize(stmt);
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+		free(valid);
+		return(FALSE);
+	}
+
+	tasks->words = (size_t) (tasks->count + 63) / 64;
+	tasks->valid = query_bits(tasks);
+	tasks->roots = query_bits(tasks);
+	tasks->order = malloc(sizeof(int) * (size_t) (tasks->count + 1));
+	pairs = malloc(sizeof(struct t_QUERY_PAIR) * (size_t) (tasks->count + 1));
+
+	/* Parent ids become indexes, a missing parent makes a root */
+	for (i = 0; i < tasks->count; ++i) {
+		pairs[i].key = tasks->task_id[i];
+		pairs[i].index = i;
+	}
+	qsort(pairs, (size_t) tasks->count, sizeof(*pairs), query_pair_compare);
+	for (i = 0; i < tasks->count; ++i) {
+		const struct t_QUERY_PAIR *found;
+
+		/* Ids are unique, the key alone finds the pair */
+		found = 0 != tasks->parent[i] ? bsearch(&tasks->parent[i], pairs, (size_t) tasks->count,
+		                                        sizeof(*pairs), query_id_compare) : NULL;
+
+		tasks->parent[i] = found ? found->index : -1;
+		if (!found)
+			tasks->roots[i / 64] |= (uint64_t) 1 << (i % 64);
+		if (valid[i])
+			tasks->valid[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+
+	/*
+	 * Parents come before their children: breadth first from the roots,
+	 * with the children of p at children[first[p + 1] .. first[p + 2])
+	 * after a counting sort on the parent index. Tasks on a cycle are
+	 * never reached that way and go last, in table order.
+	 */
+	first = calloc((size_t) tasks->count + 3, sizeof(int));
+	children = malloc(sizeof(int) * (size_t) (tasks->count + 1));
+	reached = query_bits(tasks);
+	for (i = 0; i < tasks->count; ++i)
+		++first[tasks->parent[i] + 3];
+	for (i = 1; i <= tasks->count + 2; ++i)
+		first[i] += first[i - 1];
+	for (i = 0; i < tasks->count; ++i)
+		children[first[tasks->parent[i] + 2]++] = i;
+
+	for (tail = 0; tail < first[1]; ++tail)
+		tasks->order[tail] = children[tail];
+	for (head = 0; head < tail; ++head) {
+		int p = tasks->order[head];
+
+		reached[p / 64] |= (uint64_t) 1 << (p % 64);
+		for (i = first[p + 1]; i < first[p + 2]; ++i)
+			tasks->order[tail++] = children[i];
+	}
+	for (i = 0; i < tasks->count; ++i) {
+		if (!(reached[i / 64] & ((uint64_t) 1 << (i % 64))))
+			tasks->order[tail++] = i;
+	}
+
+	free(reached);
+	free(children);
+	free(first);
+	free(pairs);
+	free(valid);
+
+	return(TRUE);
+}
+
+uint64_t *
+query_match(const struct t_QUERY_TASKS *tasks, const char *term, size_t len)
+{
+	uint64_t *bits = query_bits(tasks);
+	char *segment = strndup(term, len);
+	char *end;
+	long id;
+	int i;
+
+	/* A number also matches the task id, as it always has */
+	id = strtol(segment, &end, 10);
+	if (end == segment || *end)
+		id = -1;
+
+	for (i = 0; i < tasks->count; ++i) {
+		if (id == tasks->task_id[i] || query_contains(tasks->name[i], segment))
+			bits[i / 64] |= (uint64_t) 1 << (i % 64);
+	}
+	free(segment);
+
+	return(bits);
+}
+
+int
+query_id_compare(const void *a, const void *b)
+{
+	const int ia = *(const int *) a, ib = *(const int *) b;
+
+	return(ia < ib ? -1 : ia > ib ? 1 : 0);
+}
+
+int
+query_node(struct t_QUERY *query, int type, int left, int right, const char *text)
+{
+	struct t_QUERY_NODE *node;
+
+	if (-1 == left || (QUERY_AND == type || QUERY_OR == type ? -1 == right : FALSE)
+	    || QUERY_NODES_MAX == query->nodes_count)
+		return(-1);
+
+	node = query->nodes + query->nodes_count;
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->text = text;
+
+	return(query->nodes_count++);
+}
+
+int
+query_pair_compare(const void *a, const void *b)
+{
+	const struct t_QUERY_PAIR *pa = a, *pb = b;
+
+	if (pa->key != pb->key)
+		return(pa->key < pb->key ? -1 : 1);
+	return(pa->index - pb->index);
+}
+
+void
+query_release(struct t_QUERY *query, struct t_QUERY_TASKS *tasks)
+{
+	int i;
+
+	for (i = 0; i < tasks->count; ++i)
+		free(tasks->name[i]);
+	free(tasks->task_id);
+	free(tasks->parent);
+	free(tasks->name);
+	free(tasks->order);
+	free(tasks->valid);
+	free(tasks->roots);
+	for (i = 0; i < query->tokens_count; ++i)
+		free(query->tokens[i]);
+}
+
+int
+query_parse_and(struct t_QUERY *query)
+{
+	int node = query_parse_unary(query);
+
+	while (-1 != node && query->token < query->tokens_count) {
+		const char *token = query->tokens[query->token];
+
+		if (0 == strcmp(token, "OR") || 0 == strcmp(token, ")"))
+			break;
+		if (0 == strcmp(token, "AND"))
+			++query->token;
+		node = query_node(query, QUERY_AND, node, query_parse_unary(query), NULL);
+	}
+
+	return(node);
+}
+
+int
+query_parse_or(struct t_QUERY *query)
+{
+	int node = query_parse_and(query);
+
+	while (-1 != node && query->token < query->tokens_count
+	       && 0 == strcmp(query->tokens[query->token], "OR")) {
+		++query->token;
+		node = query_node(query, QUERY_OR, node, query_parse_and(query), NULL);
+	}
+
+	return(node);
+}
+
+int
+query_parse_unary(struct t_QUERY *query)
+{
+	const char *token;
+	int node;
+
+	if (query->token == query->tokens_count)
+		return(-1);
+	token = query->tokens[query->token++];
+
+	if (0 == strcmp(token, "NOT"))
+		return(query_node(query, QUERY_NOT, query_parse_unary(query), -1, NULL));
+	if ('-' == token[0] && token[1])
+		return(query_node(query, QUERY_NOT,
+		                  query_node(query, QUERY_TERM, 0, -1, token + 1), -1, NULL));
+
+	if (0 == strcmp(token, "(")) {
+		node = query_parse_or(query);
+		if (query->token == query->tokens_count || 0 != strcmp(query->tokens[query->token++], ")"))
+			return(-1);
+		return(node);
+	}
+	if (0 == strcmp(token, ")") || 0 == strcmp(token, "AND") || 0 == strcmp(token, "OR"))
+		return(-1);
+
+	return(query_node(query, QUERY_TERM, 0, -1, '"' == token[0] ? token + 1 : token));
+}
+
+uint64_t *
+query_term(const struct t_QUERY_TASKS *tasks, const char *term)
+{
+	const char *segment = term;
+	uint64_t *current, *below, *match;
+	size_t w;
+
+	/* Each segment must sit below the tasks matching the ones before */
+	if ('/' == *segment) {
+		++segment;
+		current = query_match(tasks, segment, strcspn(segment, "/"));
+		for (w = 0; w < tasks->words; ++w)
+			current[w] &= tasks->roots[w];
+	} else current = query_match(tasks, segment, strcspn(segment, "/"));
+
+	segment += strcspn(segment, "/");
+	below = query_bits(tasks);
+	while ('/' == *segment) {
+		size_t len;
+
+		++segment;
+		len = strcspn(segment, "/");
+		if (0 == len && *segment)
+			continue;
+
+		query_descend(tasks, current, below);
+		if (0 == len) {
+			memcpy(current, below, sizeof(uint64_t) * tasks->words);
+		} else {
+			match = query_match(tasks, segment, len);
+			for (w = 0; w < tasks->words; ++w)
+				current[w] = match[w] & below[w];
+			free(match);
+		}
+		segment += len;
+	}
+
+	/* What a term selects it selects with everything below it */
+	query_descend(tasks, current, below);
+	for (w = 0; w < tasks->words; ++w)
+		current[w] |= below[w];
+	free(below);
+
+	return(current);
+}
+
+BOOL
+query_tokenize(struct t_QUERY *query, const char *querystr)
+{
+	const char *s = querystr;
+
+	while (*s) {
+		size_t len;
+
+		if (isspace((unsigned char) *s)) {
+			++s;
+			continue;
+		}
+
+		if (QUERY_TOKENS_MAX == query->tokens_count)
+			return(FALSE);
+
+		/* Quoted phrases keep their spaces, the opening quote marks them literal */
+		if ('"' == *s) {
+			len = strcspn(s + 1, "\"") + 1;
+			query->tokens[query->tokens_count++] = strndup(s, len);
+			s += '"' == s[len] ? len + 1 : len;
+			continue;
+		}
+
+		len = '(' == *s || ')' == *s ? 1 : strcspn(s, " \t\n()");
+		query->tokens[query->tokens_count++] = strndup(s, len);
+		s += len;
+	}
+
+	return(TRUE);
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "report.h"
+
+#include <assert.h>
+#include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "archive.h"
+#include "db.h"
+#include "epoch.h"
+#include "pool.h"
+#include "session.h"
+#include "stamp.h"
+#include "task.h"
+
+/*************************************************************************** constants */
+
+#define REPORT_CHUNKS_PER_THREAD 4
+#define REPORT_CHUNK_MIN         8192
+#define REPORT_PARTITIONS_MAX    64
+
+const char report_text_query[] =
+	"SELECT `task`, `start`, `end` FROM `Events` "
+	"WHERE (`id` BETWEEN ? AND ?) "
+	   "AND (`start` >= ?) "
+	   "AND (`start` < ?)";
+const char report_epoch_query[] =
+	"SELECT `task`, `end` - `start` FROM `ccharm_event_times` "
+	"WHERE (`id` BETWEEN ? AND ?) "
+	   "AND (`start` >= ?) "
+	   "AND (`start` < ?)";
+
+/************************************************************************ declarations */
+
+struct t_REPORT_TOTAL {
+	int           task_id;
+	BOOL          used;
+	sqlite3_int64 seconds;
+};
+
+struct t_REPORT_SUMS {
+	struct t_REPORT_TOTAL *slots;
+	size_t                 capacity;
+	size_t                 count;
+};
+
+struct t_REPORT_JOB {
+	const char          *path;
+	const char          *live;
+	const char          *from;
+	const char          *until;
+	BOOL                 epoch;
+	sqlite3_int64        from_epoch;
+	sqlite3_int64        until_epoch;
+	sqlite3_int64        lo;
+	sqlite3_int64        hi;
+	struct t_REPORT_SUMS sums;
+	char                 error[256];
+};
+
+static BOOL report_range(sqlite3 *, const char *, sqlite3_int64 *, sqlite3_int64 *);
+static void report_sums_add(struct t_REPORT_SUMS *, int, sqlite3_int64);
+static void report_sums_free(struct t_REPORT_SUMS *);
+static int  report_total_compare(const void *, const void *);
+static void report_worker(void *, int);
+
+/************************************************************************* definitions */
+
+void
+report_totals(const char *from, const char *until)
+{
+	struct t_REPORT_JOB *jobs = 0;
+	struct t_REPORT_SUMS totals;
+	sqlite3_int64 lo, hi, span, total;
+	sqlite3_int64 from_epoch = 0, until_epoch = 0;
+	BOOL epoch;
+	char task_name[MAX_TASK_NAME_LEN + 1];
+	char paths[REPORT_PARTITIONS_MAX][256];
+	int years[REPORT_PARTITIONS_MAX - 1];
+	POOL pool;
+	int threads, chunks, partitions;
+	int count = 0;
+	int i, k;
+	size_t j;
+
+	use_database(DB_PROFILE_READ);
+
+	/* Bounds converted once, workers then compare plain integers */
+	epoch = epoch_parse(session.db, from, &from_epoch) &&
+	        epoch_parse(session.db, until, &until_epoch) ? TRUE : FALSE;
+
+	/* Live events plus every archived year the range touches */
+	strncpy(paths[0], path_database(), sizeof(paths[0]) - 1);
+	paths[0][sizeof(paths[0]) - 1] = '\0';
+	partitions = 1 + archive_years(from, until, years, REPORT_PARTITIONS_MAX - 1);
+	if (REPORT_PARTITIONS_MAX < partitions) {
+		ERROR((stderr, "Range spans %d archived years, at most %d can be read at once.\nAbort.\n",
+		       partitions - 1, REPORT_PARTITIONS_MAX - 1));
+		quit(-1);
+	}
+	for (i = 1; i < partitions; ++i)
+		archive_path(years[i - 1], paths[i], sizeof(paths[i]));
+
+	threads = pool_threads(REPORT_THREADS_MAX);
+
+	for (k = 0; k < partitions; ++k) {
+		if (FALSE == report_range(0 == k ? session.db : 0, paths[k], &lo, &hi))
+			continue;
+
+		/*
+		 * Split the rowid range in chunks, a few per worker so that uneven
+		 * chunks (deleted rows, date filter) still balance out across cores.
+		 */
+		span = hi - lo + 1;
+		chunks = threads * REPORT_CHUNKS_PER_THREAD;
+		if (span / chunks < REPORT_CHUNK_MIN)
+			chunks = (int) (span / REPORT_CHUNK_MIN) + 1;
+
+		jobs = realloc(jobs, sizeof(struct t_REPORT_JOB) * (size_t) (count + chunks));
+		memset(jobs + count, 0, sizeof(struct t_REPORT_JOB) * (size_t) chunks);
+		for (i = 0; i < chunks; ++i, ++count) {
+			jobs[count].path  = paths[k];
+			jobs[count].live  = 0 == k ? 0 : paths[0];
+			jobs[count].from  = from;
+			jobs[count].until = until;
+			jobs[count].epoch = epoch;
+			jobs[count].from_epoch  = from_epoch;
+			jobs[count].until_epoch = until_epoch;
+			jobs[count].lo    = lo + (span * i) / chunks;
+			jobs[count].hi    = lo + (span * (i + 1)) / chunks - 1;
+		}
+	}
+
+	if (0 == count) {
+		printf("Total: 00:00:00\n\n");
+		return;
+	}
+
+	INFO((stderr, "Report: %d chunk(s) over %d partition(s) on %d thread(s)\n",
+	      count, partitions, threads));
+
+	pool = pool_create(threads, count, report_worker, jobs);
+	pool_destroy(pool);
+
+	/* Workers can't quit under the pool, the first error is raised once all joined */
+	for (i = 0; i < count; ++i) {
+		if ('\0' != jobs[i].error[0]) {
+			ERROR((stderr, "%s", jobs[i].error));
+			quit(-1);
+		}
+	}
+
+	/* Merge thread-local partial sums */
+	memset(&totals, 0, sizeof(totals));
+	for (i = 0; i < count; ++i) {
+		for (j = 0; j < jobs[i].sums.capacity; ++j) {
+			if (TRUE == jobs[i].sums.slots[j].used)
+				report_sums_add(&totals,
+				                jobs[i].sums.slots[j].task_id,
+				                jobs[i].sums.slots[j].seconds);
+		}
+		report_sums_free(&jobs[i].sums);
+	}
+	free(jobs);
+
+	/* Compact and sort by time spent */
+	for (i = 0, j = 0; j < totals.capacity; ++j) {
+		if (TRUE == totals.slots[j].used)
+			totals.slots[i++] = totals.slots[j];
+	}
+	if (totals.slots)
+		qsort(totals.slots, totals.count, sizeof(struct t_REPORT_TOTAL), report_total_compare);
+
+	total = 0;
+	for (j = 0; j < totals.count; ++j) {
+		memset(task_name, 0, sizeof(task_name));
+		if (FALSE == task_recurse_name(session.db, totals.slots[j].task_id, task_name))
+			quit(-1);
+		printf("%s\n   Time: %s\n", task_name, report_duration(totals.slots[j].seconds));
+		total += totals.slots[j].seconds;
+	}
+	printf("Total: %s\n\n", report_duration(total));
+
+	report_sums_free(&totals);
+}
+
+const char *
+report_duration(sqlite3_int64 seconds)
+{
+	static char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "%02lld:%02d:%02d",
+	         (long long) (seconds / 3600),
+	         (int) (seconds / 60 % 60),
+	         (int) (seconds % 60));
+
+	return(buffer);
+}
+
+sqlite3_int64
+report_span(sqlite3_stmt *stmt, int column)
+{
+	int64_t start, end;
+
+	/* Start and end text side by side, nothing when either doesn't parse */
+	if (FALSE == stamp_parse((const char *) sqlite3_column_text(stmt, column),
+	                         (size_t) sqlite3_column_bytes(stmt, column), &start) ||
+	    FALSE == stamp_parse((const char *) sqlite3_column_text(stmt, column + 1),
+	                         (size_t) sqlite3_column_bytes(stmt, column + 1), &end))
+		return(0);
+
+	return((sqlite3_int64) (end - start));
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+report_range(sqlite3 *db, const char *path, sqlite3_int64 *lo, sqlite3_int64 *hi)
+{
+	sqlite3 *own = 0;
+	sqlite3_stmt *stmt;
+	BOOL found = FALSE;
+
+	const char querystr[] = "SELECT MIN(`id`), MAX(`id`) FROM `Events`";
+
+	if (0 == db) {
+		if (SQLITE_OK != sqlite3_open_v2(path, &own, SQLITE_OPEN_READONLY, 0)) {
+			WARNING((stderr, "Can't open archive: %s\n", path));
+			sqlite3_close(own);
+			return(FALSE);
+		}
+		db = own;
+	}
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, sizeof(querystr), &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		quit(-1);
+	}
+	assert(stmt);
+
+	if (SQLITE_ROW == sqlite3_step(stmt) && SQLITE_NULL != sqlite3_column_type(stmt, 0)) {
+		*lo = sqlite3_column_int64(stmt, 0);
+		*hi = sqlite3_column_int64(stmt, 1);
+		found = TRUE;
+	}
+	sqlite3_finalize(stmt);
+	sqlite3_close(own);
+
+	return(found);
+}
+
+void
+report_sums_add(struct t_REPORT_SUMS *sums, int task_id, sqlite3_int64 seconds)
+{
+	size_t i;
+
+	/* Open addressing, kept at most half full; task 0 is a valid key */
+	if (sums->count * 2 >= sums->capacity) {
+		struct t_REPORT_SUMS grown;
+
+		grown.capacity = sums->capacity ? sums->capacity * 2 : 64;
+		grown.slots = calloc(grown.capacity, sizeof(struct t_REPORT_TOTAL));
+		grown.count = 0;
+		for (i = 0; i < sums->capacity; ++i) {
+			if (TRUE == sums->slots[i].used)
+				report_sums_add(&grown, sums->slots[i].task_id, sums->slots[i].seconds);
+		}
+		free(sums->slots);
+		*sums = grown;
+	}
+
+	i = ((size_t) task_id * 2654435761u) & (sums->capacity - 1);
+	while (TRUE == sums->slots[i].used && task_id != sums->slots[i].task_id)
+		i = (i + 1) & (sums->capacity - 1);
+
+	if (FALSE == sums->slots[i].used) {
+		sums->slots[i].task_id = task_id;
+		sums->slots[i].used = TRUE;
+		++sums->count;
+	}
+	sums->slots[i].seconds += seconds;
+}
+
+void
+report_sums_free(struct t_REPORT_SUMS *sums)
+{
+	free(sums->slots);
+	memset(sums, 0, sizeof(struct t_REPORT_SUMS));
+}
+
+int
+report_total_compare(const void *a, const void *b)
+{
+	const struct t_REPORT_TOTAL *ta = a;
+	const struct t_REPORT_TOTAL *tb = b;
+
+	if (ta->seconds != tb->seconds)
+		return(ta->seconds < tb->seconds ? 1 : -1);
+	return(ta->task_id - tb->task_id);
+}
+
+void
+report_worker(void *data, int index)
+{
+	struct t_REPORT_JOB *job = (struct t_REPORT_JOB *)data + index;
+	sqlite3 *db = 0;
+	sqlite3_stmt *stmt;
+	char *archived = 0;
+	char *attach;
+	int ret;
+
+	const char *querystr = report_text_query;
+	BOOL epoch;
+
+	/* Workers only read, a private connection keeps them off each other's locks */
+	if (SQLITE_OK != sqlite3_open_v2(job->path, &db,
+	    SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0)) {
+		snprintf(job->error, sizeof(job->error), "Can't open database: %s\n%s\n",
+		         job->path, sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return;
+	}
+	tune_database(db, DB_PROFILE_READ);
+
+	/* Integer shadow times where they exist, parsing the text otherwise */
+	epoch = job->epoch && epoch_available(db, "main") ? TRUE : FALSE;
+	if (TRUE == epoch)
+		querystr = report_epoch_query;
+
+	/* Rows an interrupted archive move left in both files count where they are live */
+	if (job->live) {
+		attach = sqlite3_mprintf("ATTACH DATABASE %Q AS `live`", job->live);
+		ret = sqlite3_exec(db, attach, 0, 0, 0);
+		sqlite3_free(attach);
+		if (SQLITE_OK != ret) {
+			snprintf(job->error, sizeof(job->error), "Can't open database: %s\n%s\n",
+			         job->live, sqlite3_errmsg(db));
+			sqlite3_close(db);
+			return;
+		}
+
+		archived = sqlite3_mprintf(
+		    "%s AND NOT EXISTS (SELECT 1 FROM `live`.`Events` AS `m` WHERE `m`.`id` = `%w`.`id`)",
+		    querystr, TRUE == epoch ? "ccharm_event_times" : "Events");
+		querystr = archived;
+	}
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL)) {
+		snprintf(job->error, sizeof(job->error), "SQL error: '%s' %s\n",
+		         querystr, sqlite3_errmsg(db));
+		sqlite3_free(archived);
+		sqlite3_close(db);
+		return;
+	}
+	assert(stmt);
+	sqlite3_free(archived);
+
+	sqlite3_bind_int64(stmt, 1, job->lo);
+	sqlite3_bind_int64(stmt, 2, job->hi);
+	if (TRUE == epoch) {
+		sqlite3_bind_int64(stmt, 3, job->from_epoch);
+		sqlite3_bind_int64(stmt, 4, job->until_epoch);
+	} else {
+		sqlite3_bind_text(stmt, 3, job->from,  -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, job->until, -1, SQLITE_STATIC);
+	}
+
+	do {
+		ret = sqlite3_step(stmt);
+		switch (ret) {
+		case SQLITE_ROW:
+			report_sums_add(&job->sums,
+			                sqlite3_column_int(stmt, 0),
+			                TRUE == epoch ? sqlite3_column_int64(stmt, 1) : report_span(stmt, 1));
+			/* fall-through */
+		case SQLITE_DONE:
+			break;
+
+		default:
+			snprintf(job->error, sizeof(job->error), "SQL error: %s\n", sqlite3_errmsg(db));
+			ret = SQLITE_DONE;
+			break;
+		}
+	} while (SQLITE_DONE != ret);
+
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+}
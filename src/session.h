@@ -31,17 +31,19 @@
 #include <sqlite3.h>
 
 #include "common.h"
+#include "state.h"
 
 /************************************************************************ declarations */
 
 struct t_SESSION {
-	int      taskfd;
-	int      bookmarkfd;
-	int      recentfd;
+	STATE    taskstate;
+	STATE    bookmarkstate;
+	STATE    recentstate;
 	char    *db_path;
 	char    *home_path;
 	size_t   max_path;
 	sqlite3 *db;
+	int      db_profile;
 };
 typedef struct t_SESSION SESSION;
 
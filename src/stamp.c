@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "stamp.h"
+
+#include <string.h>
+#include <time.h>
+
+/*************************************************************************** constants */
+
+#define STAMP_DAY        86400
+#define STAMP_ZONE_SLOTS 4096
+
+/* Zone slots hold the day above the offset, biased so an empty slot is zero */
+#define STAMP_ZONE_BIAS  0x40000000u
+#define STAMP_ZONE_MIXED 1u
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define STAMP_SWAR 1
+#else
+#  define STAMP_SWAR 0
+#endif
+
+static const char stamp_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/************************************************************************ declarations */
+
+/*
+ * Charm stores events as local wall clock text. Wall seconds are those
+ * read as if they were UTC, which is what strftime('%s', text) gives;
+ * epoch seconds are proper UTC, what the 'utc' modifier makes of them.
+ *
+ * Zone offsets only change a couple of times a year, so they're looked
+ * up once per day and kept in a small direct mapped table; the few days
+ * with a transition in them fall back to the C library for every call.
+ */
+static void    stamp_civil(int64_t, int64_t *, unsigned *, unsigned *);
+static int64_t stamp_days(int64_t, unsigned, unsigned);
+static BOOL    stamp_fast(const char *, int64_t *);
+static BOOL    stamp_general(const char *, size_t, int64_t *, BOOL *);
+static BOOL    stamp_number(const char **, const char *, int, unsigned *);
+static int64_t stamp_tm_wall(const struct tm *);
+static int64_t stamp_zone(uint64_t *, int64_t, int64_t (*)(int64_t));
+static int64_t stamp_zone_local(int64_t);
+static int64_t stamp_zone_utc(int64_t);
+
+/********************************************************************* local variables */
+
+static uint64_t zone_local[STAMP_ZONE_SLOTS];
+static uint64_t zone_utc[STAMP_ZONE_SLOTS];
+
+/************************************************************************* definitions */
+
+BOOL
+stamp_epoch(const char *text, size_t len, int64_t *epoch)
+{
+	BOOL zoned = FALSE;
+	int64_t wall;
+
+	if (0 == text)
+		return(FALSE);
+
+	if (FALSE == (STAMP_LENGTH == len && TRUE == stamp_fast(text, &wall)) &&
+	    FALSE == stamp_general(text, len, &wall, &zoned))
+		return(FALSE);
+
+	/* An explicit zone already made it UTC, like the 'utc' modifier skips it */
+	*epoch = TRUE == zoned ? wall : stamp_utc(wall);
+
+	return(TRUE);
+}
+
+void
+stamp_format(int64_t wall, char *text)
+{
+	int64_t days = (wall >= 0 ? wall : wall - (STAMP_DAY - 1)) / STAMP_DAY;
+	unsigned second = (unsigned) (wall - days * STAMP_DAY);
+	unsigned year, month, day;
+	int64_t full_year;
+
+	stamp_civil(days, &full_year, &month, &day);
+	year = (unsigned) (full_year % 10000);
+
+	/* Two digits at a time out of the pair table */
+	memcpy(text,      stamp_pairs + 2 * (year / 100), 2);
+	memcpy(text + 2,  stamp_pairs + 2 * (year % 100), 2);
+	memcpy(text + 5,  stamp_pairs + 2 * month, 2);
+	memcpy(text + 8,  stamp_pairs + 2 * day, 2);
+	memcpy(text + 11, stamp_pairs + 2 * (second / 3600), 2);
+	memcpy(text + 14, stamp_pairs + 2 * (second / 60 % 60), 2);
+	memcpy(text + 17, stamp_pairs + 2 * (second % 60), 2);
+	text[4] = text[7] = '-';
+	text[10] = 'T';
+	text[13] = text[16] = ':';
+	text[STAMP_LENGTH] = '\0';
+}
+
+int64_t
+stamp_local(int64_t epoch)
+{
+	return(epoch + stamp_zone(zone_local, epoch, stamp_zone_local));
+}
+
+BOOL
+stamp_parse(const char *text, size_t len, int64_t *wall)
+{
+	BOOL zoned;
+
+	if (0 == text)
+		return(FALSE);
+
+	/* Anything off the fixed layout takes the long way */
+	if (STAMP_LENGTH == len && TRUE == stamp_fast(text, wall))
+		return(TRUE);
+
+	return(stamp_general(text, len, wall, &zoned));
+}
+
+int64_t
+stamp_utc(int64_t wall)
+{
+	return(wall - stamp_zone(zone_utc, wall, stamp_zone_utc));
+}
+
+/******************************************************************* local definitions */
+
+void
+stamp_civil(int64_t days, int64_t *year, unsigned *month, unsigned *day)
+{
+	int64_t z = days + 719468;
+	int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+	unsigned doe = (unsigned) (z - era * 146097);
+	unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	unsigned mp = (5 * doy + 2) / 153;
+
+	/* The inverse of stamp_days, years still start in March */
+	*day = doy - (153 * mp + 2) / 5 + 1;
+	*month = mp < 10 ? mp + 3 : mp - 9;
+	*year = (int64_t) yoe + era * 400 + (*month <= 2);
+}
+
+int64_t
+stamp_days(int64_t year, unsigned month, unsigned day)
+{
+	int64_t era;
+	unsigned yoe, doy;
+
+	/* Days since 1970-01-01, counting years from March so leap days come last */
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = (unsigned) (year - era * 400);
+	doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+	return(era * 146097 + (int64_t) (yoe * 365 + yoe / 4 - yoe / 100 + doy) - 719468);
+}
+
+BOOL
+stamp_fast(const char *text, int64_t *wall)
+{
+#if STAMP_SWAR
+	uint64_t date, clock, digits, pairs, invalid;
+	unsigned year, month, day, hour, minute, second;
+
+	/* "YYYY-MM-" and "DDTHH:MM", byte 0 lowest */
+	memcpy(&date, text, 8);
+	memcpy(&clock, text + 8, 8);
+
+	/*
+	 * A digit is 0x30 to 0x39: high nibble 3 before and after adding 6.
+	 * Everything is checked at once and folded into one flag, any carry
+	 * out of a byte comes from one that fails on its own anyway.
+	 */
+	invalid  = ((date & 0xF0F0F0F0F0F0F0F0ull & 0x00FFFF00FFFFFFFFull) ^ 0x0030300030303030ull)
+	         | (((date + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull & 0x00FFFF00FFFFFFFFull) ^ 0x0030300030303030ull)
+	         | ((date & 0xFF0000FF00000000ull) ^ 0x2D00002D00000000ull)
+	         | ((clock & 0xF0F0F0F0F0F0F0F0ull & 0xFFFF00FFFF00FFFFull) ^ 0x3030003030003030ull)
+	         | (((clock + 0x0606060606060606ull) & 0xF0F0F0F0F0F0F0F0ull & 0xFFFF00FFFF00FFFFull) ^ 0x3030003030003030ull)
+	         | ((clock & 0x0000FF0000000000ull) ^ 0x00003A0000000000ull);
+	invalid |= (uint64_t) (('T' != text[10]) & (' ' != text[10]))
+	         | (uint64_t) (':' != text[16])
+	         | (uint64_t) ((unsigned) (text[17] - '0') > 9u)
+	         | (uint64_t) ((unsigned) (text[18] - '0') > 9u);
+
+	/* Byte i of pairs is digit i times ten plus digit i + 1 */
+	digits = date & 0x0F0F0F0F0F0F0F0Full;
+	pairs = digits * 10 + (digits >> 8);
+	year = (unsigned) (pairs & 0xFF) * 100 + (unsigned) ((pairs >> 16) & 0xFF);
+	month = (unsigned) ((pairs >> 40) & 0xFF);
+
+	digits = clock & 0x0F0F0F0F0F0F0F0Full;
+	pairs = digits * 10 + (digits >> 8);
+	day = (unsigned) (pairs & 0xFF);
+	hour = (unsigned) ((pairs >> 24) & 0xFF);
+	minute = (unsigned) ((pairs >> 48) & 0xFF);
+	second = (unsigned) (text[17] - '0') * 10 + (unsigned) (text[18] - '0');
+
+	invalid |= (uint64_t) ((month - 1 > 11u) | (day - 1 > 30u) | (hour > 24u) |
+	                       (minute > 59u) | (second > 59u));
+	if (0 != invalid)
+		return(FALSE);
+
+	*wall = stamp_days(year, month, day) * STAMP_DAY + hour * 3600 + minute * 60 + second;
+
+	return(TRUE);
+#else
+	UNUSED(text);
+	UNUSED(wall);
+
+	return(FALSE);
+#endif
+}
+
+BOOL
+stamp_general(const char *text, size_t len, int64_t *wall, BOOL *zoned)
+{
+	const char *s = text, *end = text + len;
+	unsigned year, month, day, hour = 0, minute = 0, second = 0;
+	unsigned zone_hour, zone_minute;
+	int64_t zone = 0;
+
+	*zoned = FALSE;
+
+	/* YYYY-MM-DD, then [T ]HH:MM[:SS[.SSS]] and Z or +-HH:MM, as SQLite takes them */
+	if (FALSE == stamp_number(&s, end, 4, &year) || s == end || '-' != *s++ ||
+	    FALSE == stamp_number(&s, end, 2, &month) || s == end || '-' != *s++ ||
+	    FALSE == stamp_number(&s, end, 2, &day))
+		return(FALSE);
+
+	while (s < end && ('T' == *s || ' ' == *s))
+		++s;
+	if (s < end) {
+		if (FALSE == stamp_number(&s, end, 2, &hour) || s == end || ':' != *s++ ||
+		    FALSE == stamp_number(&s, end, 2, &minute))
+			return(FALSE);
+		if (s < end && ':' == *s) {
+			++s;
+			if (FALSE == stamp_number(&s, end, 2, &second))
+				return(FALSE);
+			/* Fractions don't make it into whole seconds */
+			if (s < end && '.' == *s) {
+				++s;
+				while (s < end && '0' <= *s && '9' >= *s)
+					++s;
+			}
+		}
+
+		/* Only a time may carry a zone */
+		while (s < end && ' ' == *s)
+			++s;
+		if (s < end && ('Z' == *s || 'z' == *s)) {
+			*zoned = TRUE;
+			++s;
+		} else if (s < end && ('+' == *s || '-' == *s)) {
+			int sign = '-' == *s++ ? -1 : 1;
+
+			if (FALSE == stamp_number(&s, end, 2, &zone_hour) || s == end || ':' != *s++ ||
+			    FALSE == stamp_number(&s, end, 2, &zone_minute) || 14 < zone_hour || 59 < zone_minute)
+				return(FALSE);
+			zone = sign * (int64_t) (zone_hour * 3600 + zone_minute * 60);
+			*zoned = TRUE;
+		}
+		while (s < end && ' ' == *s)
+			++s;
+	}
+
+	if (s != end || month - 1 > 11u || day - 1 > 30u || hour > 24u || minute > 59u || second > 59u)
+		return(FALSE);
+
+	*wall = stamp_days(year, month, day) * STAMP_DAY + hour * 3600 + minute * 60 + second - zone;
+
+	return(TRUE);
+}
+
+BOOL
+stamp_number(const char **s, const char *end, int digits, unsigned *value)
+{
+	*value = 0;
+	for (; 0 < digits; --digits, ++*s) {
+		if (*s == end || '0' > **s || '9' < **s)
+			return(FALSE);
+		*value = *value * 10 + (unsigned) (**s - '0');
+	}
+
+	return(TRUE);
+}
+
+int64_t
+stamp_tm_wall(const struct tm *tm)
+{
+	return(stamp_days(1900 + (int64_t) tm->tm_year, (unsigned) tm->tm_mon + 1, (unsigned) tm->tm_mday) * STAMP_DAY +
+	       tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec);
+}
+
+int64_t
+stamp_zone(uint64_t *slots, int64_t seconds, int64_t (*offset)(int64_t))
+{
+	int64_t day = (seconds >= 0 ? seconds : seconds - (STAMP_DAY - 1)) / STAMP_DAY;
+	uint64_t *slot = &slots[(uint64_t) day % STAMP_ZONE_SLOTS];
+	uint64_t value = __atomic_load_n(slot, __ATOMIC_RELAXED);
+	int64_t first, last;
+
+	if ((uint32_t) (value >> 32) != (uint32_t) day || 0 == (uint32_t) value) {
+		/* Both ends of the day agree unless the clocks changed in between */
+		first = offset(day * STAMP_DAY);
+		last = offset(day * STAMP_DAY + STAMP_DAY - 1);
+		value = ((uint64_t) (uint32_t) day << 32) |
+		        (first == last ? (uint32_t) (first + STAMP_ZONE_BIAS) : STAMP_ZONE_MIXED);
+		__atomic_store_n(slot, value, __ATOMIC_RELAXED);
+	}
+
+	if (STAMP_ZONE_MIXED == (uint32_t) value)
+		return(offset(seconds));
+
+	return((int64_t) (uint32_t) value - STAMP_ZONE_BIAS);
+}
+
+int64_t
+stamp_zone_local(int64_t epoch)
+{
+	time_t t = (time_t) epoch;
+	struct tm tm;
+
+	if (0 == localtime_r(&t, &tm))
+		return(0);
+
+	return(stamp_tm_wall(&tm) - epoch);
+}
+
+int64_t
+stamp_zone_utc(int64_t wall)
+{
+	int64_t guess = wall, error = 0;
+	int count = 0;
+
+	/*
+	 * Walk towards the instant showing this wall clock the way SQLite's
+	 * 'utc' modifier does, so skipped and repeated hours land where it
+	 * puts them.
+	 */
+	do {
+		guess -= error;
+		error = guess + stamp_zone_local(guess) - wall;
+	} while (0 != error && count++ < 3);
+
+	return(wall - guess);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "state.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*************************************************************************** constants */
+
+#define STATE_MAGIC      0x4d484343u /* CCHM */
+#define STATE_SPIN_YIELD 64
+#define STATE_SPIN_MAX   4096
+
+/************************************************************************ declarations */
+
+/*
+ * State files are shared between concurrent invocations through a mapping:
+ *
+ *   magic | sequence | payload
+ *
+ * Writers hold an exclusive flock() and make the sequence odd while they
+ * copy the payload in. Readers never lock, they copy the payload out and
+ * retry if the sequence was odd or moved underneath them.
+ */
+struct t_STATE_HEADER {
+	uint32_t magic;
+	uint32_t sequence;
+};
+
+struct t_STATE
+{
+	int                    fd;
+	size_t                 size;
+	size_t                 map_size;
+	struct t_STATE_HEADER *header;
+	void                  *payload;
+};
+
+static BOOL state_setup(int, size_t);
+
+/************************************************************************* definitions */
+
+STATE
+state_open(const char *path, size_t size)
+{
+	struct stat st;
+	STATE s;
+	int fd;
+
+	if (-1 == (fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)))
+		return(0);
+
+	/* Layout is only fixed up under the lock, settled files skip it */
+	if (0 != fstat(fd, &st) ||
+	    (size_t) st.st_size != sizeof(struct t_STATE_HEADER) + size) {
+		if (FALSE == state_setup(fd, size)) {
+			close(fd);
+			return(0);
+		}
+	}
+
+	s = malloc(sizeof(struct t_STATE));
+	s->fd = fd;
+	s->size = size;
+	s->map_size = sizeof(struct t_STATE_HEADER) + size;
+	s->header = mmap(0, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if (MAP_FAILED == s->header) {
+		close(fd);
+		free(s);
+		return(0);
+	}
+	s->payload = s->header + 1;
+
+	/* Not ours, start over rather than hand out garbage */
+	if (STATE_MAGIC != s->header->magic) {
+		flock(fd, LOCK_EX);
+		if (STATE_MAGIC != s->header->magic) {
+			memset(s->payload, 0, size);
+			s->header->sequence = 0;
+			s->header->magic = STATE_MAGIC;
+		}
+		flock(fd, LOCK_UN);
+	}
+
+	return(s);
+}
+
+void
+state_close(STATE s)
+{
+	if (0 == s)
+		return;
+
+	munmap(s->header, s->map_size);
+	close(s->fd);
+	free(s);
+}
+
+void
+state_read(STATE s, void *data)
+{
+	uint32_t before, after;
+	int spins = 0;
+
+	for (;;) {
+		before = __atomic_load_n(&s->header->sequence, __ATOMIC_ACQUIRE);
+
+		if (0 == (before & 1)) {
+			memcpy(data, s->payload, s->size);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			after = __atomic_load_n(&s->header->sequence, __ATOMIC_RELAXED);
+
+			if (before == after)
+				return;
+		}
+
+		if (0 == (++spins % STATE_SPIN_YIELD))
+			sched_yield();
+
+		/*
+		 * A writer that died mid-copy leaves the sequence odd forever;
+		 * once we can take its lock it is gone, so close the sequence.
+		 */
+		if (STATE_SPIN_MAX <= spins) {
+			flock(s->fd, LOCK_EX);
+			before = s->header->sequence;
+			if (before & 1)
+				__atomic_store_n(&s->header->sequence, before + 1, __ATOMIC_RELEASE);
+			memcpy(data, s->payload, s->size);
+			flock(s->fd, LOCK_UN);
+			return;
+		}
+	}
+}
+
+void
+state_update(STATE s, STATE_UPDATE fn, void *data)
+{
+	uint32_t sequence;
+	void *payload;
+
+	payload = malloc(s->size);
+
+	/*
+	 * Read, merge and write back under one lock, a copy loaded at startup
+	 * would otherwise overwrite whatever other invocations stored since.
+	 */
+	flock(s->fd, LOCK_EX);
+
+	memcpy(payload, s->payload, s->size);
+	fn(payload, data);
+
+	/* Rounded up, a writer that died mid-copy left the sequence odd */
+	sequence = (s->header->sequence + 1) & ~1u;
+	__atomic_store_n(&s->header->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(s->payload, payload, s->size);
+
+	__atomic_store_n(&s->header->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+	flock(s->fd, LOCK_UN);
+
+	free(payload);
+
+	/* Stores through the mapping raise no inotify events, touch instead */
+	futimens(s->fd, 0);
+}
+
+/******************************************************************* local definitions */
+
+BOOL
+state_setup(int fd, size_t size)
+{
+	struct t_STATE_HEADER header;
+	struct stat st;
+	void *payload;
+	BOOL result = TRUE;
+
+	flock(fd, LOCK_EX);
+
+	/* Someone else might have beaten us to it */
+	if (0 != fstat(fd, &st)) {
+		flock(fd, LOCK_UN);
+		return(FALSE);
+	}
+
+	if ((size_t) st.st_size != sizeof(struct t_STATE_HEADER) + size) {
+		payload = calloc(1, size);
+
+		/* Files from older versions hold the bare payload, carry it over */
+		if ((size_t) st.st_size == size) {
+			lseek(fd, (off_t) 0, SEEK_SET);
+			if ((ssize_t) size != read(fd, payload, size))
+				memset(payload, 0, size);
+		}
+
+		header.magic = STATE_MAGIC;
+		header.sequence = 0;
+
+		lseek(fd, (off_t) 0, SEEK_SET);
+		if (0 != ftruncate(fd, 0) ||
+		    (ssize_t) sizeof(header) != write(fd, &header, sizeof(header)) ||
+		    (ssize_t) size != write(fd, payload, size))
+			result = FALSE;
+
+		free(payload);
+	}
+
+	flock(fd, LOCK_UN);
+
+	return(result);
+}
@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "stats.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/*************************************************************************** constants */
+
+#define STATS_MAGIC     0x54534343u /* CCST */
+#define STATS_VERSION   3u
+#define STATS_SUB_BITS  3
+#define STATS_SUB       (1 << STATS_SUB_BITS)
+#define STATS_EXP_MAX   35
+#define STATS_BUCKETS   (STATS_SUB + (STATS_EXP_MAX - STATS_SUB_BITS + 1) * STATS_SUB)
+
+static const char * const stats_commands[] = {
+	"none", "archive", "audit", "bookmark", "bookmarks", "compact", "complete", "discard", "help",
+	"import-tasks", "log", "optimize", "recent", "report", "start", "stats", "status", "stop", "sync", "tasks", "wipe",
+	"other", 0
+};
+
+static const char * const stats_phases[] = {
+	"total", "init", "open", "command", "finish"
+};
+
+#define STATS_COMMANDS  (sizeof(stats_commands) / sizeof(*stats_commands) - 1)
+
+/************************************************************************ declarations */
+
+/*
+ * Latency histograms shared by every invocation through a mapping:
+ *
+ *   magic | version | counts[commands][phases][buckets]
+ *
+ * Buckets are log-linear over microseconds, HDR style: values below
+ * STATS_SUB get a bucket each, above that every power of two is split in
+ * STATS_SUB buckets, so any recorded value is off by less than 1/16 when
+ * read back from the middle of its bucket. Invocations only ever add
+ * one to a counter with an atomic increment, the file is never locked
+ * except to lay it out or reset it.
+ */
+struct t_STATS_FILE {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t counts[STATS_COMMANDS][STATS_PHASES][STATS_BUCKETS];
+};
+
+struct t_STATS_INVOCATION {
+	struct timespec start;
+	uint64_t        began[STATS_PHASES];
+	uint64_t        spent[STATS_PHASES];
+	unsigned        running;
+	unsigned        done;
+	int             command;
+	BOOL            named;
+};
+
+static int                  stats_bucket(uint64_t);
+static const char          *stats_format(uint64_t, char *, size_t);
+static struct t_STATS_FILE *stats_map(int *);
+static uint64_t             stats_now(void);
+static uint64_t             stats_percentile(const uint32_t *, uint64_t, double);
+static uint64_t             stats_value(int);
+
+/********************************************************************* local variables */
+
+static struct t_STATS_INVOCATION invocation;
+
+/************************************************************************* definitions */
+
+void
+stats_begin(int phase)
+{
+	invocation.began[phase] = stats_now();
+	invocation.running |= 1u << phase;
+}
+
+void
+stats_command(const char *command)
+{
+	int i;
+
+	/* An invocation counts under its first command */
+	if (TRUE == invocation.named)
+		return;
+	invocation.named = TRUE;
+
+	for (i = 0; stats_commands[i]; ++i) {
+		if (0 == strcasecmp(stats_commands[i], command))
+			break;
+	}
+	invocation.command = stats_commands[i] ? i : (int) STATS_COMMANDS - 1;
+}
+
+void
+stats_end(int phase)
+{
+	if (0 == (invocation.running & (1u << phase)))
+		return;
+
+	/* Phases entered more than once add up, the database may be reopened */
+	invocation.spent[phase] += stats_now() - invocation.began[phase];
+	invocation.running &= ~(1u << phase);
+	invocation.done |= 1u << phase;
+}
+
+void
+stats_print(void)
+{
+	struct t_STATS_FILE *file;
+	char p50[16], p95[16], p99[16];
+	size_t c;
+	int fd;
+	int p;
+	int b;
+
+	if (0 == (file = stats_map(&fd)))
+		return;
+
+	printf("%-10s %-8s %10s %10s %10s %10s\n", "Command", "Phase", "Count", "p50", "p95", "p99");
+
+	for (c = 0; c < STATS_COMMANDS; ++c) {
+		BOOL first = TRUE;
+
+		for (p = 0; p < STATS_PHASES; ++p) {
+			const uint32_t *counts = file->counts[c][p];
+			uint64_t total = 0;
+
+			for (b = 0; b < STATS_BUCKETS; ++b)
+				total += __atomic_load_n(&counts[b], __ATOMIC_RELAXED);
+			if (0 == total)
+				continue;
+
+			printf("%-10s %-8s %10llu %10s %10s %10s\n",
+			       first ? stats_commands[c] : "", stats_phases[p], (unsigned long long) total,
+			       stats_format(stats_percentile(counts, total, .50), p50, sizeof(p50)),
+			       stats_format(stats_percentile(counts, total, .95), p95, sizeof(p95)),
+			       stats_format(stats_percentile(counts, total, .99), p99, sizeof(p99)));
+			first = FALSE;
+		}
+	}
+
+	munmap(file, sizeof(*file));
+	close(fd);
+}
+
+void
+stats_record(void)
+{
+	struct t_STATS_FILE *file;
+	int fd;
+	int p;
+
+	/*
+	 * Nothing is recorded before the charm directory is our working
+	 * directory, nor for looking at the counters themselves.
+	 */
+	if (0 == STATS_RECORD || 0 == (invocation.done & (1u << STATS_PHASE_INIT))
+	    || 0 == strcmp("stats", stats_commands[invocation.command]))
+		return;
+
+	for (p = 0; p < STATS_PHASES; ++p)
+		stats_end(p);
+
+	/* Command time is what is left after opening the database */
+	invocation.spent[STATS_PHASE_COMMAND] -= invocation.spent[STATS_PHASE_COMMAND]
+	                                       < invocation.spent[STATS_PHASE_OPEN]
+	                                       ? invocation.spent[STATS_PHASE_COMMAND]
+	                                       : invocation.spent[STATS_PHASE_OPEN];
+	invocation.spent[STATS_PHASE_TOTAL] = stats_now();
+	invocation.done |= 1u << STATS_PHASE_TOTAL;
+
+	if (0 == (file = stats_map(&fd)))
+		return;
+
+	for (p = 0; p < STATS_PHASES; ++p) {
+		if (invocation.done & (1u << p))
+			__atomic_fetch_add(&file->counts[invocation.command][p][stats_bucket(invocation.spent[p])],
+			                   1, __ATOMIC_RELAXED);
+	}
+
+	munmap(file, sizeof(*file));
+	close(fd);
+}
+
+void
+stats_reset(void)
+{
+	struct t_STATS_FILE *file;
+	int fd;
+
+	if (0 == (file = stats_map(&fd)))
+		return;
+
+	/* Increments racing the reset may survive it, close enough */
+	flock(fd, LOCK_EX);
+	memset(file->counts, 0, sizeof(file->counts));
+	flock(fd, LOCK_UN);
+
+	munmap(file, sizeof(*file));
+	close(fd);
+}
+
+void
+stats_start(void)
+{
+	memset(&invocation, 0, sizeof(invocation));
+	clock_gettime(CLOCK_MONOTONIC, &invocation.start);
+}
+
+/******************************************************************* local definitions */
+
+int
+stats_bucket(uint64_t us)
+{
+	int e;
+
+	if (us < STATS_SUB)
+		return((int) us);
+
+	e = 63 - __builtin_clzll(us);
+	if (STATS_EXP_MAX < e)
+		return(STATS_BUCKETS - 1);
+
+	return(STATS_SUB + (e - STATS_SUB_BITS) * STATS_SUB
+	       + (int) ((us >> (e - STATS_SUB_BITS)) & (STATS_SUB - 1)));
+}
+
+const char *
+stats_format(uint64_t us, char *buffer, size_t size)
+{
+	if (us < 1000)
+		snprintf(buffer, size, "%lluus", (unsigned long long) us);
+	else if (us < 1000000)
+		snprintf(buffer, size, "%.1fms", (double) us / 1e3);
+	else
+		snprintf(buffer, size, "%.2fs", (double) us / 1e6);
+
+	return(buffer);
+}
+
+struct t_STATS_FILE *
+stats_map(int *fd)
+{
+	struct t_STATS_FILE *file;
+	struct stat st;
+
+	if (-1 == (*fd = open(STATS_PATH, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR))) {
+		WARNING((stderr, "Unable to access stats file.\n"));
+		return(0);
+	}
+
+	/* Layout is only fixed up under the lock, settled files skip it */
+	if (0 != fstat(*fd, &st) || (size_t) st.st_size != sizeof(*file)) {
+		flock(*fd, LOCK_EX);
+		if (0 != fstat(*fd, &st) || (size_t) st.st_size != sizeof(*file)) {
+			if (0 != ftruncate(*fd, 0) || 0 != ftruncate(*fd, (off_t) sizeof(*file))) {
+				flock(*fd, LOCK_UN);
+				close(*fd);
+				return(0);
+			}
+		}
+		flock(*fd, LOCK_UN);
+	}
+
+	file = mmap(0, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (MAP_FAILED == file) {
+		close(*fd);
+		return(0);
+	}
+
+	/* Fresh or from another layout, start counting over */
+	if (STATS_MAGIC != file->magic || STATS_VERSION != file->version) {
+		flock(*fd, LOCK_EX);
+		if (STATS_MAGIC != file->magic || STATS_VERSION != file->version) {
+			memset(file->counts, 0, sizeof(file->counts));
+			file->version = STATS_VERSION;
+			__atomic_store_n(&file->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+		}
+		flock(*fd, LOCK_UN);
+	}
+
+	return(file);
+}
+
+uint64_t
+stats_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return((uint64_t) (now.tv_sec - invocation.start.tv_sec) * 1000000u
+	       + (uint64_t) (now.tv_nsec / 1000) - (uint64_t) (invocation.start.tv_nsec / 1000));
+}
+
+uint64_t
+stats_percentile(const uint32_t *counts, uint64_t total, double quantile)
+{
+	uint64_t rank = (uint64_t) ((double) total * quantile + .5);
+	uint64_t seen = 0;
+	int b;
+
+	if (0 == rank)
+		rank = 1;
+
+	for (b = 0; b < STATS_BUCKETS; ++b) {
+		seen += __atomic_load_n(&counts[b], __ATOMIC_RELAXED);
+		if (seen >= rank)
+			return((stats_value(b) + stats_value(b + 1) - 1) / 2);
+	}
+
+	return(stats_value(STATS_BUCKETS - 1));
+}
+
+uint64_t
+stats_value(int bucket)
+{
+	int e;
+
+	/* Lowest value landing in the bucket */
+	if (bucket < STATS_SUB)
+		return((uint64_t) bucket);
+
+	e = (bucket - STATS_SUB) / STATS_SUB + STATS_SUB_BITS;
+
+	return((uint64_t) (STATS_SUB + (bucket - STATS_SUB) % STATS_SUB) << (e - STATS_SUB_BITS));
+}
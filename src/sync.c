@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "sync.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "session.h"
+
+/*************************************************************************** constants */
+
+#define SYNC_CONFLICTS_SHOWN 10
+#define SYNC_DESKTOP         1
+
+/* Events one installation has past a mark, taking the schema they are read from */
+const char sync_delta_query[] =
+	"SELECT `event_id`, `user_id`, `report_id`, `task`, `comment`, `start`, `end` "
+	"FROM `%s`.`Events` WHERE (`installation_id` IN (?1, ?2)) AND (`event_id` > ?3) "
+	"ORDER BY `event_id`";
+
+/************************************************************************ declarations */
+
+/*
+ * Events are identified across databases by (installation_id, event_id),
+ * event_id being the row id at the installation that recorded them. Each
+ * database remembers, per installation, the highest event_id it has
+ * taken in; a sync only reads events above the other side's mark.
+ *
+ * The desktop app records its own events as installation 1 in every
+ * database, so those are sent under the database's ccharm installation id
+ * instead; its events stay apart from another desktop's on the other side.
+ * Keys found holding different content are listed per event and checked
+ * again on later syncs, the mark moves on past them.
+ */
+struct t_SYNC_CONFLICT {
+	sqlite3_int64 installation;
+	sqlite3_int64 event_id;
+};
+
+struct t_SYNC_CONFLICTS {
+	struct t_SYNC_CONFLICT *keys;
+	int                     count;
+};
+
+struct t_SYNC_COUNT {
+	int transferred;
+	struct t_SYNC_CONFLICTS *conflicts;
+};
+
+struct t_SYNC_PUSH {
+	sqlite3_stmt        *existing;
+	sqlite3_stmt        *insert;
+	struct t_SYNC_COUNT *count;
+};
+
+static void     sync_conflict(struct t_SYNC_CONFLICTS *, sqlite3_int64, sqlite3_int64, const unsigned char *);
+static BOOL     sync_event(struct t_SYNC_PUSH *, sqlite3_int64, sqlite3_stmt *);
+static uint64_t sync_hash(sqlite3_stmt *, int);
+static void     sync_exec(const char *);
+static void     sync_prepare(const char *, sqlite3_stmt **);
+static void     sync_push(const char *, const char *, struct t_SYNC_COUNT *);
+static void     sync_schema(const char *);
+static void     sync_step(sqlite3_stmt *);
+
+/************************************************************************* definitions */
+
+void
+sync_events(const char *path, BOOL dry_run)
+{
+	struct t_SYNC_CONFLICTS conflicts;
+	struct t_SYNC_COUNT sent, received;
+	char *querystr;
+
+	if (0 != access(path, R_OK | W_OK)) {
+		ERROR((stderr, "Can't access sync database: %s\n", path));
+		quit(-1);
+	}
+
+	use_database(DB_PROFILE_WRITE);
+
+	querystr = sqlite3_mprintf("ATTACH DATABASE %Q AS `peer`", path);
+	sync_exec(querystr);
+	sqlite3_free(querystr);
+
+	/*
+	 * WAL databases commit atomically one file at a time, not across an
+	 * attachment. Each direction only writes the receiving side, its events
+	 * and marks together, so each lands in a transaction of its own; a
+	 * crash in between leaves a consistent half the next sync carries on
+	 * from. Dry runs keep it all in one and roll it back.
+	 */
+	sync_exec("BEGIN IMMEDIATE");
+	sync_schema("main");
+	sync_schema("peer");
+	sync_installation(session.db, "main");
+	sync_installation(session.db, "peer");
+
+	memset(&conflicts, 0, sizeof(conflicts));
+	memset(&sent, 0, sizeof(sent));
+	memset(&received, 0, sizeof(received));
+	sent.conflicts = received.conflicts = &conflicts;
+
+	if (FALSE == dry_run) {
+		sync_exec("COMMIT");
+		sync_exec("BEGIN IMMEDIATE");
+	}
+	sync_push("main", "peer", &sent);
+
+	if (FALSE == dry_run) {
+		sync_exec("COMMIT");
+		sync_exec("BEGIN IMMEDIATE");
+	}
+	sync_push("peer", "main", &received);
+
+	sync_exec(TRUE == dry_run ? "ROLLBACK" : "COMMIT");
+	sync_exec("DETACH DATABASE `peer`");
+
+	printf("%s %d event(s), %s %d event(s), %d conflict(s).\n",
+	       dry_run ? "Would send" : "Sent", sent.transferred,
+	       dry_run ? "would receive" : "received", received.transferred,
+	       conflicts.count);
+
+	free(conflicts.keys);
+}
+
+int
+sync_installation(sqlite3 *db, const char *schema)
+{
+	sqlite3_stmt *stmt;
+	char *querystr;
+	char *errstr;
+	int id = 0;
+
+	/*
+	 * Charm databases all start out as installation 1, pick a random id
+	 * once so two copies of the same file stop minting the same keys.
+	 */
+	querystr = sqlite3_mprintf(
+	    "CREATE TABLE IF NOT EXISTS %w.`ccharm_installation` (`id` INTEGER); "
+	    "INSERT INTO %w.`ccharm_installation` "
+	        "SELECT (abs(random()) %% 2147483640) + 2 "
+	        "WHERE NOT EXISTS (SELECT 1 FROM %w.`ccharm_installation`)",
+	    schema, schema, schema);
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+	sqlite3_free(querystr);
+
+	querystr = sqlite3_mprintf("SELECT `id` FROM %w.`ccharm_installation` LIMIT 1", schema);
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		quit(-1);
+	}
+	if (SQLITE_ROW == sqlite3_step(stmt))
+		id = sqlite3_column_int(stmt, 0);
+	sqlite3_finalize(stmt);
+	sqlite3_free(querystr);
+
+	return(id);
+}
+
+/******************************************************************* local definitions */
+
+void
+sync_conflict(struct t_SYNC_CONFLICTS *conflicts, sqlite3_int64 installation,
+              sqlite3_int64 event_id, const unsigned char *start)
+{
+	int i;
+
+	/* Both directions trip over the same pair, report it once */
+	for (i = 0; i < conflicts->count; ++i) {
+		if (conflicts->keys[i].installation == installation &&
+		    conflicts->keys[i].event_id == event_id)
+			return;
+	}
+
+	if (SYNC_CONFLICTS_SHOWN > conflicts->count)
+		ERROR((stderr, "Conflict: installation %lld event %lld (%s)\n",
+		       (long long) installation, (long long) event_id, start));
+
+	conflicts->keys = realloc(conflicts->keys,
+	                          sizeof(struct t_SYNC_CONFLICT) * (size_t) (conflicts->count + 1));
+	conflicts->keys[conflicts->count].installation = installation;
+	conflicts->keys[conflicts->count].event_id = event_id;
+	++conflicts->count;
+}
+
+BOOL
+sync_event(struct t_SYNC_PUSH *push, sqlite3_int64 installation, sqlite3_stmt *row)
+{
+	sqlite3_int64 event_id = sqlite3_column_int64(row, 0);
+	BOOL conflicted = FALSE;
+	int i;
+
+	sqlite3_bind_int64(push->existing, 1, installation);
+	sqlite3_bind_int64(push->existing, 2, event_id);
+	if (SQLITE_ROW == sqlite3_step(push->existing)) {
+		/* Same key on both sides, identical content is just a copy */
+		if (sync_hash(row, 3) != sync_hash(push->existing, 0)) {
+			sync_conflict(push->count->conflicts, installation, event_id,
+			              sqlite3_column_text(row, 5));
+			conflicted = TRUE;
+		}
+	} else {
+		sqlite3_bind_int64(push->insert, 1, installation);
+		sqlite3_bind_int64(push->insert, 2, event_id);
+		for (i = 1; i < 7; ++i)
+			sqlite3_bind_value(push->insert, i + 2, sqlite3_column_value(row, i));
+		sync_step(push->insert);
+		++push->count->transferred;
+	}
+	sqlite3_reset(push->existing);
+
+	return(conflicted);
+}
+
+uint64_t
+sync_hash(sqlite3_stmt *stmt, int column)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int i;
+
+	/* FNV-1a over task, comment, start and end, NULL apart from empty */
+	for (i = column; i < column + 4; ++i) {
+		const unsigned char *value = sqlite3_column_text(stmt, i);
+		int len = sqlite3_column_bytes(stmt, i);
+		int j;
+
+		hash ^= (0 == value) ? 0xff : 0xfe;
+		hash *= 1099511628211ULL;
+		for (j = 0; j < len; ++j) {
+			hash ^= value[j];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	return(hash);
+}
+
+void
+sync_exec(const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, 0, &errstr)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+}
+
+void
+sync_prepare(const char *querystr, sqlite3_stmt **stmt)
+{
+	if (SQLITE_OK != sqlite3_prepare_v2(session.db, querystr, -1, stmt, NULL)) {
+		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	assert(*stmt);
+}
+
+void
+sync_push(const char *from, const char *to, struct t_SYNC_COUNT *count)
+{
+	struct t_SYNC_PUSH push;
+	sqlite3_stmt *next, *mark, *delta, *lookup, *listed, *hold, *release, *update;
+	sqlite3_int64 installation = INT64_MIN;
+	sqlite3_int64 *pending = 0;
+	char querystr[512];
+	BOOL desktop = FALSE;
+	int own, origin;
+
+	own = sync_installation(session.db, to);
+	origin = sync_installation(session.db, from);
+
+	snprintf(querystr, sizeof(querystr),
+	    "SELECT MIN(`installation_id`) FROM `%s`.`Events` WHERE `installation_id` > ?", from);
+	sync_prepare(querystr, &next);
+	snprintf(querystr, sizeof(querystr),
+	    "SELECT `event_id` FROM `%s`.`ccharm_sync_marks` WHERE `installation_id` = ?", to);
+	sync_prepare(querystr, &mark);
+	snprintf(querystr, sizeof(querystr), sync_delta_query, from);
+	sync_prepare(querystr, &delta);
+	snprintf(querystr, sizeof(querystr),
+	    "SELECT `event_id`, `user_id`, `report_id`, `task`, `comment`, `start`, `end` "
+	    "FROM `%s`.`Events` WHERE (`installation_id` IN (?1, ?2)) AND (`event_id` = ?3)", from);
+	sync_prepare(querystr, &lookup);
+	snprintf(querystr, sizeof(querystr),
+	    "SELECT `task`, `comment`, `start`, `end` FROM `%s`.`Events` "
+	    "WHERE (`installation_id` = ?) AND (`event_id` = ?)", to);
+	sync_prepare(querystr, &push.existing);
+	snprintf(querystr, sizeof(querystr),
+	    "INSERT INTO `%s`.`Events` (`installation_id`, `event_id`, `user_id`, `report_id`, "
+	                               "`task`, `comment`, `start`, `end`) "
+	    "VALUES (?, ?, ?, ?, ?, ?, ?, ?)", to);
+	sync_prepare(querystr, &push.insert);
+	snprintf(querystr, sizeof(querystr),
+	    "SELECT `event_id` FROM `%s`.`ccharm_sync_conflicts` WHERE `installation_id` = ?", to);
+	sync_prepare(querystr, &listed);
+	snprintf(querystr, sizeof(querystr),
+	    "INSERT OR IGNORE INTO `%s`.`ccharm_sync_conflicts` VALUES (?, ?)", to);
+	sync_prepare(querystr, &hold);
+	snprintf(querystr, sizeof(querystr),
+	    "DELETE FROM `%s`.`ccharm_sync_conflicts` "
+	    "WHERE (`installation_id` = ?) AND (`event_id` = ?)", to);
+	sync_prepare(querystr, &release);
+	snprintf(querystr, sizeof(querystr),
+	    "INSERT OR REPLACE INTO `%s`.`ccharm_sync_marks` VALUES (?, ?)", to);
+	sync_prepare(querystr, &update);
+
+	push.count = count;
+
+	/* Walk the distinct installations through the index, one seek each */
+	for (;;) {
+		sqlite3_int64 high = 0, last, key, stored;
+		int pending_count = 0;
+		int i;
+
+		sqlite3_bind_int64(next, 1, installation);
+		if (SQLITE_ROW != sqlite3_step(next) || SQLITE_NULL == sqlite3_column_type(next, 0)) {
+			sqlite3_reset(next);
+			break;
+		}
+		installation = sqlite3_column_int64(next, 0);
+		sqlite3_reset(next);
+
+		/* Desktop events travel as the sending database's, with its ccharm ones */
+		key = stored = installation;
+		if (SYNC_DESKTOP == installation) {
+			key = origin;
+			desktop = TRUE;
+		} else if (origin == installation) {
+			if (TRUE == desktop)
+				continue;
+			stored = SYNC_DESKTOP;
+		}
+
+		/* Nobody knows a database's own events better than itself */
+		if (key == own)
+			continue;
+
+		/* Earlier conflicts first, dropped from the list once resolved */
+		sqlite3_bind_int64(listed, 1, key);
+		while (SQLITE_ROW == sqlite3_step(listed)) {
+			pending = realloc(pending, sizeof(sqlite3_int64) * (size_t) (pending_count + 1));
+			pending[pending_count++] = sqlite3_column_int64(listed, 0);
+		}
+		sqlite3_reset(listed);
+
+		for (i = 0; i < pending_count; ++i) {
+			BOOL conflicted = FALSE;
+
+			sqlite3_bind_int64(lookup, 1, key);
+			sqlite3_bind_int64(lookup, 2, stored);
+			sqlite3_bind_int64(lookup, 3, pending[i]);
+			if (SQLITE_ROW == sqlite3_step(lookup))
+				conflicted = sync_event(&push, key, lookup);
+			sqlite3_reset(lookup);
+
+			if (FALSE == conflicted) {
+				sqlite3_bind_int64(release, 1, key);
+				sqlite3_bind_int64(release, 2, pending[i]);
+				sync_step(release);
+			}
+		}
+
+		sqlite3_bind_int64(mark, 1, key);
+		if (SQLITE_ROW == sqlite3_step(mark))
+			high = sqlite3_column_int64(mark, 0);
+		sqlite3_reset(mark);
+		last = high;
+
+		sqlite3_bind_int64(delta, 1, key);
+		sqlite3_bind_int64(delta, 2, stored);
+		sqlite3_bind_int64(delta, 3, high);
+		while (SQLITE_ROW == sqlite3_step(delta)) {
+			last = sqlite3_column_int64(delta, 0);
+
+			if (TRUE == sync_event(&push, key, delta)) {
+				sqlite3_bind_int64(hold, 1, key);
+				sqlite3_bind_int64(hold, 2, last);
+				sync_step(hold);
+			}
+		}
+		sqlite3_reset(delta);
+
+		if (last != high) {
+			sqlite3_bind_int64(update, 1, key);
+			sqlite3_bind_int64(update, 2, last);
+			sync_step(update);
+		}
+	}
+
+	free(pending);
+
+	sqlite3_finalize(next);
+	sqlite3_finalize(mark);
+	sqlite3_finalize(delta);
+	sqlite3_finalize(lookup);
+	sqlite3_finalize(push.existing);
+	sqlite3_finalize(push.insert);
+	sqlite3_finalize(listed);
+	sqlite3_finalize(hold);
+	sqlite3_finalize(release);
+	sqlite3_finalize(update);
+}
+
+void
+sync_schema(const char *schema)
+{
+	char querystr[512];
+
+	/* The delta and key lookups are both seeks on this index */
+	snprintf(querystr, sizeof(querystr),
+	    "CREATE TABLE IF NOT EXISTS `%s`.`ccharm_sync_marks` "
+	        "(`installation_id` INTEGER PRIMARY KEY, `event_id` INTEGER); "
+	    "CREATE TABLE IF NOT EXISTS `%s`.`ccharm_sync_conflicts` "
+	        "(`installation_id` INTEGER, `event_id` INTEGER, "
+	         "PRIMARY KEY (`installation_id`, `event_id`)); "
+	    "CREATE INDEX IF NOT EXISTS `%s`.`ccharm_events_origin` "
+	        "ON `Events` (`installation_id`, `event_id`)",
+	    schema, schema, schema);
+	sync_exec(querystr);
+}
+
+void
+sync_step(sqlite3_stmt *stmt)
+{
+	if (SQLITE_DONE != sqlite3_step(stmt)) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
+		quit(-1);
+	}
+	sqlite3_reset(stmt);
+}
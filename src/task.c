@@ -33,26 +33,131 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
+#include "db.h"
+#include "frecency.h"
+#include "query.h"
 #include "session.h"
 #include "stack.h"
+#include "stamp.h"
+#include "sync.h"
+#include "tree.h"
 
 /************************************************************************ declarations */
 
-static int task_recurse_name_callback(void *, int, char **, char **);
-static int task_tasks_callback(void *, int, char **, char **);
+struct t_TASK_LEAF {
+	int post;
+	int task_id;
+};
+
+struct t_TASK_CHILD {
+	int  task_id;
+	BOOL trackable;
+};
+
+/* Leaf consumer, returning FALSE stops the search */
+typedef BOOL (*TASK_LEAF_FN)(sqlite3 *, int, void *);
+
+struct t_TASK_SEEN {
+	int    *slots;
+	size_t  capacity;
+	size_t  count;
+	BOOL    failed;
+};
+
+struct t_TASK_FILTER {
+	const QUERY_RESULT *result;
+	TASK_LEAF_FN        fn;
+	void               *data;
+};
+
+struct t_TASK_PRINT {
+	FILE       *out;
+	const char *tag;
+	int         limit;
+	int         printed;
+	BOOL        stopped;
+	BOOL        failed;
+	BOOL        capture;
+	char       *captured;
+	size_t      captured_size;
+	size_t      captured_capacity;
+};
+
+static int  task_leaf_compare(const void *, const void *);
+static BOOL task_find_leafs(sqlite3 *, int, BOOL, struct t_TASK_SEEN *, TASK_LEAF_FN, void *);
+static void task_bookmark_merge(void *, void *);
+static void task_merge(void *, void *);
+static void task_recent_merge(void *, void *);
+static BOOL task_seen_insert(struct t_TASK_SEEN *, int);
+static STACK task_tasks_collect(sqlite3 *, const char *);
+static BOOL task_tasks_each(sqlite3 *, const char *, TASK_LEAF_FN, void *);
+static BOOL task_tasks_filter(sqlite3 *, int, void *);
+static BOOL task_tasks_print(sqlite3 *, int, void *);
+static BOOL task_tasks_push(sqlite3 *, int, void *);
+static BOOL task_walk_leafs(sqlite3 *, int, BOOL, int, struct t_TASK_SEEN *, TASK_LEAF_FN, void *);
 
 /*************************************************************************** constants */
 
+#define TASK_WALK_DEPTH_MAX 64
+
 static const size_t ctask_size = sizeof(TASK);
 static const size_t ctask_bookmark_size = sizeof(TASK_BOOKMARK);
 static const size_t ctask_recent_size = sizeof(TASK_RECENT);
 
+/* The whole ancestry in one statement, however deep the task sits */
+const char task_name_query[] =
+	"WITH RECURSIVE `chain`(`task_id`, `parent`, `trackable`, `name`, `depth`) AS ("
+	    "SELECT `task_id`, `parent`, `trackable`, `name`, 0 FROM `Tasks` "
+	    "WHERE `task_id` = ?1 "
+	    "UNION ALL SELECT `t`.`task_id`, `t`.`parent`, `t`.`trackable`, `t`.`name`, `c`.`depth` + 1 "
+	    "FROM `chain` AS `c` CROSS JOIN `Tasks` AS `t` ON `t`.`task_id` = `c`.`parent` "
+	    "WHERE `c`.`parent` != 0 AND `c`.`depth` < ?2) "
+	"SELECT `task_id`, `trackable`, `name` FROM `chain` ORDER BY `depth`";
+
+/*
+ * The whole subtree is one range over the Euler tour numbering; the
+ * side file has no statistics, so the join order is spelled out.
+ */
+const char task_leafs_query[] =
+	"SELECT `d`.`task_id`, `d`.`post`, `t`.`trackable`, "
+	       "(`t`.`validfrom`  <= CURRENT_DATE OR `t`.`validfrom`  ISNULL) "
+	   "AND (`t`.`validuntil` >= CURRENT_DATE OR `t`.`validuntil` ISNULL) "
+	"FROM `ccharm_tree`.`tree` AS `r` CROSS JOIN `ccharm_tree`.`tree` AS `d` CROSS JOIN `Tasks` AS `t` "
+	"WHERE (`r`.`task_id` = ?) "
+	  "AND (`d`.`pre` BETWEEN `r`.`pre` AND `r`.`post`) "
+	  "AND (`t`.`task_id` = `d`.`task_id`) "
+	"ORDER BY `d`.`pre`";
+
+/* The level walk starts from the root, if it is still valid */
+const char task_root_query[] =
+	"SELECT `trackable` FROM `Tasks` "
+	"WHERE (`task_id` = ?) "
+	   "AND (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
+	   "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL)";
+
+/* Children in id order, as the tree numbering visits them */
+const char task_children_query[] =
+	"SELECT `task_id`, `trackable` FROM `Tasks` "
+	"WHERE (`parent` = ?) "
+	   "AND (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
+	   "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL) "
+	"ORDER BY `task_id`";
+
 /******************************************************************************* flags */
 
 static BOOL modtask;
 static BOOL modbookmark;
 static BOOL modrecent;
 
+/********************************************************************* local variables */
+
+/* As loaded, saves only merge what changed since into the shared state */
+static TASK          task_base;
+static TASK_BOOKMARK bookmark_base;
+static int           recent_pushed;
+static BOOL          recent_cleared;
+
 /************************************************************************* definitions */
 
 BOOL
@@ -69,13 +174,10 @@ task_bookmark_clear(void)
 }
 
 void
-task_bookmark_load(int fd)
+task_bookmark_load(STATE state)
 {
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_bookmark_size != read(fd, &bookmark, ctask_bookmark_size)) {
-		INFO((stderr, "Unable to read bookmark tasks. Initializing.\n"));
-		task_bookmark_clear();
-	}
+	state_read(state, &bookmark);
+	memcpy(&bookmark_base, &bookmark, ctask_bookmark_size);
 	modbookmark = FALSE;
 }
 
@@ -98,16 +200,12 @@ task_bookmark_print(void)
 }
 
 void
-task_bookmark_save(int fd)
+task_bookmark_save(STATE state)
 {
 	if (FALSE == modbookmark)
 		return;
 
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_bookmark_size != write(fd, &bookmark, ctask_bookmark_size)) {
-		ERROR((stderr, "Unable to save bookmark tasks. ABORT.\n"));
-		quit(-1);
-	}
+	state_update(state, task_bookmark_merge, 0);
 	modbookmark = FALSE;
 }
 
@@ -157,34 +255,60 @@ task_comment(const char *comment)
 	modtask = TRUE;
 }
 
-void
-task_recurse_name(int id, char *task_name)
+BOOL
+task_recurse_name(sqlite3 *db, int id, char *task_name)
 {
-	char querystr[128];
-	char *errstr;
-	int   errcode;
+	sqlite3_stmt *stmt;
+	size_t len;
+	int ret;
+
+	ret = sqlite3_prepare_v2(db, task_name_query, sizeof(task_name_query), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", task_name_query, sqlite3_errmsg(db)));
+		return(FALSE);
+	}
+	assert(stmt);
 
-	sprintf(querystr, "SELECT `parent`, `task_id`, `trackable`, `name` FROM `Tasks` "
-	                  "WHERE `task_id` = \"%d\" LIMIT 1",
-	                  id);
+	/* Every level takes a few characters at least, deeper ones (or cycles) can't fit */
+	sqlite3_bind_int(stmt, 1, id);
+	sqlite3_bind_int(stmt, 2, MAX_TASK_NAME_LEN / 4);
 
-	errcode = sqlite3_exec(session.db, querystr, task_recurse_name_callback, task_name, &errstr);
-	if (SQLITE_OK != errcode &&
-	    SQLITE_ABORT != errcode) {
-		ERROR((stderr, "SQL error: %s\n", errstr));
-		sqlite3_free(errstr);
-		quit(-1);
+	len = strlen(task_name);
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 2);
+		size_t room = MAX_TASK_NAME_LEN + 1 - len;
+		int written;
+
+		if (0 == name)
+			name = "";
+
+		if (1 == sqlite3_column_int(stmt, 1))
+			written = snprintf(task_name + len, room, "%s[%04d] %s",
+			                   0 < len ? "\n   " : "", sqlite3_column_int(stmt, 0), name);
+		else
+			written = snprintf(task_name + len, room, "%s{%04d} %s",
+			                   0 < len ? "\n   " : "", sqlite3_column_int(stmt, 0), name);
+
+		/* Cut short at the buffer's end, the outermost parents are dropped */
+		if (0 > written || room <= (size_t) written)
+			break;
+		len += (size_t) written;
+	}
+	if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+		sqlite3_finalize(stmt);
+		return(FALSE);
 	}
+	sqlite3_finalize(stmt);
+
+	return(TRUE);
 }
 
 void
-task_load(int fd)
+task_load(STATE state)
 {
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_size != read(fd, &task, ctask_size)) {
-		INFO((stderr, "Unable to load current task state. Initializing.\n"));
-		task_clear(TRUE);
-	}
+	state_read(state, &task);
+	memcpy(&task_base, &task, ctask_size);
 	modtask = FALSE;
 }
 
@@ -210,21 +334,46 @@ task_print(void)
 	}
 }
 
+void
+task_print_line(FILE *out)
+{
+	int name_len = (int) strcspn(task.task_name, "\n");
+
+	if (TRUE == task_active()) {
+		double delta_t = difftime(time(0), task.start_time);
+		double hours, minutes, seconds;
+
+		hours = floor(delta_t / SECONDS_PER_HOUR);
+		delta_t -= (hours * SECONDS_PER_HOUR);
+		minutes = floor(delta_t / SECONDS_PER_MINUTE);
+		seconds = delta_t - (minutes * SECONDS_PER_MINUTE);
+
+		fprintf(out, "%.*s (%s) %02d:%02d:%02d\n",
+		        name_len, task.task_name, task.comment,
+		        (int) hours, (int) minutes, (int) seconds);
+	} else if (0 != task.task_id) {
+		fprintf(out, "%.*s (%s) stopped\n",
+		        name_len, task.task_name, task.comment);
+	} else {
+		fprintf(out, "No task\n");
+	}
+}
+
 void
 task_recent_clear(void)
 {
 	memset(&recent, 0, ctask_recent_size);
+	recent_pushed = 0;
+	recent_cleared = TRUE;
 	modrecent = TRUE;
 }
 
 void
-task_recent_load(int fd)
+task_recent_load(STATE state)
 {
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_recent_size != read(fd, &recent, ctask_recent_size)) {
-		INFO((stderr, "Unable to read recent tasks. Initializing.\n"));
-		task_recent_clear();
-	}
+	state_read(state, &recent);
+	recent_pushed = 0;
+	recent_cleared = FALSE;
 	modrecent = FALSE;
 }
 
@@ -248,16 +397,12 @@ task_recent_print(void)
 }
 
 void
-task_recent_save(int fd)
+task_recent_save(STATE state)
 {
 	if (FALSE == modrecent)
 		return;
 
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_recent_size != write(fd, &recent, ctask_recent_size)) {
-		ERROR((stderr, "Unable to save recent tasks. ABORT.\n"));
-		quit(-1);
-	}
+	state_update(state, task_recent_merge, 0);
 	modrecent = FALSE;
 }
 
@@ -283,6 +428,8 @@ task_recent_store(void)
 		memcpy(&recent.tasks[i], &recent.tasks[i - 1], ctask_size);
 	memcpy(&recent.tasks[0], &task, ctask_size);
 	recent.tasks[0].start_time = 0;
+	if (MAX_TASK_RECENT_LEN > recent_pushed)
+		++recent_pushed;
 	modrecent = TRUE;
 }
 
@@ -294,25 +441,24 @@ task_reset(void)
 }
 
 void
-task_save(int fd)
+task_save(STATE state)
 {
 	if (FALSE == modtask)
 	  return;
 
-	lseek(fd, (off_t) 0, SEEK_SET);
-	if ((int)ctask_size != write(fd, &task, ctask_size)) {
-		ERROR((stderr, "Unable to save current task state. ABORT.\n"));
-		quit(-1);
-	}
+	state_update(state, task_merge, 0);
 	modtask = FALSE;
 }
 
 void
 task_select(int id)
 {
+	use_database(DB_PROFILE_READ);
+
 	task.task_id = id;
 	memset(task.task_name, 0, sizeof(task.task_name));
-	task_recurse_name(id, task.task_name);
+	if (FALSE == task_recurse_name(session.db, id, task.task_name))
+		quit(-1);
 	modtask = TRUE;
 }
 
@@ -321,27 +467,31 @@ task_store(void)
 {
 	void *null = 0;
 	char querystr[512];
+	char start_time[STAMP_SIZE];
+	char end_time[STAMP_SIZE];
 	char *errstr;
-	time_t now;
-	struct tm start_time;
-	struct tm end_time;
-	struct tm *tm_time;
+	int installation;
 
 	if (0 == task.start_time)
 		return;
 
-	now = time(0);
-	tm_time = localtime(&task.start_time);
-	memcpy(&start_time, tm_time, sizeof(struct tm));
-	tm_time = localtime(&now);
-	memcpy(&end_time,   tm_time, sizeof(struct tm));
+	use_database(DB_PROFILE_WRITE);
+
+	if (SQLITE_OK != sqlite3_exec(session.db, "BEGIN IMMEDIATE", 0, null, &errstr) ) {
+		ERROR((stderr, "SQL error: %s\n", errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+
+	installation = sync_installation(session.db, "main");
+
+	stamp_format(stamp_local((int64_t) task.start_time), start_time);
+	stamp_format(stamp_local((int64_t) time(0)), end_time);
 
 	sprintf(querystr, "INSERT INTO `Events` "
 	                  " (`installation_id`, `report_id`, `task`, `comment`, `start`, `end`) "
-	                  " VALUES (1, 0, %d, \"%s\", \"%4d-%02d-%02dT%02d:%02d:%02d\", \"%4d-%02d-%02dT%02d:%02d:%02d\")",
-	        task.task_id, task.comment,
-	        1900 + start_time.tm_year, 1 + start_time.tm_mon, start_time.tm_mday, start_time.tm_hour, start_time.tm_min, start_time.tm_sec,
-	        1900 + end_time.tm_year, 1 + end_time.tm_mon, end_time.tm_mday, end_time.tm_hour, end_time.tm_min, end_time.tm_sec);
+	                  " VALUES (%d, 0, %d, \"%s\", \"%s\", \"%s\")",
+	        installation, task.task_id, task.comment, start_time, end_time);
 
 	if (SQLITE_OK != sqlite3_exec(session.db, querystr, 0, null, &errstr) ) {
 		ERROR((stderr, "SQL error: %s\n", errstr));
@@ -357,180 +507,447 @@ task_store(void)
 		quit(-1);
 	}
 
+	if (SQLITE_OK != sqlite3_exec(session.db, "COMMIT", 0, null, &errstr) ) {
+		ERROR((stderr, "SQL error: %s\n", errstr));
+		sqlite3_free(errstr);
+		quit(-1);
+	}
+
 	task_recent_store();
 }
 
 void
-task_tasks(const char *keyword)
+task_tasks(const char *keyword, int limit)
 {
-	STACK leafs;
-	char querystr[512];
-	char task_name[MAX_TASK_NAME_LEN + 1];
-	char *errstr;
-	int task_id;
+	struct t_TASK_PRINT print;
 
-	sprintf(querystr, "SELECT `task_id`, `name` FROM `Tasks` "
-	                  "WHERE (`name` LIKE \"%%%s%%\"  OR `task_id` = \"%s\") "
-	                    "AND (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
-	                    "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL)",
-	                   keyword, keyword);
+	/* Repeated queries are answered without opening the database */
+	if (TRUE == cache_tasks_print(keyword, stdout, limit))
+		return;
 
-	leafs = stack_create();
+	use_database(DB_PROFILE_READ);
 
-	if (SQLITE_OK != sqlite3_exec(session.db, querystr, task_tasks_callback, leafs, &errstr) ) {
-		ERROR((stderr, "SQL error: %s\n", errstr));
-		sqlite3_free(errstr);
+	memset(&print, 0, sizeof(print));
+	print.out = stdout;
+	print.limit = limit;
+	print.capture = TRUE;
+
+	if (FALSE == task_tasks_each(session.db, keyword, task_tasks_print, &print) ||
+	    TRUE == print.failed)
 		quit(-1);
-	}
 
+	cache_tasks_store(print.captured, print.captured_size, print.printed, FALSE == print.stopped);
+	free(print.captured);
+}
+
+BOOL
+task_tasks_query(sqlite3 *db, const char *keyword, FILE *out, const char *tag, int limit)
+{
+	struct t_TASK_PRINT print;
+
+	memset(&print, 0, sizeof(print));
+	print.out = out;
+	print.tag = tag;
+	print.limit = limit;
+
+	/* Shared with worker threads, so errors go back to the caller */
+	if (FALSE == task_tasks_each(db, keyword, task_tasks_print, &print))
+		return(FALSE);
+
+	return(TRUE == print.failed ? FALSE : TRUE);
+}
+
+void
+task_tasks_top(const char *keyword, int top)
+{
+	STACK leafs;
+	char task_name[MAX_TASK_NAME_LEN + 1];
+	int *ids, *ranked;
+	int count = 0;
+	int capacity = 64;
+	int i;
+
+	use_database(DB_PROFILE_READ);
+
+	leafs = task_tasks_collect(session.db, keyword);
+	ids = malloc(sizeof(int) * (size_t) capacity);
 	while (stack_empty(leafs) == FALSE) {
-		memset(task_name, 0, sizeof(task_name));
-		task_id = stack_pop(leafs);
-		task_recurse_name(task_id, task_name);
+		if (count == capacity) {
+			capacity *= 2;
+			ids = realloc(ids, sizeof(int) * (size_t) capacity);
+		}
+		ids[count++] = stack_pop(leafs);
+	}
+	stack_destroy(leafs);
+
+	frecency_refresh();
 
+	ranked = malloc(sizeof(int) * (size_t) (top > 0 ? top : 1));
+	count = frecency_rank(ids, count, ranked, top);
+
+	for (i = 0; i < count; ++i) {
+		memset(task_name, 0, sizeof(task_name));
+		if (FALSE == task_recurse_name(session.db, ranked[i], task_name))
+			quit(-1);
 		printf("%s\n", task_name);
 	}
 
-	stack_destroy(leafs);
+	free(ranked);
+	free(ids);
 }
 
 BOOL
-task_trackable(int id)
+task_find_leafs(sqlite3 *db, int parent, BOOL ranged, struct t_TASK_SEEN *seen, TASK_LEAF_FN fn, void *data)
 {
-	BOOL trackable;
+	struct t_TASK_LEAF *leafs = 0;
+	BOOL more = TRUE;
+	int leafs_count = 0;
+	int skip = 0;
 	int ret;
+	int i;
 	sqlite3_stmt *stmt;
 
-	const char querystr[] =
-	    "SELECT `trackable` FROM `Tasks` "
-	    "WHERE (`task_id` = ?) "
-	       "AND (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
-	       "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL) "
-	       "LIMIT 1";
+	/* Without a task tree the subtree is walked a level at a time */
+	if (FALSE == ranged) {
+		BOOL found, trackable;
 
-	ret = sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL);
-	if (SQLITE_OK != ret) {
-		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
-		quit(-1);
+		ret = sqlite3_prepare_v2(db, task_root_query, sizeof(task_root_query), &stmt, NULL);
+		if (SQLITE_OK != ret) {
+			ERROR((stderr, "SQL error: '%s' %s\n", task_root_query, sqlite3_errmsg(db)));
+			seen->failed = TRUE;
+			return(FALSE);
+		}
+		assert(stmt);
+
+		sqlite3_bind_int(stmt, 1, parent);
+		ret = sqlite3_step(stmt);
+		found = SQLITE_ROW == ret ? TRUE : FALSE;
+		trackable = TRUE == found && 1 == sqlite3_column_int(stmt, 0) ? TRUE : FALSE;
+		sqlite3_finalize(stmt);
+		if (SQLITE_ROW != ret && SQLITE_DONE != ret) {
+			ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+			seen->failed = TRUE;
+			return(FALSE);
+		}
+
+		return(TRUE == found ? task_walk_leafs(db, parent, trackable, 0, seen, fn, data) : TRUE);
 	}
-	assert(stmt);
 
-	ret = sqlite3_bind_int(stmt, 1, id);
+	ret = sqlite3_prepare_v2(db, task_leafs_query, sizeof(task_leafs_query), &stmt, NULL);
 	if (SQLITE_OK != ret) {
-		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
-		quit(-1);
+		ERROR((stderr, "SQL error: '%s' %s\n", task_leafs_query, sqlite3_errmsg(db)));
+		seen->failed = TRUE;
+		return(FALSE);
 	}
+	assert(stmt);
+
+	sqlite3_bind_int(stmt, 1, parent);
 
-	trackable = FALSE;
 	do {
 		ret = sqlite3_step(stmt);
 		switch (ret) {
-		case SQLITE_ROW:
-			trackable = sqlite3_column_int(stmt, 0) == 1;
-			/* fall-through */
+		case SQLITE_ROW: {
+			int post = sqlite3_column_int(stmt, 1);
+
+			/* Expired tasks hide their whole subtree, as the walk used to */
+			if (post < skip)
+				continue;
+			if (0 == sqlite3_column_int(stmt, 3)) {
+				skip = post;
+				continue;
+			}
+			if (1 != sqlite3_column_int(stmt, 2))
+				continue;
+
+			leafs = realloc(leafs, sizeof(*leafs) * (size_t) (leafs_count + 1));
+			leafs[leafs_count].post = post;
+			leafs[leafs_count].task_id = sqlite3_column_int(stmt, 0);
+			++leafs_count;
+			continue;
+		}
+
 		case SQLITE_DONE:
 			break;
 
 		default:
-			ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
-			quit(-1);
-			break;
+			ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+			sqlite3_finalize(stmt);
+			free(leafs);
+			seen->failed = TRUE;
+			return(FALSE);
 		}
 	} while (SQLITE_DONE != ret);
 
 	sqlite3_finalize(stmt);
 
-	return trackable;
+	/* Children before their parent, handed out as soon as the subtree is read */
+	qsort(leafs, (size_t) leafs_count, sizeof(*leafs), task_leaf_compare);
+	for (i = 0; i < leafs_count && TRUE == more; ++i) {
+		if (TRUE == task_seen_insert(seen, leafs[i].task_id))
+			more = fn(db, leafs[i].task_id, data);
+	}
+
+	free(leafs);
+
+	return(more);
 }
 
 void
-task_find_leafs(STACK stack, int parent)
+task_bookmark_merge(void *payload, void *data)
 {
-	int ret;
-	sqlite3_stmt *stmt;
+	TASK_BOOKMARK *current = payload;
+	int i;
 
-	const char querystr[] =
-	    "SELECT `task_id`, `trackable` FROM `Tasks` "
-	    "WHERE (`parent` = ?) "
-	       "AND (`validfrom`  <= CURRENT_DATE OR `validfrom`  ISNULL) "
-	       "AND (`validuntil` >= CURRENT_DATE OR `validuntil` ISNULL)";
+	UNUSED(data);
 
-	ret = sqlite3_prepare_v2(session.db, querystr, sizeof(querystr), &stmt, NULL);
-	if (SQLITE_OK != ret) {
-		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
-		quit(-1);
+	/* Slots we stored into win, the others keep what was saved meanwhile */
+	for (i = 0; i < MAX_TASK_BOOKMARK_LEN; ++i) {
+		if (0 != memcmp(&bookmark.tasks[i], &bookmark_base.tasks[i], ctask_size))
+			memcpy(&current->tasks[i], &bookmark.tasks[i], ctask_size);
 	}
-	assert(stmt);
 
-	ret = sqlite3_bind_int(stmt, 1, parent);
-	if (SQLITE_OK != ret) {
-		ERROR((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(session.db)));
-		quit(-1);
+	memcpy(&bookmark, current, ctask_bookmark_size);
+	memcpy(&bookmark_base, current, ctask_bookmark_size);
+}
+
+int
+task_leaf_compare(const void *a, const void *b)
+{
+	const struct t_TASK_LEAF *x = a;
+	const struct t_TASK_LEAF *y = b;
+
+	return(x->post < y->post ? -1 : x->post > y->post);
+}
+
+void
+task_merge(void *payload, void *data)
+{
+	TASK *current = payload;
+
+	UNUSED(data);
+
+	/* Field by field, so a comment change doesn't undo a concurrent stop */
+	if (task.task_id != task_base.task_id ||
+	    0 != memcmp(task.task_name, task_base.task_name, sizeof(task.task_name))) {
+		current->task_id = task.task_id;
+		memcpy(current->task_name, task.task_name, sizeof(task.task_name));
 	}
+	if (task.start_time != task_base.start_time)
+		current->start_time = task.start_time;
+	if (0 != memcmp(task.comment, task_base.comment, sizeof(task.comment)))
+		memcpy(current->comment, task.comment, sizeof(task.comment));
 
-	do {
-		ret = sqlite3_step(stmt);
-		switch (ret) {
-		case SQLITE_ROW:
-			task_find_leafs(stack, sqlite3_column_int(stmt, 0));
-			continue;
+	memcpy(&task, current, ctask_size);
+	memcpy(&task_base, current, ctask_size);
+}
 
-		case SQLITE_DONE:
-			break;
+void
+task_recent_merge(void *payload, void *data)
+{
+	TASK_RECENT *current = payload;
+	int i;
 
-		default:
-			ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(session.db)));
-			quit(-1);
-			break;
+	UNUSED(data);
+
+	/* Our pushes replayed on top of the list as it is now */
+	if (TRUE == recent_cleared)
+		memset(current, 0, ctask_recent_size);
+	memmove(&current->tasks[recent_pushed], &current->tasks[0],
+	        ctask_size * (size_t) (MAX_TASK_RECENT_LEN - recent_pushed));
+	for (i = 0; i < recent_pushed; ++i)
+		memcpy(&current->tasks[i], &recent.tasks[i], ctask_size);
+
+	memcpy(&recent, current, ctask_recent_size);
+	recent_pushed = 0;
+	recent_cleared = FALSE;
+}
+
+BOOL
+task_seen_insert(struct t_TASK_SEEN *seen, int task_id)
+{
+	size_t i;
+
+	/* Open addressing on the id, kept at most half full */
+	if (seen->count * 2 >= seen->capacity) {
+		struct t_TASK_SEEN grown;
+
+		memset(&grown, 0, sizeof(grown));
+		grown.failed = seen->failed;
+		grown.capacity = seen->capacity ? seen->capacity * 2 : 256;
+		grown.count = 0;
+		grown.slots = malloc(sizeof(int) * grown.capacity);
+		memset(grown.slots, 0xff, sizeof(int) * grown.capacity);
+		for (i = 0; i < seen->capacity; ++i) {
+			if (-1 != seen->slots[i])
+				task_seen_insert(&grown, seen->slots[i]);
 		}
-	} while (SQLITE_DONE != ret);
+		free(seen->slots);
+		*seen = grown;
+	}
 
-	sqlite3_finalize(stmt);
+	for (i = ((size_t) task_id * 2654435761u) & (seen->capacity - 1);
+	     -1 != seen->slots[i];
+	     i = (i + 1) & (seen->capacity - 1)) {
+		if (task_id == seen->slots[i])
+			return(FALSE);
+	}
+
+	seen->slots[i] = task_id;
+	++seen->count;
+
+	return(TRUE);
+}
+
+STACK
+task_tasks_collect(sqlite3 *db, const char *keyword)
+{
+	STACK leafs;
+
+	leafs = stack_create();
+	if (FALSE == task_tasks_each(db, keyword, task_tasks_push, leafs))
+		quit(-1);
+
+	return(leafs);
+}
+
+BOOL
+task_tasks_each(sqlite3 *db, const char *keyword, TASK_LEAF_FN fn, void *data)
+{
+	struct t_TASK_SEEN seen;
+	struct t_TASK_FILTER filter;
+	QUERY_RESULT result;
+	BOOL ranged;
+	int i;
+
+	if (FALSE == query_tasks(db, keyword, &result))
+		return(FALSE);
+	memset(&seen, 0, sizeof(seen));
+
+	filter.result = &result;
+	filter.fn = fn;
+	filter.data = data;
 
-	if (task_trackable(parent) && !stack_contains(stack, parent)) {
-		stack_push(stack, parent);
+	/* Matches are expanded one at a time, a consumer may stop us midway */
+	ranged = tree_attach(db);
+	for (i = 0; i < result.tops_count; ++i) {
+		if (FALSE == task_find_leafs(db, result.tops[i], ranged, &seen, task_tasks_filter, &filter))
+			break;
 	}
+
+	free(seen.slots);
+	query_free(&result);
+
+	return(TRUE == seen.failed ? FALSE : TRUE);
 }
 
-int
-task_recurse_name_callback(void *task_name, int columns, char **data, char **headers)
+BOOL
+task_tasks_filter(sqlite3 *db, int task_id, void *data)
 {
-	char task_str[MAX_TASK_NAME_LEN];
-	int parent_id;
-	int task_id;
-	BOOL trackable;
+	struct t_TASK_FILTER *filter = data;
 
-	UNUSED(columns);
-	UNUSED(headers);
+	/* Leaves below a match may still be excluded by the query */
+	if (FALSE == query_member(filter->result, task_id))
+		return(TRUE);
 
-	parent_id = atoi(data[0]);
-	task_id = atoi(data[1]);
-	trackable = (atoi(data[2]) == 1);
+	return(filter->fn(db, task_id, filter->data));
+}
 
-	if (*(char *)task_name != '\0') {
-	    strncat((char *)task_name, "\n   ", MAX_TASK_NAME_LEN);
+BOOL
+task_tasks_print(sqlite3 *db, int task_id, void *data)
+{
+	struct t_TASK_PRINT *print = data;
+	char task_name[MAX_TASK_NAME_LEN + 1];
+
+	memset(task_name, 0, sizeof(task_name));
+	if (FALSE == task_recurse_name(db, task_id, task_name)) {
+		print->failed = TRUE;
+		return(FALSE);
 	}
 
-	if (trackable)
-		snprintf(task_str, MAX_TASK_NAME_LEN, "[%04d] %s", task_id, data[3]);
+	if (print->tag)
+		fprintf(print->out, "%s: %s\n", print->tag, task_name);
 	else
-		snprintf(task_str, MAX_TASK_NAME_LEN, "{%04d} %s", task_id, data[3]);
-	strncat((char *)task_name, task_str, MAX_TASK_NAME_LEN);
+		fprintf(print->out, "%s\n", task_name);
 
-	if (parent_id != 0)
-		task_recurse_name(parent_id, task_name);
+	/* Kept for the query cache, each result NUL terminated */
+	if (TRUE == print->capture) {
+		size_t len = strlen(task_name);
+
+		if (print->captured_size + len + 2 > print->captured_capacity) {
+			print->captured_capacity = 2 * print->captured_capacity + len + 2;
+			print->captured = realloc(print->captured, print->captured_capacity);
+		}
+		memcpy(print->captured + print->captured_size, task_name, len);
+		print->captured[print->captured_size + len] = '\n';
+		print->captured[print->captured_size + len + 1] = '\0';
+		print->captured_size += len + 2;
+	}
+	++print->printed;
+
+	/* Flushed per result for pipes, a closed one (EPIPE) ends the search */
+	if (0 != fflush(print->out) || (0 != print->limit && print->printed >= print->limit)) {
+		print->stopped = TRUE;
+		return(FALSE);
+	}
 
-	return (1);
+	return(TRUE);
 }
 
-int
-task_tasks_callback(void *stack, int columns, char **data, char **headers)
+BOOL
+task_tasks_push(sqlite3 *db, int task_id, void *data)
 {
-	UNUSED(columns);
-	UNUSED(headers);
+	UNUSED(db);
 
-	task_find_leafs(stack, atoi(data[0]));
+	stack_push(data, task_id);
 
-	return (0);
+	return(TRUE);
 }
 
+BOOL
+task_walk_leafs(sqlite3 *db, int parent, BOOL trackable, int depth,
+                struct t_TASK_SEEN *seen, TASK_LEAF_FN fn, void *data)
+{
+	struct t_TASK_CHILD *children = 0;
+	BOOL more = TRUE;
+	int children_count = 0;
+	int ret;
+	int i;
+	sqlite3_stmt *stmt;
+
+	/* Nothing bounds a cycle in Tasks here, the numbering would have */
+	if (TASK_WALK_DEPTH_MAX < depth)
+		return(TRUE);
+
+	ret = sqlite3_prepare_v2(db, task_children_query, sizeof(task_children_query), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		ERROR((stderr, "SQL error: '%s' %s\n", task_children_query, sqlite3_errmsg(db)));
+		seen->failed = TRUE;
+		return(FALSE);
+	}
+	assert(stmt);
+
+	sqlite3_bind_int(stmt, 1, parent);
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		children = realloc(children, sizeof(*children) * (size_t) (children_count + 1));
+		children[children_count].task_id = sqlite3_column_int(stmt, 0);
+		children[children_count].trackable = 1 == sqlite3_column_int(stmt, 1) ? TRUE : FALSE;
+		++children_count;
+	}
+	sqlite3_finalize(stmt);
+	if (SQLITE_DONE != ret) {
+		ERROR((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+		free(children);
+		seen->failed = TRUE;
+		return(FALSE);
+	}
+
+	/* Children before their parent, the same post order as the ranged search */
+	for (i = 0; i < children_count && TRUE == more; ++i)
+		more = task_walk_leafs(db, children[i].task_id, children[i].trackable, depth + 1, seen, fn, data);
+	free(children);
+
+	if (TRUE == more && TRUE == trackable && TRUE == task_seen_insert(seen, parent))
+		more = fn(db, parent, data);
+
+	return(more);
+}
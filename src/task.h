@@ -27,9 +27,11 @@
 #ifndef TASK_H
 #define TASK_H 1
 
+#include <sqlite3.h>
 #include <time.h>
 
 #include "common.h"
+#include "state.h"
 
 /****************************************************************** compiler constants */
 
@@ -67,29 +69,41 @@ extern TASK task;
 extern TASK_BOOKMARK bookmark;
 extern TASK_RECENT recent;
 
+/****************************************************************** exported constants */
+
+/* Shared with optimize, which plans the statements as they are issued */
+extern const char task_children_query[];
+extern const char task_leafs_query[];
+extern const char task_name_query[];
+extern const char task_root_query[];
+
 /************************************************************************ declarations */
 
 BOOL task_active(void);
 void task_bookmark_clear(void);
-void task_bookmark_load(int fd);
+void task_bookmark_load(STATE);
 void task_bookmark_print(void);
-void task_bookmark_save(int fd);
+void task_bookmark_save(STATE);
 void task_bookmark_select(int index);
 void task_bookmark_store(int index);
 void task_clear(BOOL);
 void task_comment(const char *);
-void task_load(int fd);
+void task_load(STATE);
 void task_print(void);
+void task_print_line(FILE *);
 void task_recent_clear(void);
-void task_recent_load(int fd);
+void task_recent_load(STATE);
 void task_recent_print(void);
-void task_recent_save(int fd);
+void task_recent_save(STATE);
 void task_recent_select(int index);
 void task_recent_store(void);
+BOOL task_recurse_name(sqlite3 *, int, char *);
 void task_reset(void);
-void task_save(int fd);
+void task_save(STATE);
 void task_select(int id);
 void task_store(void);
-void task_tasks(const char *);
+void task_tasks(const char *, int limit);
+BOOL task_tasks_query(sqlite3 *, const char *, FILE *, const char *, int limit);
+void task_tasks_top(const char *, int);
 
 #endif
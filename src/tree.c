@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "tree.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+
+/*************************************************************************** constants */
+
+#define TREE_FNV_BASIS 14695981039346656037ULL
+
+const char tree_load_query[] =
+	"SELECT `task_id`, `parent`, `trackable`, `name`, `validfrom`, `validuntil` "
+	"FROM `Tasks` ORDER BY `task_id`";
+
+/************************************************************************ declarations */
+
+/*
+ * Every task gets an Euler tour interval: pre on the way down, post on the
+ * way back up, from a single clock. A subtree is then the contiguous range
+ * pre BETWEEN root.pre AND root.post, and post order is plain post order.
+ *
+ * Every task also gets a Merkle hash of its own fields and its children's
+ * hashes. When Tasks changes, only subtrees whose hash differs from the
+ * stored one are written again; an unchanged subtree keeps its rows, or
+ * moves them all with one ranged update when something before it grew.
+ */
+struct t_TREE_NODE {
+	int      task_id;
+	int      parent;
+	int      pre;
+	int      post;
+	int      depth;
+	uint64_t self;
+	uint64_t hash;
+};
+
+enum {TREE_STEP_WRITE, TREE_STEP_SHIFT, TREE_STEP_KEEP};
+
+struct t_TREE_STEP {
+	int node;
+	int kind;
+	int pre;
+	int post;
+	int depth;
+};
+
+struct t_TREE_COUNT {
+	int written;
+	int shifted;
+	int reused;
+	int dropped;
+};
+
+struct t_TREE {
+	struct t_TREE_NODE *nodes;
+	int                *children;
+	int                 count;
+};
+
+static int      tree_by_parent(const void *, const void *);
+static void     tree_exec(sqlite3 *, const char *, BOOL *);
+static int      tree_find(const struct t_TREE *, int);
+static uint64_t tree_fnv(uint64_t, const void *, size_t);
+static BOOL     tree_load(sqlite3 *, struct t_TREE *, uint64_t *);
+static void     tree_mark(sqlite3 *, uint64_t, const DB_SIGNATURE *, BOOL *);
+static void     tree_number(struct t_TREE *);
+static void     tree_prepare(sqlite3 *, const char *, sqlite3_stmt **, BOOL *);
+static void     tree_step(sqlite3 *, sqlite3_stmt *, BOOL *);
+static BOOL     tree_store(sqlite3 *, const struct t_TREE *, uint64_t, const DB_SIGNATURE *,
+                           struct t_TREE_COUNT *);
+
+/************************************************************************* definitions */
+
+BOOL
+tree_attach(sqlite3 *db)
+{
+	struct t_TREE tree;
+	struct t_TREE_COUNT count;
+	DB_SIGNATURE signature;
+	sqlite3_stmt *stmt;
+	sqlite3 *side = 0;
+	const char *db_path;
+	char path[FILENAME_MAX];
+	char *querystr;
+	uint64_t hash, stored = 0;
+	BOOL known = FALSE;
+	BOOL fresh = FALSE;
+	BOOL ok = TRUE;
+
+	/* Once per connection, the file itself is shared with other processes */
+	if (0 != sqlite3_db_filename(db, "ccharm_tree"))
+		return(TRUE);
+
+	db_path = sqlite3_db_filename(db, "main");
+	if (0 == db_path || '\0' == *db_path)
+		return(FALSE);
+
+	/* Kept with ccharm's own files, the database itself may be read-only */
+	snprintf(path, sizeof(path), TREE_PATH_FORMAT,
+	         (unsigned long long) tree_fnv(TREE_FNV_BASIS, db_path, strlen(db_path)));
+
+	/* Taken before Tasks is read, a write racing us shows up next time */
+	signature_database(db_path, &signature);
+
+	if (SQLITE_OK != sqlite3_open_v2(path, &side, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0)) {
+		WARNING((stderr, "Can't open task tree: %s\n%s\n", path, sqlite3_errmsg(side)));
+		sqlite3_close(side);
+		return(FALSE);
+	}
+	tune_database(side, DB_PROFILE_WRITE);
+
+	/* Anything from an older layout is started over */
+	if (SQLITE_OK == sqlite3_prepare_v2(side, "SELECT `hash`, `signature` FROM `meta`", -1, &stmt, NULL)) {
+		if (SQLITE_ROW == sqlite3_step(stmt)) {
+			const void *blob = sqlite3_column_blob(stmt, 1);
+
+			known = TRUE;
+			stored = (uint64_t) sqlite3_column_int64(stmt, 0);
+			fresh = blob && sizeof(signature) == (size_t) sqlite3_column_bytes(stmt, 1) &&
+			        0 == memcmp(blob, &signature, sizeof(signature)) ? TRUE : FALSE;
+		}
+		sqlite3_finalize(stmt);
+	} else {
+		tree_exec(side, "DROP TABLE IF EXISTS `tree`; DROP TABLE IF EXISTS `meta`", &ok);
+	}
+
+	/* An untouched database needs no look at Tasks at all */
+	if (FALSE == fresh) {
+		memset(&tree, 0, sizeof(tree));
+		if (0 != sqlite3_db_readonly(side, "main")) {
+			WARNING((stderr, "Can't update task tree: %s\n", path));
+			ok = FALSE;
+		}
+
+		tree_exec(side, "CREATE TABLE IF NOT EXISTS `tree` ("
+		                    "`task_id` INTEGER PRIMARY KEY, `pre` INTEGER, `post` INTEGER, "
+		                    "`depth` INTEGER, `hash` INTEGER); "
+		                "CREATE UNIQUE INDEX IF NOT EXISTS `tree_pre` "
+		                    "ON `tree` (`pre`, `post`, `task_id`); "
+		                "CREATE TABLE IF NOT EXISTS `meta` (`hash` INTEGER, `signature` BLOB)", &ok);
+
+		/* Tasks is small, hashing it whole beats trusting timestamps */
+		if (TRUE == ok)
+			ok = tree_load(db, &tree, &hash);
+
+		if (TRUE == ok && TRUE == known && hash == stored) {
+			tree_mark(side, hash, &signature, &ok);
+		} else if (TRUE == ok) {
+			memset(&count, 0, sizeof(count));
+			tree_number(&tree);
+			ok = tree_store(side, &tree, hash, &signature, &count);
+			INFO((stderr, "Task Tree Numbered: %s (%d tasks, %d written, %d shifted, %d reused, %d dropped)\n",
+			      path, tree.count, count.written, count.shifted, count.reused, count.dropped));
+		}
+
+		free(tree.nodes);
+		free(tree.children);
+	}
+	sqlite3_close(side);
+
+	if (FALSE == ok)
+		return(FALSE);
+
+	querystr = sqlite3_mprintf("ATTACH DATABASE %Q AS `ccharm_tree`", path);
+	tree_exec(db, querystr, &ok);
+	sqlite3_free(querystr);
+
+	return(ok);
+}
+
+/******************************************************************* local definitions */
+
+int
+tree_by_parent(const void *a, const void *b)
+{
+	const struct t_TREE_NODE *x = a;
+	const struct t_TREE_NODE *y = b;
+
+	if (x->parent != y->parent)
+		return(x->parent < y->parent ? -1 : 1);
+	return(x->task_id < y->task_id ? -1 : x->task_id > y->task_id);
+}
+
+void
+tree_exec(sqlite3 *db, const char *querystr, BOOL *ok)
+{
+	char *errstr;
+
+	if (FALSE == *ok)
+		return;
+
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		WARNING((stderr, "SQL error: '%s' %s\n", querystr, errstr));
+		sqlite3_free(errstr);
+		*ok = FALSE;
+	}
+}
+
+int
+tree_find(const struct t_TREE *tree, int task_id)
+{
+	int lo = 0, hi = tree->count - 1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (tree->nodes[mid].task_id == task_id)
+			return(mid);
+		else if (tree->nodes[mid].task_id < task_id)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return(-1);
+}
+
+uint64_t
+tree_fnv(uint64_t hash, const void *data, size_t size)
+{
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < size; ++i) {
+		hash ^= ((const unsigned char *) data)[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return(hash);
+}
+
+BOOL
+tree_load(sqlite3 *db, struct t_TREE *tree, uint64_t *table)
+{
+	sqlite3_stmt *stmt;
+	uint64_t hash = TREE_FNV_BASIS;
+	int capacity = 256;
+	int ret;
+
+	ret = sqlite3_prepare_v2(db, tree_load_query, sizeof(tree_load_query), &stmt, NULL);
+	if (SQLITE_OK != ret) {
+		WARNING((stderr, "SQL error: '%s' %s\n", tree_load_query, sqlite3_errmsg(db)));
+		return(FALSE);
+	}
+	assert(stmt);
+
+	tree->nodes = malloc(sizeof(struct t_TREE_NODE) * (size_t) capacity);
+	tree->count = 0;
+
+	while (SQLITE_ROW == (ret = sqlite3_step(stmt))) {
+		struct t_TREE_NODE *node;
+		int values[3];
+		int column;
+
+		if (tree->count == capacity) {
+			capacity *= 2;
+			tree->nodes = realloc(tree->nodes, sizeof(struct t_TREE_NODE) * (size_t) capacity);
+		}
+		node = tree->nodes + tree->count++;
+		memset(node, 0, sizeof(*node));
+		node->task_id = values[0] = sqlite3_column_int(stmt, 0);
+		node->parent  = values[1] = sqlite3_column_int(stmt, 1);
+		values[2] = sqlite3_column_int(stmt, 2);
+
+		/* Own fields first, NULL and empty texts told apart by their length */
+		node->self = tree_fnv(TREE_FNV_BASIS, values, sizeof(values));
+		for (column = 3; column < 6; ++column) {
+			const unsigned char *text = sqlite3_column_text(stmt, column);
+			int len = text ? sqlite3_column_bytes(stmt, column) : -1;
+
+			node->self = tree_fnv(node->self, &len, sizeof(len));
+			if (text)
+				node->self = tree_fnv(node->self, text, (size_t) len);
+		}
+
+		/* The whole table, in task_id order, tells whether anything changed */
+		hash = tree_fnv(hash, &node->self, sizeof(node->self));
+	}
+	sqlite3_finalize(stmt);
+	if (SQLITE_DONE != ret) {
+		WARNING((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+		return(FALSE);
+	}
+
+	*table = hash;
+
+	return(TRUE);
+}
+
+void
+tree_mark(sqlite3 *db, uint64_t hash, const DB_SIGNATURE *signature, BOOL *ok)
+{
+	sqlite3_stmt *stmt;
+
+	/* The table hash decides what to renumber, the signature whether to look */
+	tree_exec(db, "DELETE FROM `meta`", ok);
+	tree_prepare(db, "INSERT INTO `meta` VALUES (?, ?)", &stmt, ok);
+	sqlite3_bind_int64(stmt, 1, (sqlite3_int64) hash);
+	sqlite3_bind_blob(stmt, 2, signature, sizeof(*signature), SQLITE_STATIC);
+	tree_step(db, stmt, ok);
+	sqlite3_finalize(stmt);
+}
+
+void
+tree_number(struct t_TREE *tree)
+{
+	struct t_TREE_NODE *byparent;
+	int *begin, *end;
+	int *stack, *next;
+	int clock = 0;
+	int pass, i, j;
+
+	/*
+	 * Children of nodes[i] are children[begin[i] .. end[i]), found with one
+	 * merge of the nodes (task_id order) against a copy in parent order.
+	 */
+	byparent = malloc(sizeof(struct t_TREE_NODE) * (size_t) (tree->count + 1));
+	memcpy(byparent, tree->nodes, sizeof(struct t_TREE_NODE) * (size_t) tree->count);
+	qsort(byparent, (size_t) tree->count, sizeof(struct t_TREE_NODE), tree_by_parent);
+
+	tree->children = malloc(sizeof(int) * (size_t) (tree->count + 1));
+	for (j = 0; j < tree->count; ++j)
+		tree->children[j] = tree_find(tree, byparent[j].task_id);
+
+	begin = malloc(sizeof(int) * (size_t) (tree->count + 1));
+	end   = malloc(sizeof(int) * (size_t) (tree->count + 1));
+	for (i = 0, j = 0; i < tree->count; ++i) {
+		while (j < tree->count && byparent[j].parent < tree->nodes[i].task_id)
+			++j;
+		begin[i] = j;
+		while (j < tree->count && byparent[j].parent == tree->nodes[i].task_id)
+			++j;
+		end[i] = j;
+	}
+
+	stack = malloc(sizeof(int) * (size_t) (tree->count + 1));
+	next  = malloc(sizeof(int) * (size_t) (tree->count + 1));
+
+	/*
+	 * Real roots on the first pass; whatever is still unvisited on the
+	 * second hangs off a missing parent or sits on a cycle, and is
+	 * numbered as a root of its own.
+	 */
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < tree->count; ++i) {
+			int top = 0;
+
+			if (0 != tree->nodes[i].pre)
+				continue;
+			if (0 == pass && 0 != tree->nodes[i].parent &&
+			    -1 != tree_find(tree, tree->nodes[i].parent))
+				continue;
+
+			/* Iterative DFS, Charm trees are shallow but nothing enforces it */
+			stack[0] = i;
+			next[0] = begin[i];
+			tree->nodes[i].pre = ++clock;
+			tree->nodes[i].depth = 0;
+
+			while (0 <= top) {
+				struct t_TREE_NODE *node = tree->nodes + stack[top];
+				int child;
+
+				while (next[top] < end[stack[top]] &&
+				       0 != tree->nodes[tree->children[next[top]]].pre)
+					++next[top];
+
+				/* Leaving a node, its children hashed already */
+				if (next[top] >= end[stack[top]]) {
+					node->post = ++clock;
+					node->hash = node->self;
+					for (j = begin[stack[top]]; j < end[stack[top]]; ++j) {
+						const struct t_TREE_NODE *kid = tree->nodes + tree->children[j];
+
+						if (kid->pre > node->pre && kid->post < node->post)
+							node->hash = tree_fnv(node->hash, &kid->hash, sizeof(kid->hash));
+					}
+					--top;
+					continue;
+				}
+
+				child = tree->children[next[top]++];
+				tree->nodes[child].pre = ++clock;
+				tree->nodes[child].depth = node->depth + 1;
+				stack[++top] = child;
+				next[top] = begin[child];
+			}
+		}
+	}
+
+	free(next);
+	free(stack);
+	free(end);
+	free(begin);
+	free(byparent);
+}
+
+void
+tree_prepare(sqlite3 *db, const char *querystr, sqlite3_stmt **stmt, BOOL *ok)
+{
+	/* A statement that never got prepared is NULL, sqlite takes that as a no-op */
+	*stmt = 0;
+	if (FALSE == *ok)
+		return;
+
+	if (SQLITE_OK != sqlite3_prepare_v2(db, querystr, -1, stmt, NULL)) {
+		WARNING((stderr, "SQL error: '%s' %s\n", querystr, sqlite3_errmsg(db)));
+		*ok = FALSE;
+	}
+}
+
+void
+tree_step(sqlite3 *db, sqlite3_stmt *stmt, BOOL *ok)
+{
+	if (FALSE == *ok)
+		return;
+
+	if (SQLITE_DONE != sqlite3_step(stmt)) {
+		WARNING((stderr, "SQL error: %s\n", sqlite3_errmsg(db)));
+		*ok = FALSE;
+	}
+	sqlite3_reset(stmt);
+}
+
+BOOL
+tree_store(sqlite3 *db, const struct t_TREE *tree, uint64_t hash, const DB_SIGNATURE *signature,
+           struct t_TREE_COUNT *count)
+{
+	struct t_TREE_STEP *steps;
+	sqlite3_stmt *find, *write, *shift, *stale;
+	int *order;
+	int steps_count = 0;
+	int touched = 0;
+	BOOL ok = TRUE;
+	int k;
+
+	tree_exec(db, "BEGIN IMMEDIATE", &ok);
+	if (FALSE == ok)
+		return(FALSE);
+
+	/* Pre order, the clock runs over 1 .. 2 * count */
+	order = malloc(sizeof(int) * (size_t) (2 * tree->count + 2));
+	steps = malloc(sizeof(struct t_TREE_STEP) * (size_t) (tree->count + 1));
+	for (k = 0; k <= 2 * tree->count + 1; ++k)
+		order[k] = -1;
+	for (k = 0; k < tree->count; ++k)
+		order[tree->nodes[k].pre] = k;
+
+	/* Plan first, reading only: a subtree that hashes the same is settled */
+	tree_prepare(db, "SELECT `pre`, `post`, `depth`, `hash` FROM `tree` WHERE `task_id` = ?", &find, &ok);
+	for (k = 1; k <= 2 * tree->count; ++k) {
+		const struct t_TREE_NODE *node;
+		struct t_TREE_STEP *step;
+
+		if (-1 == order[k])
+			continue;
+		node = tree->nodes + order[k];
+		step = steps + steps_count++;
+		step->node = order[k];
+		step->kind = TREE_STEP_WRITE;
+
+		sqlite3_bind_int(find, 1, node->task_id);
+		if (SQLITE_ROW == sqlite3_step(find) &&
+		    (sqlite3_int64) node->hash == sqlite3_column_int64(find, 3)) {
+			step->pre = sqlite3_column_int(find, 0);
+			step->post = sqlite3_column_int(find, 1);
+			step->depth = sqlite3_column_int(find, 2);
+			step->kind = step->pre != node->pre || step->depth != node->depth
+			           ? TREE_STEP_SHIFT : TREE_STEP_KEEP;
+			k = node->post;
+		}
+		sqlite3_reset(find);
+
+		if (TREE_STEP_WRITE == step->kind)
+			++touched;
+		else if (TREE_STEP_SHIFT == step->kind)
+			touched += (step->post - step->pre + 1) / 2;
+	}
+	sqlite3_finalize(find);
+
+	if (touched > tree->count / 4) {
+		/* Most rows would move anyway, writing them out afresh is cheaper */
+		tree_exec(db, "DELETE FROM `tree`", &ok);
+		tree_prepare(db, "INSERT INTO `tree` VALUES (?1, ?2, ?3, ?4, ?5)", &write, &ok);
+		for (k = 0; k < tree->count; ++k) {
+			const struct t_TREE_NODE *node = tree->nodes + k;
+
+			sqlite3_bind_int(write, 1, node->task_id);
+			sqlite3_bind_int(write, 2, node->pre);
+			sqlite3_bind_int(write, 3, node->post);
+			sqlite3_bind_int(write, 4, node->depth);
+			sqlite3_bind_int64(write, 5, (sqlite3_int64) node->hash);
+			tree_step(db, write, &ok);
+		}
+		sqlite3_finalize(write);
+		count->written = tree->count;
+	} else {
+		tree_prepare(db, "INSERT OR REPLACE INTO `tree` VALUES (?1, -?2, -?3, ?4, ?5)", &write, &ok);
+		tree_prepare(db, "UPDATE `tree` SET `pre` = -(`pre` + ?1), `post` = -(`post` + ?1), "
+		                                   "`depth` = `depth` + ?2 "
+		                 "WHERE `pre` BETWEEN ?3 AND ?4", &shift, &ok);
+
+		/*
+		 * Rows written or moved are kept negative until the plan is
+		 * carried out, old and new ranges overlap and a later ranged
+		 * update must only ever catch rows nobody touched yet.
+		 */
+		for (k = 0; k < steps_count; ++k) {
+			const struct t_TREE_STEP *step = steps + k;
+			const struct t_TREE_NODE *node = tree->nodes + step->node;
+
+			if (TREE_STEP_KEEP == step->kind) {
+				++count->reused;
+			} else if (TREE_STEP_SHIFT == step->kind) {
+				sqlite3_bind_int(shift, 1, node->pre - step->pre);
+				sqlite3_bind_int(shift, 2, node->depth - step->depth);
+				sqlite3_bind_int(shift, 3, step->pre);
+				sqlite3_bind_int(shift, 4, step->post);
+				tree_step(db, shift, &ok);
+				++count->shifted;
+			} else {
+				sqlite3_bind_int(write, 1, node->task_id);
+				sqlite3_bind_int(write, 2, node->pre);
+				sqlite3_bind_int(write, 3, node->post);
+				sqlite3_bind_int(write, 4, node->depth);
+				sqlite3_bind_int64(write, 5, (sqlite3_int64) node->hash);
+				tree_step(db, write, &ok);
+				++count->written;
+			}
+		}
+		sqlite3_finalize(write);
+		sqlite3_finalize(shift);
+
+		tree_exec(db, "UPDATE `tree` SET `pre` = -`pre`, `post` = -`post` WHERE `pre` < 0", &ok);
+
+		/* Rows of tasks that are gone were never visited */
+		tree_prepare(db, "DELETE FROM `tree` WHERE `task_id` = ?", &stale, &ok);
+		tree_prepare(db, "SELECT `task_id` FROM `tree`", &find, &ok);
+		while (SQLITE_ROW == sqlite3_step(find)) {
+			if (-1 != tree_find(tree, sqlite3_column_int(find, 0)))
+				continue;
+			sqlite3_bind_int(stale, 1, sqlite3_column_int(find, 0));
+			tree_step(db, stale, &ok);
+			++count->dropped;
+		}
+		sqlite3_finalize(find);
+		sqlite3_finalize(stale);
+	}
+	free(steps);
+	free(order);
+
+	tree_mark(db, hash, signature, &ok);
+	tree_exec(db, "COMMIT", &ok);
+
+	/* Whatever went wrong, the file is left as it was */
+	if (FALSE == ok)
+		sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+
+	return(ok);
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "watch.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#endif
+
+#include "session.h"
+#include "task.h"
+
+/************************************************************************ declarations */
+
+#ifdef HAVE_INOTIFY
+static void watch_timer(int, BOOL);
+#endif
+
+/************************************************************************* definitions */
+
+#ifdef HAVE_INOTIFY
+
+void
+watch_status(void)
+{
+	union {
+		struct inotify_event event;
+		char                 buffer[4096];
+	} events;
+	struct pollfd fds[2];
+	char *line = 0;
+	char *last = 0;
+	BOOL armed = FALSE;
+	size_t line_len;
+	FILE *out;
+	int inotifyfd, timerfd;
+
+	/*
+	 * Watch the directory rather than the files, so state files that get
+	 * replaced (or created late) are picked up as well.
+	 */
+	inotifyfd = inotify_init1(IN_CLOEXEC);
+	if (-1 == inotifyfd ||
+	    -1 == inotify_add_watch(inotifyfd, ".", IN_ATTRIB | IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO)) {
+		ERROR((stderr, "Unable to watch Charm directory.\n"));
+		quit(-1);
+	}
+
+	timerfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	if (-1 == timerfd) {
+		ERROR((stderr, "Unable to create watch timer.\n"));
+		quit(-1);
+	}
+
+	fds[0].fd = inotifyfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = timerfd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		/* Only tick while there is a running time to update */
+		if (armed != task_active()) {
+			armed = task_active();
+			watch_timer(timerfd, armed);
+		}
+
+		if (0 == (out = open_memstream(&line, &line_len))) {
+			ERROR((stderr, "Unable to render status.\n"));
+			quit(-1);
+		}
+		task_print_line(out);
+		fclose(out);
+
+		if (0 == last || 0 != strcmp(last, line)) {
+			if (EOF == fputs(line, stdout) || EOF == fflush(stdout))
+				break;
+			free(last);
+			last = line;
+		} else free(line);
+		line = 0;
+
+		if (-1 == poll(fds, 2, -1))
+			continue;
+
+		if (fds[1].revents & POLLIN) {
+			unsigned long long expirations;
+			ssize_t ret = read(timerfd, &expirations, sizeof(expirations));
+			UNUSED(ret);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			ssize_t len = read(inotifyfd, &events, sizeof(events));
+			ssize_t off = 0;
+
+			while (off < len) {
+				struct inotify_event *event = (struct inotify_event *) (events.buffer + off);
+
+				if (0 < event->len) {
+					if (0 == strcmp(TASK_PATH, event->name))
+						task_load(session.taskstate);
+					else if (0 == strcmp(BOOKMARK_TASKS_PATH, event->name))
+						task_bookmark_load(session.bookmarkstate);
+					else if (0 == strcmp(RECENT_TASKS_PATH, event->name))
+						task_recent_load(session.recentstate);
+				}
+				off += (ssize_t) sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+
+	free(last);
+	close(timerfd);
+	close(inotifyfd);
+}
+
+#else
+
+void
+watch_status(void)
+{
+	ERROR((stderr, "Watch mode is not supported on this platform.\nAbort.\n"));
+	quit(-1);
+}
+
+#endif
+
+/******************************************************************* local definitions */
+
+#ifdef HAVE_INOTIFY
+
+void
+watch_timer(int timerfd, BOOL armed)
+{
+	struct itimerspec spec;
+
+	memset(&spec, 0, sizeof(spec));
+
+	/* Tick on wall clock second boundaries, when time(0) moves */
+	if (TRUE == armed) {
+		spec.it_value.tv_sec = time(0) + 1;
+		spec.it_interval.tv_sec = 1;
+	}
+
+	timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &spec, 0);
+}
+
+#endif
@@ -0,0 +1,39 @@
+# Runs one ccharm command against a fresh copy of a fixture database with
+# CCHARM_SQL_BUDGET set; over budget, ccharm exits non-zero and attaches the
+# statement log to its error output, which is passed on here.
+#
+#   cmake -DCCHARM=<ccharm> -DFIXTURE=<db> -DHOME=<dir> -DBUDGET=<budget>
+#         [-DSETUP=<arguments>] -DCOMMAND=<arguments> -P budget.cmake
+#
+# SETUP runs first without a budget, to get the database and the home
+# directory into the state the command is measured from.
+
+file(REMOVE_RECURSE ${HOME})
+file(MAKE_DIRECTORY ${HOME}/.Charm)
+configure_file(${FIXTURE} ${HOME}/.Charm/Charm.db COPYONLY)
+
+set(ENV{HOME} ${HOME})
+
+if (SETUP)
+	string(REPLACE " " ";" setup_args "${SETUP}")
+	execute_process(COMMAND ${CCHARM} -C Charm.db ${setup_args}
+	                RESULT_VARIABLE result
+	                OUTPUT_QUIET
+	                ERROR_VARIABLE errors)
+	if (NOT result EQUAL 0)
+		message(FATAL_ERROR "Setup '${SETUP}' failed (${result}):\n${errors}")
+	endif()
+endif()
+
+set(ENV{CCHARM_SQL_BUDGET} ${BUDGET})
+
+string(REPLACE " " ";" command_args "${COMMAND}")
+execute_process(COMMAND ${CCHARM} -C Charm.db ${command_args}
+                RESULT_VARIABLE result
+                OUTPUT_QUIET
+                ERROR_VARIABLE errors)
+if (NOT result EQUAL 0)
+	message(FATAL_ERROR "'${COMMAND}' failed under budget '${BUDGET}' (${result}):\n${errors}")
+endif()
+
+message(STATUS "${errors}")
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Writes a Charm database for the SQL budget tests: BRANCHES chains of
+ * DEPTH nested tasks each, the innermost one named leafN, and EVENTS half
+ * hour events spread over the leaves.
+ */
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/************************************************************************ declarations */
+
+static void fixture_exec(sqlite3 *, const char *);
+static void fixture_step(sqlite3 *, sqlite3_stmt *);
+
+/************************************************************************* definitions */
+
+int
+main(int argc, char **argv)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	int depth, branches, events;
+	int branch, level, i;
+	char name[32];
+
+	const char taskstr[] =
+	    "INSERT INTO `Tasks` (`task_id`, `parent`, `trackable`, `name`) VALUES (?, ?, 1, ?)";
+	const char eventstr[] =
+	    "INSERT INTO `Events` (`user_id`, `event_id`, `installation_id`, `report_id`, "
+	                          "`task`, `comment`, `start`, `end`) "
+	    "VALUES (1, ?1, 1, 0, ?2, '', "
+	            "strftime('%Y-%m-%dT%H:%M:%S', 1577869200 + ?1 * 3600, 'unixepoch'), "
+	            "strftime('%Y-%m-%dT%H:%M:%S', 1577871000 + ?1 * 3600, 'unixepoch'))";
+
+	if (5 != argc) {
+		fprintf(stderr, "Usage: %s PATH DEPTH BRANCHES EVENTS\n", argv[0]);
+		return(1);
+	}
+	depth = atoi(argv[2]);
+	branches = atoi(argv[3]);
+	events = atoi(argv[4]);
+
+	remove(argv[1]);
+	if (SQLITE_OK != sqlite3_open(argv[1], &db)) {
+		fprintf(stderr, "Can't create database: %s\n", argv[1]);
+		return(1);
+	}
+
+	/* As ccharm leaves it after its first write, so that isn't measured */
+	fixture_exec(db, "PRAGMA journal_mode = WAL");
+	fixture_exec(db, "BEGIN");
+	fixture_exec(db, "CREATE TABLE Tasks (id INTEGER PRIMARY KEY, task_id INTEGER UNIQUE, "
+	                 "parent INTEGER, validfrom TIMESTAMP, validuntil TIMESTAMP, "
+	                 "trackable INTEGER, comment varchar(256), name varchar(256))");
+	fixture_exec(db, "CREATE TABLE Events (id INTEGER PRIMARY KEY, user_id INTEGER, "
+	                 "event_id INTEGER, installation_id INTEGER, report_id INTEGER, "
+	                 "task INTEGER, comment varchar(256), start date, end date)");
+	fixture_exec(db, "CREATE TABLE Installations (id INTEGER PRIMARY KEY, "
+	                 "installation_id INTEGER, user_id INTEGER, name varchar(256))");
+	fixture_exec(db, "INSERT INTO Installations (installation_id, user_id, name) "
+	                 "VALUES (1, 1, 'fixture')");
+
+	/* Task N of a chain is the parent of task N + 1 */
+	if (SQLITE_OK != sqlite3_prepare_v2(db, taskstr, sizeof(taskstr), &stmt, NULL)) {
+		fprintf(stderr, "SQL error: '%s' %s\n", taskstr, sqlite3_errmsg(db));
+		return(1);
+	}
+	for (branch = 0; branch < branches; ++branch) {
+		for (level = 0; level < depth; ++level) {
+			int task_id = branch * depth + level + 1;
+
+			if (depth - 1 == level)
+				snprintf(name, sizeof(name), "leaf%d", branch);
+			else
+				snprintf(name, sizeof(name), "node%d", task_id);
+
+			sqlite3_bind_int(stmt, 1, task_id);
+			sqlite3_bind_int(stmt, 2, 0 == level ? 0 : task_id - 1);
+			sqlite3_bind_text(stmt, 3, name, -1, SQLITE_TRANSIENT);
+			fixture_step(db, stmt);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	/* Back to back hours from 2020 on, round robin over the leaves */
+	if (SQLITE_OK != sqlite3_prepare_v2(db, eventstr, sizeof(eventstr), &stmt, NULL)) {
+		fprintf(stderr, "SQL error: '%s' %s\n", eventstr, sqlite3_errmsg(db));
+		return(1);
+	}
+	for (i = 0; i < events; ++i) {
+		sqlite3_bind_int(stmt, 1, i);
+		sqlite3_bind_int(stmt, 2, (i % branches + 1) * depth);
+		fixture_step(db, stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	fixture_exec(db, "COMMIT");
+	sqlite3_close(db);
+
+	return(0);
+}
+
+/******************************************************************* local definitions */
+
+void
+fixture_exec(sqlite3 *db, const char *querystr)
+{
+	char *errstr;
+
+	if (SQLITE_OK != sqlite3_exec(db, querystr, 0, 0, &errstr)) {
+		fprintf(stderr, "SQL error: '%s' %s\n", querystr, errstr);
+		sqlite3_free(errstr);
+		exit(1);
+	}
+}
+
+void
+fixture_step(sqlite3 *db, sqlite3_stmt *stmt)
+{
+	if (SQLITE_DONE != sqlite3_step(stmt)) {
+		fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+		exit(1);
+	}
+	sqlite3_reset(stmt);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2015, Guillermo Amaral <gamaral@kdab.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Checks the timestamp fast path against the general parser it stands in
+ * for: every well-formed stamp must take the fast path, and whatever it
+ * accepts the general parser must read the same way. Each base stamp is
+ * tried with every byte value in every position.
+ */
+
+#include "../src/stamp.c"
+
+#include <stdio.h>
+
+/*************************************************************************** constants */
+
+#define STAMP_TEST_BASES 512
+
+/************************************************************************ declarations */
+
+static int stamp_test_check(const char *, BOOL);
+
+/************************************************************************* definitions */
+
+int
+main(void)
+{
+	char base[STAMP_SIZE + 8], text[STAMP_SIZE];
+	unsigned seed = 1;
+	int failures = 0;
+	int i, j, byte;
+
+	for (i = 0; i < STAMP_TEST_BASES; ++i) {
+		unsigned values[6];
+
+		for (j = 0; j < 6; ++j) {
+			seed = seed * 1103515245u + 12345u;
+			values[j] = seed >> 8;
+		}
+
+		/* Field limits as both parsers take them, not as calendars do */
+		snprintf(base, sizeof(base), "%04u-%02u-%02u%c%02u:%02u:%02u",
+		         values[0] % 10000, 1 + values[1] % 12, 1 + values[2] % 31,
+		         1 & values[0] ? 'T' : ' ', values[3] % 25, values[4] % 60, values[5] % 60);
+		failures += stamp_test_check(base, TRUE);
+
+		for (j = 0; j < STAMP_LENGTH; ++j) {
+			for (byte = 0; byte < 256; ++byte) {
+				memcpy(text, base, STAMP_SIZE);
+				text[j] = (char) byte;
+				failures += stamp_test_check(text, FALSE);
+			}
+		}
+	}
+
+	printf("%d stamps, %d failures\n", STAMP_TEST_BASES * (1 + STAMP_LENGTH * 256), failures);
+
+	return(0 == failures ? 0 : 1);
+}
+
+/******************************************************************* local definitions */
+
+int
+stamp_test_check(const char *text, BOOL valid)
+{
+	int64_t fast = 0, general = 0;
+	BOOL fast_ok, general_ok, zoned;
+
+	fast_ok = stamp_fast(text, &fast);
+	general_ok = stamp_general(text, STAMP_LENGTH, &general, &zoned);
+
+	if ((TRUE == valid && STAMP_SWAR && FALSE == fast_ok) ||
+	    (TRUE == fast_ok && (FALSE == general_ok || TRUE == zoned || fast != general))) {
+		fprintf(stderr, "Disagree on \"%.*s\": fast %d (%lld), general %d (%lld)\n",
+		        STAMP_LENGTH, text, fast_ok, (long long) fast, general_ok, (long long) general);
+		return(1);
+	}
+
+	return(0);
+}